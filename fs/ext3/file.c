@@ -26,6 +26,7 @@
 
 #include "xattr.h"
 #include "acl.h"
+#include "super.h"
 #include "namei.h"
 #include "yuiha.h"
 
@@ -37,6 +38,7 @@
 static int ext3_release_file (struct inode * inode, struct file * filp)
 {
 	struct yuiha_inode_info *yi;
+	struct inode *parent_inode;
 
 	if (EXT3_I(inode)->i_state & EXT3_STATE_FLUSH_ON_CLOSE) {
 		filemap_flush(inode->i_mapping);
@@ -54,11 +56,16 @@ static int ext3_release_file (struct inode * inode, struct file * filp)
 		ext3_htree_free_dir_info(filp->private_data);
 
 	// only yuihafs
+	if (!ext3_judge_yuiha(inode->i_sb))
+		return 0;
 	yi = YUIHA_I(inode);
-	if (yi->parent_inode) {
+	mutex_lock(&yi->i_share_mutex);
+	parent_inode = yi->parent_inode;
+	yi->parent_inode = NULL;
+	mutex_unlock(&yi->i_share_mutex);
+	if (parent_inode) {
 		ext3_debug("%lu", inode->i_ino);
-		iput(yi->parent_inode);
-		yi->parent_inode = NULL;
+		iput(parent_inode);
 	}
 
 	return 0;
@@ -80,21 +87,20 @@ static int yuiha_file_open(struct inode * inode, struct file *filp)
 static int yuiha_readversion(struct file *filp,
 			 void *buf, filldir_t filldir)
 {
-	struct inode *inode = filp->f_dentry->d_inode, *next_inode;
-	struct yuiha_inode_info *yi = YUIHA_I(inode), *next_yi;
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	struct yuiha_vnode vn;
 	unsigned int version_list_pos = (int)filp->private_data,
 							 ret = 0, error, type = 0;
 
 	// version_list_pos is initial position
 	if (!version_list_pos) {
 		type = DT_PARENT;
-		if (!(inode->i_flags & S_ROOT_VERSION)) {
-			next_inode = ilookup(inode->i_sb, yi->i_parent_ino);
-			if (!next_inode)
-				next_inode = ext3_iget(inode->i_sb, yi->i_parent_ino);
-			next_yi = YUIHA_I(next_inode);
+		if (!(inode->i_flags & S_ROOT_VERSION) && yi->i_parent_ino) {
+			if (yuiha_vtree_lookup(inode->i_sb, yi->i_parent_ino, &vn))
+				goto out;
 
-			if (next_inode->i_flags & S_ROOT_VERSION)
+			if (vn.flags & YUIHA_ROOT_VERSION_FL)
 				type |= DT_VROOT;
 
 			error = filldir(buf, "", 0, 0, yi->i_parent_ino, type);
@@ -102,7 +108,6 @@ static int yuiha_readversion(struct file *filp,
 				goto out;
 
 			ret++;
-			iput(next_inode);
 		}
 		version_list_pos = yi->i_child_ino;
 	}
@@ -113,19 +118,16 @@ static int yuiha_readversion(struct file *filp,
 	// if search child version inode
 	type = DT_CHILD;
 	do {
-		next_inode = ilookup(inode->i_sb, version_list_pos);
-		if (!next_inode)
-			next_inode = ext3_iget(inode->i_sb, version_list_pos);
-		next_yi = YUIHA_I(next_inode);
+		if (yuiha_vtree_lookup(inode->i_sb, version_list_pos, &vn))
+			break;
 
-		error = filldir(buf, "", 0, 0, next_inode->i_ino, type);
+		error = filldir(buf, "", 0, 0, vn.ino, type);
 		if (error)
 			break;
 
 		ret++;
-		version_list_pos = next_yi->i_sibling_next_ino;
-		iput(next_inode);
-	} while (yi->i_child_ino != version_list_pos);
+		version_list_pos = vn.sibling_next;
+	} while (version_list_pos && yi->i_child_ino != version_list_pos);
 	version_list_pos = 0;
 
 out:
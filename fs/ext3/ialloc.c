@@ -29,6 +29,7 @@
 #include "xattr.h"
 #include "acl.h"
 #include "super.h"
+#include "yuiha.h"
 
 /*
  * ialloc.c contains the inodes allocation and deallocation routines
@@ -51,8 +52,8 @@
  *
  * Return buffer_head of bitmap on success or NULL.
  */
-static struct buffer_head *
-read_inode_bitmap(struct super_block * sb, unsigned long block_group)
+struct buffer_head *
+ext3_read_inode_bitmap(struct super_block * sb, unsigned long block_group)
 {
 	struct ext3_group_desc *desc;
 	struct buffer_head *bh = NULL;
@@ -63,7 +64,7 @@ read_inode_bitmap(struct super_block * sb, unsigned long block_group)
 
 	bh = sb_bread(sb, le32_to_cpu(desc->bg_inode_bitmap));
 	if (!bh)
-		ext3_error(sb, "read_inode_bitmap",
+		ext3_error(sb, "ext3_read_inode_bitmap",
 			    "Cannot read inode bitmap - "
 			    "block_group = %lu, inode_bitmap = %u",
 			    block_group, le32_to_cpu(desc->bg_inode_bitmap));
@@ -120,6 +121,9 @@ void ext3_free_inode (handle_t *handle, struct inode * inode)
 	ino = inode->i_ino;
 	ext3_debug ("freeing inode %lu\n", ino);
 
+	if (ext3_judge_yuiha(sb))
+		yuiha_vtree_forget(sb, ino);
+
 	/*
 	 * Note: we must free any quota before locking the superblock,
 	 * as writing the quota to disk may need the lock as well.
@@ -142,7 +146,7 @@ void ext3_free_inode (handle_t *handle, struct inode * inode)
 	}
 	block_group = (ino - 1) / EXT3_INODES_PER_GROUP(sb);
 	bit = (ino - 1) % EXT3_INODES_PER_GROUP(sb);
-	bitmap_bh = read_inode_bitmap(sb, block_group);
+	bitmap_bh = ext3_read_inode_bitmap(sb, block_group);
 	if (!bitmap_bh)
 		goto error_return;
 
@@ -421,6 +425,12 @@ yuiha_set_tree_link_zero(struct yuiha_inode_info *yi)
 
 	yi->i_child_ino = 0;
 	yi->i_child_generation = 0;
+
+	yi->i_seq = 0;
+	yi->i_crtime = 0;
+	yi->i_origin_seq = 0;
+	yi->i_origin_crtime = 0;
+	yi->i_tags = 0;
 }
 /*
  * There are two policies for allocating an inode.  If the new inode is
@@ -491,7 +501,7 @@ struct inode *ext3_new_inode(handle_t *handle, struct inode * dir, int mode)
 			goto fail;
 
 		brelse(bitmap_bh);
-		bitmap_bh = read_inode_bitmap(sb, group);
+		bitmap_bh = ext3_read_inode_bitmap(sb, group);
 		if (!bitmap_bh)
 			goto fail;
 
@@ -613,6 +623,8 @@ got:
 	ei->i_extra_isize =
 		(EXT3_INODE_SIZE(inode->i_sb) > EXT3_GOOD_OLD_INODE_SIZE) ?
 		sizeof(struct ext3_inode) - EXT3_GOOD_OLD_INODE_SIZE : 0;
+	if (ei->i_extra_isize && ext3_judge_yuiha(sb))
+		ei->i_extra_isize = YUIHA_INODE_EXTRA_ISIZE;
 
 	ret = inode;
 	if (vfs_dq_alloc_inode(inode)) {
@@ -677,7 +689,7 @@ struct inode *ext3_orphan_get(struct super_block *sb, unsigned long ino)
 
 	block_group = (ino - 1) / EXT3_INODES_PER_GROUP(sb);
 	bit = (ino - 1) % EXT3_INODES_PER_GROUP(sb);
-	bitmap_bh = read_inode_bitmap(sb, block_group);
+	bitmap_bh = ext3_read_inode_bitmap(sb, block_group);
 	if (!bitmap_bh) {
 		ext3_warning(sb, __func__,
 			     "inode bitmap error for orphan %lu", ino);
@@ -755,7 +767,7 @@ unsigned long ext3_count_free_inodes (struct super_block * sb)
 			continue;
 		desc_count += le16_to_cpu(gdp->bg_free_inodes_count);
 		brelse(bitmap_bh);
-		bitmap_bh = read_inode_bitmap(sb, i);
+		bitmap_bh = ext3_read_inode_bitmap(sb, i);
 		if (!bitmap_bh)
 			continue;
 
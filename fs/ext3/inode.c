@@ -46,13 +46,43 @@
 
 #include <linux/journal-head.h>
 
+/*
+ * Children of a version being truncated.  Blocks the version produced are
+ * not released while a child still refers to them: with a single child the
+ * producer bit moves over to the child's pointer, with several children the
+ * block is kept and the version becomes a phantom.
+ *
+ * @refs lists the children whose tree still differs from ours at the level
+ * being cleared, together with the block that lines up with ours there (0
+ * for the child's i_data); index @start of that array matches the first
+ * pointer we clear.  A child whose pointer equals ours shares the whole
+ * subtree and is settled one level up, a child with a hole drops out, so
+ * the deep levels only see the children that copied-on-write there.
+ */
+struct sibling_ref {
+	struct inode *inode;
+	ext3_fsblk_t block;
+};
+
 struct sibling_datablock {
-	int count;
-	int phantom;
-	__le32 *first[10], *last[10];
+	int count;			// children of the version
+	int phantom;			// a shared block had to be kept
+	int frozen;			// a child maps the block being cleared
+	int versioned;			// producer bits tell which blocks are ours
+	int plain;			// every block mapped is ours, no bits yet
+	int refcount;			// the reference map tells it instead
+	int nr_refs;
+	int start;
+	struct sibling_ref *refs;	// room for count refs per tree level
+	unsigned long *shared;		// leaf offsets a child refers to as well
 };
 
+/* get_blocks @create: copy a shared block, but allocate none */
+#define YUIHA_CREATE_COW	2
+
 static int ext3_writepage_trans_blocks(struct inode *inode);
+static int yuiha_mark_branch(handle_t *handle, struct inode *inode,
+		ext3_fsblk_t block, int depth, int own);
 
 /*
  * Test whether an inode is a fast symlink.
@@ -212,6 +242,15 @@ void ext3_delete_inode (struct inode * inode)
 	if (is_bad_inode(inode))
 		goto no_delete;
 
+	// The top of a tree no name leads to takes its versions along.  While
+	// one is still in use it stays an orphan for the next mount.
+	if (yuiha_file(inode) && (EXT3_I(inode)->i_flags & YUIHA_TEARDOWN_FL) &&
+			!YUIHA_I(inode)->i_parent_ino &&
+			yuiha_teardown_tree(inode) < 0) {
+		ext3_orphan_del(NULL, inode);
+		goto no_delete;
+	}
+
 	handle = start_transaction(inode);
 	if (IS_ERR(handle)) {
 		/*
@@ -226,7 +265,11 @@ void ext3_delete_inode (struct inode * inode)
 	if (IS_SYNC(inode))
 		handle->h_sync = 1;
 	inode->i_size = 0;
-	if (inode->i_blocks)
+	// an empty version still has to leave its tree, as one a squash
+	// emptied before a crash
+	if (inode->i_blocks || (yuiha_file(inode) &&
+			(YUIHA_I(inode)->i_parent_ino ||
+			 YUIHA_I(inode)->i_child_ino)))
 		ext3_truncate(inode);
 	/*
 	 * Kill off the orphan record which ext3_truncate created.
@@ -276,18 +319,61 @@ static int verify_chain(Indirect *from, Indirect *to)
 	return (from > to);
 }
 
-static int yuiha_verify_chain(Indirect *from, Indirect *to)
+static int yuiha_verify_chain(struct super_block *sb, Indirect *from,
+		Indirect *to)
 {
-	__le32 from_p = cpu_to_le32(clear_producer_flg(le32_to_cpu(*from->p)));
+	__le32 producer = yuiha_producer_le(sb);
 
-	while (from <= to && from->key == from_p) {
+	while (from <= to && from->key == (*from->p & ~producer))
 		from++;
-		if (from <= to)
-			from_p = cpu_to_le32(clear_producer_flg(le32_to_cpu(*from->p)));
-	}
 	return (from > to);
 }
 
+/*
+ * Regular files of a yuiha mount, other than the journal and the block
+ * reference map.  Their block pointers may carry the producer bit,
+ * ext3_set_aops() gives them the yuiha address_space operations.
+ */
+int yuiha_file(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+
+	return ext3_judge_yuiha(sb) && S_ISREG(inode->i_mode) &&
+		le32_to_cpu(EXT3_SB(sb)->s_es->s_journal_inum) != inode->i_ino &&
+		le32_to_cpu(EXT3_SB(sb)->s_es->s_yuiha_refcount_inum) !=
+			inode->i_ino;
+}
+
+/*
+ * Regular files that have never been snapshotted carry YUIHA_PLAIN_FL.
+ * None of their block pointers has the producer bit and nothing of theirs
+ * can be shared, so they skip copy-on-write and the parent's pages.  The
+ * first snapshot hands the flag on to the new version: its unflagged
+ * pointers stay its own until truncate gives them to the child, see
+ * ext3_free_branches().
+ */
+int yuiha_versioned(struct inode *inode)
+{
+	return yuiha_file(inode) && !(EXT3_I(inode)->i_flags & YUIHA_PLAIN_FL);
+}
+
+/*
+ * Whether the stored pointer @v reaches a block no other version uses.
+ * The producer bit says so, or in the fulladdr format a zero count in the
+ * block reference map.  A hole is not owned.
+ */
+int yuiha_ptr_owned(struct super_block *sb, __le32 v)
+{
+	__le32 producer = yuiha_producer_le(sb);
+	u32 extra;
+
+	if (producer)
+		return (v & producer) != 0;
+	if (!v || yuiha_refcount_get(sb, le32_to_cpu(v), &extra))
+		return 0;
+	return !extra;
+}
+
 /**
  *	ext3_block_to_path - parse the block number into array of offsets
  *	@inode: inode in question (we are only interested in its superblock)
@@ -427,11 +513,9 @@ static Indirect *yuiha_get_branch(struct inode *inode, int depth,
 				int *offsets, Indirect chain[4], int *err, int *is_shared)
 {
 	struct super_block *sb = inode->i_sb;
-	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
+	__le32 producer = yuiha_producer_le(sb);
 	Indirect *p = chain;
 	struct buffer_head *bh;
-	int is_not_journal_file = es->s_journal_inum != inode->i_ino;
-	struct ext3_inode_info *ei = EXT3_I(inode);
 
 	ext3_debug("depth=%d", depth);
 
@@ -440,12 +524,9 @@ static Indirect *yuiha_get_branch(struct inode *inode, int depth,
 		*is_shared = 0;
 	/* i_data is not going away, no lock needed */
 	add_chain (chain, NULL, EXT3_I(inode)->i_data + *offsets);
-	if (S_ISREG(inode->i_mode) && is_not_journal_file) {
-		if (is_shared && !test_producer_flg(le32_to_cpu(chain->key)))
-			*is_shared = 1;
-
-		chain->key = cpu_to_le32(clear_producer_flg(le32_to_cpu(chain->key)));
-	}
+	if (is_shared && !yuiha_ptr_owned(sb, chain->key))
+		*is_shared = 1;
+	chain->key &= ~producer;
 	if (!p->key) {
 		ext3_debug("");
 		goto no_block;
@@ -458,20 +539,18 @@ static Indirect *yuiha_get_branch(struct inode *inode, int depth,
 			goto failure;
 		}
 		/* Reader: pointers */
-		if (!yuiha_verify_chain(chain, p)) {
+		if (!yuiha_verify_chain(sb, chain, p)) {
 			ext3_debug("");
 			goto changed;
 		}
 		add_chain(++p, bh, (__le32*)bh->b_data + *++offsets);
-		if (S_ISREG(inode->i_mode) && is_not_journal_file) {
-			if (!test_producer_flg(le32_to_cpu(p->key))) {
-				ext3_debug("");
-				set_buffer_shared(bh);
-				if (is_shared)
-					*is_shared = 1;
-			}
-			p->key = cpu_to_le32(clear_producer_flg(le32_to_cpu(p->key)));
+		// one shared level is enough, spare the map the rest
+		if (is_shared && !*is_shared && !yuiha_ptr_owned(sb, p->key)) {
+			ext3_debug("");
+			set_buffer_shared(bh);
+			*is_shared = 1;
 		}
+		p->key &= ~producer;
 		/* Reader: end */
 		if (!p->key) {
 			ext3_debug("");
@@ -673,6 +752,7 @@ failed_out:
  *	@blks: number of allocated direct blocks
  *	@offsets: offsets (in the blocks) to store the pointers to next.
  *	@branch: place to store the chain in.
+ *	@owner: or'ed into the stored pointers, the producer bit or 0
  *
  *	This function allocates blocks, zeroes out all but the last one,
  *	links them into chain and (if we are synchronous) writes them to disk.
@@ -693,7 +773,7 @@ failed_out:
  */
 static int ext3_alloc_branch(handle_t *handle, struct inode *inode,
 			int indirect_blks, int *blks, ext3_fsblk_t goal,
-			int *offsets, Indirect *branch)
+			int *offsets, Indirect *branch, __le32 owner)
 {
 	int blocksize = inode->i_sb->s_blocksize;
 	int i, n = 0;
@@ -702,9 +782,6 @@ static int ext3_alloc_branch(handle_t *handle, struct inode *inode,
 	int num;
 	ext3_fsblk_t new_blocks[4];
 	ext3_fsblk_t current_block;
-	struct super_block *sb = inode->i_sb;
-	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
-	int is_not_journal_file = es->s_journal_inum != inode->i_ino;
 
 	num = ext3_alloc_blocks(handle, inode, goal, indirect_blks,
 				*blks, new_blocks, &err);
@@ -735,11 +812,7 @@ static int ext3_alloc_branch(handle_t *handle, struct inode *inode,
 		memset(bh->b_data, 0, blocksize);
 		branch[n].p = (__le32 *) bh->b_data + offsets[n];
 		branch[n].key = cpu_to_le32(new_blocks[n]);
-		*branch[n].p = branch[n].key;
-		if (ext3_judge_yuiha(sb) && S_ISREG(inode->i_mode) && is_not_journal_file) {
-			//*branch[n].p = cpu_to_le32(set_producer_flg(new_blocks[n]));
-			*branch[n].p = cpu_to_le32(set_producer_flg(le32_to_cpu(*branch[n].p)));
-		}
+		*branch[n].p = branch[n].key | owner;
 
 		if ( n == indirect_blks) {
 			current_block = new_blocks[n];
@@ -749,7 +822,7 @@ static int ext3_alloc_branch(handle_t *handle, struct inode *inode,
 			 * data blocks numbers
 			 */
 			for (i=1; i < num; i++)
-				*(branch[n].p + i) = cpu_to_le32(set_producer_flg(++current_block));
+				*(branch[n].p + i) = cpu_to_le32(++current_block) | owner;
 		}
 		BUFFER_TRACE(bh, "marking uptodate");
 		set_buffer_uptodate(bh);
@@ -785,22 +858,20 @@ failed:
  * @where: location of missing link
  * @num:   number of indirect blocks we are adding
  * @blks:  number of direct blocks we are adding
+ * @owner: or'ed into the stored pointers, the producer bit or 0
  *
  * This function fills the missing link and does all housekeeping needed in
  * inode (->i_blocks, etc.). In case of success we end up with the full
  * chain to new block and return 0.
  */
 static int ext3_splice_branch(handle_t *handle, struct inode *inode,
-			long block, Indirect *where, int num, int blks)
+			long block, Indirect *where, int num, int blks, __le32 owner)
 {
 	int i;
 	int err = 0;
 	struct ext3_block_alloc_info *block_i;
 	ext3_fsblk_t current_block;
 	struct ext3_inode_info *ei = EXT3_I(inode);
-	struct super_block *sb = inode->i_sb;
-	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
-	int is_not_journal_file = es->s_journal_inum != inode->i_ino;
 
 	block_i = ei->i_block_alloc_info;
 	/*
@@ -816,10 +887,7 @@ static int ext3_splice_branch(handle_t *handle, struct inode *inode,
 	}
 	/* That's it */
 
-	if (ext3_judge_yuiha(sb) && S_ISREG(inode->i_mode) && is_not_journal_file)
-		*where->p = cpu_to_le32(set_producer_flg(le32_to_cpu(where->key)));
-	else
-		*where->p = where->key;
+	*where->p = where->key | owner;
 
 	/*
 	 * Update the host buffer_head or inode to point to more just allocated
@@ -827,13 +895,8 @@ static int ext3_splice_branch(handle_t *handle, struct inode *inode,
 	 */
 	if (num == 0 && blks > 1) {
 		current_block = le32_to_cpu(where->key) + 1;
-		for (i = 1; i < blks; i++) {
-			if (ext3_judge_yuiha(sb) && S_ISREG(inode->i_mode) && is_not_journal_file)
-				*(where->p + i ) = cpu_to_le32(set_producer_flg(current_block));
-			else
-				*(where->p + i ) = cpu_to_le32(current_block);
-			current_block++;
-		}
+		for (i = 1; i < blks; i++)
+			*(where->p + i ) = cpu_to_le32(current_block++) | owner;
 	}
 
 	/*
@@ -889,57 +952,451 @@ err_out:
 	return err;
 }
 
+/*
+ * Number of blocks yuiha_copy_blocks() moves per round of I/O.
+ */
+#define YUIHA_COW_BATCH	16
+
+static struct buffer_head *yuiha_alloc_copy_bh(struct super_block *sb)
+{
+	struct buffer_head *bh;
+	struct page *page;
+
+	bh = alloc_buffer_head(GFP_NOFS);
+	if (!bh)
+		return NULL;
+	page = alloc_page(GFP_NOFS);
+	if (!page) {
+		free_buffer_head(bh);
+		return NULL;
+	}
+	set_bh_page(bh, page, 0);
+	bh->b_size = sb->s_blocksize;
+	bh->b_bdev = sb->s_bdev;
+	set_buffer_mapped(bh);
+	return bh;
+}
+
+static void yuiha_free_copy_bh(struct buffer_head *bh)
+{
+	struct page *page = bh->b_page;
+
+	free_buffer_head(bh);
+	__free_page(page);
+}
+
+static int yuiha_copy_io(int rw, struct buffer_head **bhs, int nr)
+{
+	int i, err = 0;
+
+	for (i = 0; i < nr; i++) {
+		lock_buffer(bhs[i]);
+		get_bh(bhs[i]);
+		bhs[i]->b_end_io = rw == READ ?
+				end_buffer_read_sync : end_buffer_write_sync;
+		submit_bh(rw, bhs[i]);
+	}
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			err = -EIO;
+	}
+	return err;
+}
+
+/*
+ * Copy the old contents of the @nr blocks listed at @old_p into the new
+ * extent starting at @new_block.  The copies go straight to disk through
+ * private buffers: they are in place before the tree points at them, and
+ * no buffer-cache alias is left behind for a block that direct I/O is
+ * about to write.
+ */
+static int yuiha_copy_blocks(struct super_block *sb, __le32 *old_p,
+		ext3_fsblk_t new_block, int nr)
+{
+	struct buffer_head *bhs[YUIHA_COW_BATCH];
+	int i, n, done, err = 0;
+
+	for (done = 0; done < nr && !err; done += n) {
+		n = min(nr - done, YUIHA_COW_BATCH);
+		for (i = 0; i < n; i++) {
+			bhs[i] = yuiha_alloc_copy_bh(sb);
+			if (!bhs[i]) {
+				err = -ENOMEM;
+				break;
+			}
+			bhs[i]->b_blocknr = yuiha_block_nr(sb, old_p[done + i]);
+		}
+		n = i;
+
+		if (!err)
+			err = yuiha_copy_io(READ, bhs, n);
+		if (!err) {
+			for (i = 0; i < n; i++)
+				bhs[i]->b_blocknr = new_block + done + i;
+			err = yuiha_copy_io(WRITE, bhs, n);
+		}
+
+		for (i = 0; i < n; i++)
+			yuiha_free_copy_bh(bhs[i]);
+	}
+	return err;
+}
+
+/*
+ * Whether logical block @iblock has a page in the page cache.  Its
+ * buffers still point at the shared block, so the block is left to the
+ * write path that owns the page.
+ */
+static int yuiha_block_cached(struct inode *inode, sector_t iblock)
+{
+	struct page *page;
+
+	page = find_get_page(inode->i_mapping,
+			iblock >> (PAGE_CACHE_SHIFT - inode->i_blkbits));
+	if (!page)
+		return 0;
+	page_cache_release(page);
+	return 1;
+}
+
+/*
+ * Take over the block behind @chain[@level] instead of copying it: the
+ * reference map says nobody else refers to it.  An indirect block keeps
+ * its pointers but drops their producer bits, the blocks below are looked
+ * at again one by one.  Without producer bits the count is all it takes.
+ */
+static int yuiha_cow_claim(handle_t *handle, struct inode *inode,
+		Indirect chain[4], int level, int depth)
+{
+	Indirect *ind = chain + level;
+	struct buffer_head *bh;
+	__le32 *p;
+	int i, err;
+
+	if (!yuiha_producer_le(inode->i_sb))
+		return 0;
+
+	if (level < depth - 1) {
+		bh = chain[level + 1].bh;
+		BUFFER_TRACE(bh, "get_write_access");
+		err = ext3_journal_get_write_access(handle, bh);
+		if (err)
+			return err;
+		p = (__le32 *)bh->b_data;
+		for (i = 0; i < EXT3_ADDR_PER_BLOCK(inode->i_sb); i++)
+			p[i] &= ~PRODUCER_FLG_LE;
+		err = ext3_journal_dirty_metadata(handle, bh);
+		if (err)
+			return err;
+	}
+
+	if (!ind->bh) {
+		*ind->p |= PRODUCER_FLG_LE;
+		return ext3_mark_inode_dirty(handle, inode);
+	}
+	BUFFER_TRACE(ind->bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, ind->bh);
+	if (err)
+		return err;
+	*ind->p |= PRODUCER_FLG_LE;
+	return ext3_journal_dirty_metadata(handle, ind->bh);
+}
+
+/*
+ * Journal credits for the reference map updates of a copy-on-write: the
+ * copies of the indirect blocks below @top refer to everything the
+ * originals do, and the old blocks at the top lose a reference.
+ */
+static int yuiha_cow_credits(struct super_block *sb, Indirect chain[4],
+		int top, int depth, __le32 *old_p, int count)
+{
+	int i, credits;
+
+	// a data block may have to be freed
+	if (top == depth - 1)
+		return yuiha_refcount_credits(sb, old_p, count) + 2;
+
+	credits = yuiha_refcount_credits(sb, &chain[top].key, 1);
+	for (i = top + 1; i < depth; i++)
+		credits += yuiha_refcount_credits(sb,
+				(__le32 *)chain[i].bh->b_data,
+				EXT3_ADDR_PER_BLOCK(sb));
+	return credits;
+}
+
+/*
+ * Move the references from the old blocks at the top of a copy-on-write
+ * to the copies.  Every block the new indirect blocks point at gains one,
+ * apart from the ones on the path that are replaced by copies: the old
+ * top block loses one, or the old data blocks of the run do.  A data
+ * block that has lost its other users meanwhile is freed.  Called with
+ * the map locked.
+ */
+static int yuiha_cow_refcount(handle_t *handle, struct inode *inode,
+		Indirect chain[4], Indirect cow_chain[4], int offsets[4], int top,
+		int depth, __le32 *old_p, int count)
+{
+	struct super_block *sb = inode->i_sb;
+	int addr_per_block = EXT3_ADDR_PER_BLOCK(sb);
+	__le32 *p;
+	int i, j, skip, err;
+	u32 extra;
+
+	for (i = top + 1; i < depth; i++) {
+		p = (__le32 *)cow_chain[i].bh->b_data;
+		skip = i == depth - 1 ? count : 1;
+		err = yuiha_refcount_add(handle, sb, p, offsets[i], 1);
+		if (!err)
+			err = yuiha_refcount_add(handle, sb, p + offsets[i] + skip,
+					addr_per_block - offsets[i] - skip, 1);
+		if (err)
+			return err;
+	}
+
+	if (top < depth - 1)
+		return yuiha_refcount_add(handle, sb, &chain[top].key, 1, -1);
+
+	for (j = 0; j < count; j++) {
+		err = yuiha_refcount_get(sb, yuiha_block_nr(sb, old_p[j]),
+				&extra);
+		if (err)
+			return err;
+		if (extra)
+			err = yuiha_refcount_add(handle, sb, old_p + j, 1, -1);
+		else
+			ext3_free_blocks(handle, inode,
+					yuiha_block_nr(sb, old_p[j]), 1);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * The blocks from @iblock on, of the @count being copied, that the direct
+ * write in flight overwrites completely, as [*@from, *@to) counted from
+ * @iblock.  Both are @count when there are none.
+ */
+static void yuiha_dio_overwrite(struct inode *inode,
+		struct buffer_head *bh_result, sector_t iblock, int count,
+		int *from, int *to)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	unsigned bits = inode->i_blkbits;
+	sector_t first, end;
+
+	*from = *to = count;
+	// only direct I/O maps into a buffer without a page while it runs
+	if (bh_result->b_page || yi->i_dio_end <= yi->i_dio_start)
+		return;
+	first = (yi->i_dio_start + (1 << bits) - 1) >> bits;
+	end = yi->i_dio_end >> bits;
+	if (first < iblock)
+		first = iblock;
+	if (end > iblock + count)
+		end = iblock + count;
+	if (first < end) {
+		*from = first - iblock;
+		*to = end - iblock;
+	}
+}
+
+/*
+ * Blocks [@start, @end) were copied-on-write without their old data.
+ * The direct write maps in ascending order, so one range covers them.
+ */
+static void yuiha_dio_nocopy(struct inode *inode, sector_t start,
+		sector_t end)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+
+	if (yi->i_dio_nocopy_end == yi->i_dio_nocopy_start)
+		yi->i_dio_nocopy_start = start;
+	yi->i_dio_nocopy_end = end;
+}
+
+/*
+ * Copy-on-write the shared run of blocks starting at @iblock.
+ *
+ * The topmost shared level of @chain and everything below it get private
+ * copies.  A single ext3_alloc_branch() call allocates the new indirect
+ * blocks together with one extent for the whole run of shared pointers
+ * following @iblock in the leaf, up to @maxblocks and the end of the leaf
+ * block.  The run stops at holes, at blocks we own already and at blocks
+ * with a page in the page cache.  The new indirect blocks take over the
+ * old pointers as shared ones, and the run is spliced in with one update
+ * of the level above.
+ *
+ * With the reference map, a block nobody else refers to any more is
+ * claimed instead of copied, and the run stops before such a block.
+ *
+ * Returns the number of blocks now owned at @iblock, 0 if nothing is
+ * shared any more, or a negative errno.  -EAGAIN means that the chain
+ * changed before truncate_mutex was taken, or was changed by a claim, and
+ * has to be read again.
+ */
 static int yuiha_cow_datablock(handle_t *handle, struct inode *inode,
 				sector_t iblock, unsigned long maxblocks, int blocks_to_boundary,
 				int depth, int offsets[4], Indirect chain[4],
 				struct buffer_head *bh_result)
 {
-	int cow_ind_offset, ncow, i, j,
-		indirect_blks, err = -EIO, cow_depth = depth;
-	Indirect cow_chain[4] = {0};
-	Indirect *partial, *cow_partial;
-	ext3_fsblk_t goal;
+	struct ext3_inode_info *ei = EXT3_I(inode);
 	struct super_block *sb = inode->i_sb;
+	int addr_per_block = EXT3_ADDR_PER_BLOCK(sb);
+	Indirect cow_chain[4] = {{0}};
+	Indirect *cow_partial;
+	__le32 *old_p, *key_p;
+	ext3_fsblk_t goal, new_block, old_block;
+	int cow_ind_offset, indirect_blks, count, copy_from, i, j, err;
+	int skip_from, skip_to;
+	int refcount = yuiha_refcount_enabled(sb), claim = 0, credits;
+	__le32 producer = yuiha_producer_le(sb);
+	u32 extra;
 
-	while (cow_depth) {
-		cow_ind_offset = depth - cow_depth;
-		cow_chain[cow_ind_offset].p = chain[cow_ind_offset].p;
-		cow_chain[cow_ind_offset].key = chain[cow_ind_offset].key;
+	mutex_lock(&ei->truncate_mutex);
+	err = -EAGAIN;
+	if (!yuiha_verify_chain(sb, chain, chain + depth - 1))
+		goto out;
 
-		if (!test_producer_flg(le32_to_cpu(*chain[cow_ind_offset].p)))
+	for (cow_ind_offset = 0; cow_ind_offset < depth; cow_ind_offset++) {
+		if (!yuiha_ptr_owned(sb, *chain[cow_ind_offset].p))
 			break;
-
-		cow_depth--;
 	}
 
 	// All data block producer flag is allocated
 	// including indirect block.
-	ext3_debug("");
-	if (!cow_depth)
-		return 0;
-	ext3_debug("");
+	err = 0;
+	if (cow_ind_offset == depth)
+		goto out;
 
-	partial = &chain[cow_ind_offset];
+	for (i = 0; i <= cow_ind_offset; i++)
+		cow_chain[i] = chain[i];
 	cow_partial = &cow_chain[cow_ind_offset];
-	indirect_blks = (chain + depth) - partial - 1;
-	// ncow = ext3_blks_to_allocate(cow_partial, indirect_blks,
-	// 				maxblocks, blocks_to_boundary);
-	ncow = depth - cow_ind_offset;
-	ext3_debug("indirect_blks=%d,ncow=%d,depth=%d,cow_ind_offset=%d,maxblocks%ld",
-			indirect_blks, ncow, depth, cow_ind_offset, maxblocks);
+	indirect_blks = depth - cow_ind_offset - 1;
+
+	// Below a shared indirect block every pointer is shared.
+	old_p = chain[depth - 1].p;
+	old_block = le32_to_cpu(chain[depth - 1].key);
+	count = 1;
+	while (count < maxblocks && count <= blocks_to_boundary) {
+		if (!old_p[count] ||
+		    (!indirect_blks && yuiha_ptr_owned(sb, old_p[count])))
+			break;
+		if (yuiha_block_cached(inode, iblock + count))
+			break;
+		count++;
+	}
+	ext3_debug("indirect_blks=%d,count=%d,depth=%d,cow_ind_offset=%d,maxblocks%ld",
+			indirect_blks, count, depth, cow_ind_offset, maxblocks);
+
+	if (refcount) {
+		// A count of 0 cannot go up behind our back: we are the
+		// only ones who could share the block.
+		err = yuiha_refcount_get(sb,
+				le32_to_cpu(chain[cow_ind_offset].key), &extra);
+		if (!err && !extra) {
+			err = yuiha_cow_claim(handle, inode, chain,
+					cow_ind_offset, depth);
+			if (!err)
+				err = -EAGAIN;
+		}
+		// without producer bits the run above stopped there already
+		for (j = 1; !err && !indirect_blks && producer && j < count;
+				j++) {
+			err = yuiha_refcount_get(sb, yuiha_block_nr(sb, old_p[j]),
+					&extra);
+			if (!err && !extra)
+				count = j;
+		}
+		if (err)
+			goto out;
+
+		credits = yuiha_cow_credits(sb, chain, cow_ind_offset, depth,
+				old_p, count);
+		err = ext3_journal_extend(handle, credits);
+		if (err > 0) {
+			mutex_unlock(&ei->truncate_mutex);
+			err = ext3_journal_restart(handle,
+					credits + ext3_writepage_trans_blocks(inode));
+			return err ? err : -EAGAIN;
+		}
+		if (err)
+			goto out;
+	}
 
+	if (!ei->i_block_alloc_info)
+		ext3_init_block_alloc_info(inode);
 	goal = ext3_find_goal(inode, iblock, cow_partial);
 	err = ext3_alloc_branch(handle, inode, indirect_blks,
-					&ncow, goal,
-					offsets + cow_ind_offset, cow_partial);
+					&count, goal,
+					offsets + cow_ind_offset, cow_partial, producer);
 	if (err)
-		return err;
+		goto out;
+	new_block = le32_to_cpu(cow_chain[depth - 1].key);
+
+	// A page-cache buffer carries the old data of the first block itself,
+	// a direct write the blocks it covers completely.
+	copy_from = bh_result->b_page ? 1 : 0;
+	yuiha_dio_overwrite(inode, bh_result, iblock, count, &skip_from,
+			&skip_to);
+	if (skip_from > copy_from)
+		err = yuiha_copy_blocks(sb, old_p + copy_from,
+				new_block + copy_from, skip_from - copy_from);
+	if (!err && count > skip_to)
+		err = yuiha_copy_blocks(sb, old_p + skip_to, new_block + skip_to,
+				count - skip_to);
+	if (err)
+		goto free_branch;
+
+	// copy indirect
+	for (i = cow_ind_offset + 1; i < depth; i++) {
+		key_p = (__le32 *)cow_chain[i].bh->b_data;
+		memcpy(key_p, chain[i].bh->b_data, cow_chain[i].bh->b_size);
+		for (j = 0; j < addr_per_block; j++)
+			key_p[j] &= ~producer;
+
+		if (i == depth - 1) {
+			for (j = 0; j < count; j++)
+				cow_chain[i].p[j] =
+					cpu_to_le32(new_block + j) | producer;
+		} else {
+			*cow_chain[i].p = cow_chain[i].key | producer;
+		}
+		ext3_journal_dirty_metadata(handle, cow_chain[i].bh);
+	}
+
+	if (refcount) {
+		yuiha_refcount_lock(sb);
+		err = yuiha_refcount_get(sb,
+				le32_to_cpu(chain[cow_ind_offset].key), &extra);
+		if (!err && !extra && indirect_blks) {
+			// the other users went away while we were copying
+			yuiha_refcount_unlock(sb);
+			claim = 1;
+			goto free_branch;
+		}
+		if (!err)
+			err = yuiha_cow_refcount(handle, inode, chain, cow_chain,
+					offsets, cow_ind_offset, depth, old_p, count);
+		yuiha_refcount_unlock(sb);
+		if (err)
+			goto free_branch;
+	}
 
-	ext3_splice_branch(handle, inode, iblock, cow_partial,
-					indirect_blks, ncow);
+	err = ext3_splice_branch(handle, inode, iblock, cow_partial,
+					indirect_blks, count, producer);
+	if (err)
+		goto out;
+	if (skip_to > skip_from)
+		yuiha_dio_nocopy(inode, iblock + skip_from, iblock + skip_to);
 
-	if (!buffer_uptodate(bh_result)) {
-		map_bh(bh_result, sb, le32_to_cpu(chain[depth-1].key));
+	// A buffer the writer overwrites completely needs no old data.
+	if (bh_result->b_page && !buffer_uptodate(bh_result) &&
+			buffer_overwrite(bh_result)) {
+		clear_buffer_mapped(bh_result);
+	} else if (bh_result->b_page && !buffer_uptodate(bh_result)) {
+		map_bh(bh_result, sb, old_block);
 		ll_rw_block(READ, 1, &bh_result);
 		wait_on_buffer(bh_result);
 		clear_buffer_mapped(bh_result);
@@ -948,37 +1405,29 @@ static int yuiha_cow_datablock(handle_t *handle, struct inode *inode,
 		set_buffer_shared(bh_result);
 	}
 
-	// copy indirect
-	*cow_chain[cow_ind_offset].p = 
-		cpu_to_le32(set_producer_flg(le32_to_cpu(*cow_chain[cow_ind_offset].p)));
+	chain[cow_ind_offset].key = cow_chain[cow_ind_offset].key;
 	for (i = cow_ind_offset + 1; i < depth; i++) {
-		__le32 bn = *cow_chain[i].p;
-		memcpy(cow_chain[i].bh->b_data, chain[i].bh->b_data,
-						cow_chain[i].bh->b_size);
-
-		ext3_debug("");
-		__le32 *key_p = cow_chain[i].bh->b_data;
-		for(j = 0; j < EXT3_ADDR_PER_BLOCK(sb); j++) {
-			*key_p = cpu_to_le32(clear_producer_flg(le32_to_cpu(*key_p)));
-			key_p++;
-		}
-
-		*cow_chain[i].p = bn;
-		ext3_debug("");
-		ext3_journal_dirty_metadata(handle, cow_chain[i].bh);
-	}
-
-	for (i = cow_ind_offset; i < depth; i++) {
-		if (!i) {
-			chain[i] = cow_chain[i];
-			continue;
-		}
-		//ext3_journal_dirty_metadata(handle, chain[i].bh);
 		brelse(chain[i].bh);
 		chain[i] = cow_chain[i];
 	}
-
+	err = count;
+out:
+	mutex_unlock(&ei->truncate_mutex);
 	return err;
+
+free_branch:
+	for (i = 1; i <= indirect_blks; i++) {
+		BUFFER_TRACE(cow_partial[i].bh, "call journal_forget");
+		ext3_journal_forget(handle, cow_partial[i].bh);
+		ext3_free_blocks(handle, inode, le32_to_cpu(cow_partial[i-1].key), 1);
+	}
+	ext3_free_blocks(handle, inode, new_block, count);
+	if (claim) {
+		err = yuiha_cow_claim(handle, inode, chain, cow_ind_offset, depth);
+		if (!err)
+			err = -EAGAIN;
+	}
+	goto out;
 }
 
 /*
@@ -1016,10 +1465,6 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 	struct ext3_inode_info *ei = EXT3_I(inode);
 	int count = 0;
 	ext3_fsblk_t first_block = 0;
-	struct super_block *sb = inode->i_sb;
-	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
-	int is_not_journal_file = es->s_journal_inum != inode->i_ino,
-			is_shared = 0;
 
 	J_ASSERT(handle != NULL || create == 0);
 	depth = ext3_block_to_path(inode,iblock,offsets,&blocks_to_boundary);
@@ -1027,32 +1472,10 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 	if (depth == 0)
 		goto out;
 
-	if (ext3_judge_yuiha(sb) && S_ISREG(inode->i_mode) && is_not_journal_file) {
-		partial = yuiha_get_branch(inode, depth, offsets, chain, &err, &is_shared);
-	} else {
-		partial = ext3_get_branch(inode, depth, offsets, chain, &err);
-	}
-
+	partial = ext3_get_branch(inode, depth, offsets, chain, &err);
 
-	ext3_debug("iblock=%d", iblock);
 	/* Simplest case - block found, no allocation needed */
 	if (!partial) {
-		ext3_debug("");
-		if (ext3_judge_yuiha(sb) && create &&
-				S_ISREG(inode->i_mode) && is_not_journal_file && is_shared) {
-			ext3_debug("");
-			yuiha_cow_datablock(handle, inode, iblock, maxblocks,
-							blocks_to_boundary, depth, offsets, chain, bh_result); 
-		}
-
-		if (ext3_judge_yuiha(sb) && !create
-				&& S_ISREG(inode->i_mode) && is_not_journal_file) {
-			if (!test_producer_flg(*chain[depth - 1].p)) {
-				SetPageShared(bh_result->b_page);
-				ext3_debug();
-			}
-		}
-
 		first_block = le32_to_cpu(chain[depth - 1].key);
 		clear_buffer_new(bh_result);
 		count++;
@@ -1060,7 +1483,7 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 		while (count < maxblocks && count <= blocks_to_boundary) {
 			ext3_fsblk_t blk;
 
-			if (!yuiha_verify_chain(chain, chain + depth - 1)) {
+			if (!verify_chain(chain, chain + depth - 1)) {
 				/*
 				 * Indirect block might be removed by
 				 * truncate while we were reading it.
@@ -1072,7 +1495,7 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 				count = 0;
 				break;
 			}
-			blk = le32_to_cpu(clear_producer_flg(*(chain[depth-1].p + count)));
+			blk = le32_to_cpu(*(chain[depth-1].p + count));
 
 			if (blk == first_block + count)
 				count++;
@@ -1083,8 +1506,6 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 			goto got_it;
 	}
 
-	ext3_debug("");
-
 	/* Next simple case - plain lookup or failed read of indirect block */
 	if (!create || err == -EIO)
 		goto cleanup;
@@ -1103,17 +1524,12 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 	 * at this point, we will have the current copy of the chain when we
 	 * splice the branch into the tree.
 	 */
-	if (err == -EAGAIN || !yuiha_verify_chain(chain, partial)) {
+	if (err == -EAGAIN || !verify_chain(chain, partial)) {
 		while (partial > chain) {
 			brelse(partial->bh);
 			partial--;
 		}
-
-		if (ext3_judge_yuiha(sb) && S_ISREG(inode->i_mode) && is_not_journal_file)
-			partial = yuiha_get_branch(inode, depth, offsets, chain, &err, NULL);
-		else
-			partial = ext3_get_branch(inode, depth, offsets, chain, &err);
-
+		partial = ext3_get_branch(inode, depth, offsets, chain, &err);
 		if (!partial) {
 			count++;
 			mutex_unlock(&ei->truncate_mutex);
@@ -1124,7 +1540,6 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 		}
 	}
 
-	ext3_debug("");
 	/*
 	 * Okay, we need to do block allocation.  Lazily initialize the block
 	 * allocation info here if necessary
@@ -1147,7 +1562,7 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 	 * Block out ext3_truncate while we alter the tree
 	 */
 	err = ext3_alloc_branch(handle, inode, indirect_blks, &count, goal,
-				offsets + (partial - chain), partial);
+				offsets + (partial - chain), partial, 0);
 
 	/*
 	 * The ext3_splice_branch call will free and forget any buffers
@@ -1158,7 +1573,7 @@ int ext3_get_blocks_handle(handle_t *handle, struct inode *inode,
 	 */
 	if (!err)
 		err = ext3_splice_branch(handle, inode, iblock,
-					partial, indirect_blks, count);
+					partial, indirect_blks, count, 0);
 	mutex_unlock(&ei->truncate_mutex);
 	if (err)
 		goto cleanup;
@@ -1182,21 +1597,189 @@ out:
 	return err;
 }
 
-/* Maximum number of blocks we map for direct IO at once. */
-#define DIO_MAX_BLOCKS 4096
 /*
- * Number of credits we need for writing DIO_MAX_BLOCKS:
- * We need sb + group descriptor + bitmap + inode -> 4
- * For B blocks with A block pointers per block we need:
- * 1 (triple ind.) + (B/A/A + 2) (doubly ind.) + (B/A + 2) (indirect).
- * If we plug in 4096 for B and 256 for A (for 1KB block size), we get 25.
+ * ext3_get_blocks_handle() for yuiha_file() inodes.  The producer bits
+ * are masked out of the chain, a shared block is copied before it is
+ * written and new pointers get the bit.  Whether the inode can share
+ * anything is decided once per call, a plain file never has a shared
+ * block.  The bits are masked even then: the first snapshot may clear
+ * YUIHA_PLAIN_FL under a lookup.  New pointers go by the flag as it is
+ * under truncate_mutex, which the snapshot holds to clear it.
  */
-#define DIO_CREDITS 25
-
-static int ext3_get_block(struct inode *inode, sector_t iblock,
-			struct buffer_head *bh_result, int create)
+static int yuiha_get_blocks_handle(handle_t *handle, struct inode *inode,
+		sector_t iblock, unsigned long maxblocks,
+		struct buffer_head *bh_result,
+		int create)
 {
-	handle_t *handle = ext3_journal_current_handle();
+	int err = -EIO;
+	int offsets[4] = {0};
+	Indirect chain[4] = {0};
+	Indirect *partial;
+	ext3_fsblk_t goal;
+	int indirect_blks;
+	int blocks_to_boundary = 0;
+	int depth;
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	int count = 0;
+	ext3_fsblk_t first_block = 0;
+	int versioned = !(ei->i_flags & YUIHA_PLAIN_FL), is_shared = 0;
+	__le32 producer = yuiha_producer_le(inode->i_sb);
+	__le32 owner;
+	// a written block has to be ours already to be mapped along
+	__le32 need = versioned && create ? producer : 0;
+	int need_map = versioned && create && !producer;
+	__le32 *leaf;
+
+	J_ASSERT(handle != NULL || create == 0);
+	depth = ext3_block_to_path(inode,iblock,offsets,&blocks_to_boundary);
+
+	if (depth == 0)
+		goto out;
+
+reread:
+	partial = yuiha_get_branch(inode, depth, offsets, chain, &err,
+			versioned ? &is_shared : NULL);
+
+	ext3_debug("iblock=%d", iblock);
+	/* Simplest case - block found, no allocation needed */
+	if (!partial) {
+		if (create && is_shared) {
+			err = yuiha_cow_datablock(handle, inode, iblock, maxblocks,
+							blocks_to_boundary, depth, offsets, chain, bh_result);
+			if (err == -EAGAIN) {
+				for (partial = chain + depth - 1; partial > chain; partial--)
+					brelse(partial->bh);
+				goto reread;
+			}
+			if (err < 0) {
+				partial = chain + depth - 1;
+				goto cleanup;
+			}
+			if (err > 0) {
+				// never map past the blocks the COW made ours
+				count = err;
+				clear_buffer_new(bh_result);
+				goto got_it;
+			}
+		}
+
+		leaf = chain[depth - 1].p;
+		// direct I/O and ext3_getblk() map into a buffer without a page
+		if (versioned && !create && bh_result->b_page && is_shared)
+			SetPageShared(bh_result->b_page);
+
+		first_block = le32_to_cpu(chain[depth - 1].key);
+		clear_buffer_new(bh_result);
+		count++;
+		/*map more blocks*/
+		while (count < maxblocks && count <= blocks_to_boundary) {
+			if (!yuiha_verify_chain(inode->i_sb, chain,
+						chain + depth - 1)) {
+				/*
+				 * Indirect block might be removed by
+				 * truncate while we were reading it.
+				 * Handling of that case: forget what we've
+				 * got now. Flag the err as EAGAIN, so it
+				 * will reread.
+				 */
+				err = -EAGAIN;
+				count = 0;
+				break;
+			}
+
+			if ((leaf[count] & (~producer | need)) !=
+					(cpu_to_le32(first_block + count) | need))
+				break;
+			// without producer bits the map has to say so
+			if (need_map && !yuiha_ptr_owned(inode->i_sb,
+						leaf[count]))
+				break;
+			count++;
+		}
+		if (err != -EAGAIN)
+			goto got_it;
+	}
+
+	/* Next simple case - plain lookup or failed read of indirect block */
+	if (!create || create == YUIHA_CREATE_COW || err == -EIO)
+		goto cleanup;
+
+	mutex_lock(&ei->truncate_mutex);
+	owner = ei->i_flags & YUIHA_PLAIN_FL ? 0 : producer;
+
+	// See ext3_get_blocks_handle().
+	if (err == -EAGAIN || !yuiha_verify_chain(inode->i_sb, chain,
+				partial)) {
+		while (partial > chain) {
+			brelse(partial->bh);
+			partial--;
+		}
+		partial = yuiha_get_branch(inode, depth, offsets, chain, &err, NULL);
+		if (!partial) {
+			count++;
+			mutex_unlock(&ei->truncate_mutex);
+			if (err)
+				goto cleanup;
+			clear_buffer_new(bh_result);
+			goto got_it;
+		}
+	}
+
+	if (!ei->i_block_alloc_info)
+		ext3_init_block_alloc_info(inode);
+
+	goal = ext3_find_goal(inode, iblock, partial);
+
+	/* the number of blocks need to allocate for [d,t]indirect blocks */
+	indirect_blks = (chain + depth) - partial - 1;
+
+	count = ext3_blks_to_allocate(partial, indirect_blks,
+					maxblocks, blocks_to_boundary);
+	err = ext3_alloc_branch(handle, inode, indirect_blks, &count, goal,
+				offsets + (partial - chain), partial, owner);
+	if (!err)
+		err = ext3_splice_branch(handle, inode, iblock,
+					partial, indirect_blks, count, owner);
+	mutex_unlock(&ei->truncate_mutex);
+	if (err)
+		goto cleanup;
+
+	set_buffer_new(bh_result);
+got_it:
+	map_bh(bh_result, inode->i_sb, le32_to_cpu(chain[depth-1].key));
+	if (count > blocks_to_boundary)
+		set_buffer_boundary(bh_result);
+	err = count;
+	/* Clean up and exit */
+	partial = chain + depth - 1;	/* the whole chain */
+cleanup:
+	while (partial > chain) {
+		BUFFER_TRACE(partial->bh, "call brelse");
+		brelse(partial->bh);
+		partial--;
+	}
+	BUFFER_TRACE(bh_result, "returned");
+out:
+	return err;
+}
+
+/* Maximum number of blocks we map for direct IO at once. */
+#define DIO_MAX_BLOCKS 4096
+/*
+ * Number of credits we need for writing DIO_MAX_BLOCKS:
+ * We need sb + group descriptor + bitmap + inode -> 4
+ * For B blocks with A block pointers per block we need:
+ * 1 (triple ind.) + (B/A/A + 2) (doubly ind.) + (B/A + 2) (indirect).
+ * If we plug in 4096 for B and 256 for A (for 1KB block size), we get 25.
+ */
+#define DIO_CREDITS 25
+
+static int __ext3_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create,
+			int (*get_blocks)(handle_t *, struct inode *, sector_t,
+				unsigned long, struct buffer_head *, int))
+{
+	handle_t *handle = ext3_journal_current_handle();
 	int ret = 0, started = 0;
 	unsigned max_blocks = bh_result->b_size >> inode->i_blkbits;
 	ext3_debug("");
@@ -1213,8 +1796,7 @@ static int ext3_get_block(struct inode *inode, sector_t iblock,
 		started = 1;
 	}
 
-	ret = ext3_get_blocks_handle(handle, inode, iblock,
-					max_blocks, bh_result, create);
+	ret = get_blocks(handle, inode, iblock, max_blocks, bh_result, create);
 	if (ret > 0) {
 		bh_result->b_size = (ret << inode->i_blkbits);
 		ret = 0;
@@ -1225,11 +1807,38 @@ out:
 	return ret;
 }
 
+static int ext3_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	return __ext3_get_block(inode, iblock, bh_result, create,
+			ext3_get_blocks_handle);
+}
+
+static int yuiha_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	return __ext3_get_block(inode, iblock, bh_result, create,
+			yuiha_get_blocks_handle);
+}
+
+/*
+ * Direct writes inside i_size ask without create, see get_more_blocks(),
+ * and have holes there go through the page cache.  A shared block still
+ * has to be copied before it is written.
+ */
+static int yuiha_dio_write_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	return __ext3_get_block(inode, iblock, bh_result,
+			create ? create : YUIHA_CREATE_COW,
+			yuiha_get_blocks_handle);
+}
+
 int ext3_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		u64 start, u64 len)
 {
 	return generic_block_fiemap(inode, fieinfo, start, len,
-						ext3_get_block);
+			yuiha_file(inode) ? yuiha_get_block : ext3_get_block);
 }
 
 /*
@@ -1245,9 +1854,15 @@ struct buffer_head *ext3_getblk(handle_t *handle, struct inode *inode,
 
 	dummy.b_state = 0;
 	dummy.b_blocknr = -1000;
+	dummy.b_page = NULL;
 	buffer_trace_init(&dummy.b_history);
-	err = ext3_get_blocks_handle(handle, inode, block, 1,
-					&dummy, create);
+	// quota files are regular files too
+	if (yuiha_file(inode))
+		err = yuiha_get_blocks_handle(handle, inode, block, 1,
+						&dummy, create);
+	else
+		err = ext3_get_blocks_handle(handle, inode, block, 1,
+						&dummy, create);
 	/*
 	 * ext3_get_blocks_handle() returns number of blocks
 	 * mapped. 0 in case of a HOLE.
@@ -1386,9 +2001,13 @@ static int do_journal_get_write_access(handle_t *handle,
 	return ext3_journal_get_write_access(handle, bh);
 }
 
-static int ext3_write_begin(struct file *file, struct address_space *mapping,
+static int __ext3_write_begin(struct file *file, struct address_space *mapping,
 				loff_t pos, unsigned len, unsigned flags,
-				struct page **pagep, void **fsdata)
+				struct page **pagep, void **fsdata,
+				int (*prepare)(struct file *, struct address_space *,
+					loff_t, unsigned, unsigned, struct page **,
+					void **, get_block_t *),
+				get_block_t *get_block)
 {
 	struct inode *inode = mapping->host;
 	int ret;
@@ -1397,7 +2016,6 @@ static int ext3_write_begin(struct file *file, struct address_space *mapping,
 	struct page *page;
 	pgoff_t index;
 	unsigned from, to;
-	struct super_block *sb = inode->i_sb;
 	/* Reserve one block more for addition to orphan list in case
 	 * we allocate blocks but write fails for some reason */
 	int needed_blocks = ext3_writepage_trans_blocks(inode) + 1;
@@ -1419,15 +2037,10 @@ retry:
 		ret = PTR_ERR(handle);
 		goto out;
 	}
-	
-	if (ext3_judge_yuiha(sb)) {
-		ret = yuiha_block_write_begin(file, mapping, pos, len, flags,
-						pagep, fsdata, ext3_get_block);
-	} else {
-		ret = block_write_begin(file, mapping, pos, len, flags, pagep, fsdata,
-							ext3_get_block);
-	}
 
+	ret = prepare(file, mapping, pos, len, flags, pagep, fsdata, get_block);
+	// yuiha_block_write_begin() may hand the page over to the parent
+	page = *pagep;
 	if (ret)
 		goto write_begin_failed;
 
@@ -1460,6 +2073,25 @@ out:
 	return ret;
 }
 
+static int ext3_write_begin(struct file *file, struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned flags,
+				struct page **pagep, void **fsdata)
+{
+	return __ext3_write_begin(file, mapping, pos, len, flags, pagep,
+			fsdata, block_write_begin, ext3_get_block);
+}
+
+static int yuiha_write_begin(struct file *file, struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned flags,
+				struct page **pagep, void **fsdata)
+{
+	int plain = EXT3_I(mapping->host)->i_flags & YUIHA_PLAIN_FL;
+
+	return __ext3_write_begin(file, mapping, pos, len, flags, pagep,
+			fsdata, plain ? block_write_begin : yuiha_block_write_begin,
+			yuiha_get_block);
+}
+
 
 int ext3_journal_dirty_data(handle_t *handle, struct buffer_head *bh)
 {
@@ -1525,42 +2157,110 @@ static int ext3_ordered_write_end(struct file *file,
 	unsigned from, to;
 	int ret = 0, ret2;
 
-	struct yuiha_inode_info *yi = YUIHA_I(inode);
-	struct inode *parent_inode = yi->parent_inode;
+	copied = block_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+	from = pos & (PAGE_CACHE_SIZE - 1);
+	to = from + copied;
+	ret = walk_page_buffers(handle, page_buffers(page),
+		from, to, NULL, journal_dirty_data_fn);
+
+	if (ret == 0)
+		update_file_sizes(inode, pos, copied);
+	/*
+	 * There may be allocated blocks outside of i_size because
+	 * we failed to copy some data. Prepare for truncate.
+	 */
+	if (pos + len > inode->i_size && ext3_can_truncate(inode))
+		ext3_orphan_add(handle, inode);
+	ret2 = ext3_journal_stop(handle);
+	if (!ret)
+		ret = ret2;
+	unlock_page(page);
+	page_cache_release(page);
+
+	if (pos + len > inode->i_size)
+		ext3_truncate(inode);
+	return ret ? ret : copied;
+}
+
+/*
+ * Like ext3_ordered_write_end(), for versions.  Buffers restored by
+ * yuiha_block_write_end() are filed along with the copied ones, and a
+ * page that was copied to the parent version in write_begin is finished
+ * there as well.
+ */
+static int yuiha_ordered_write_end(struct file *file,
+				struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned copied,
+				struct page *page, void *fsdata)
+{
+	handle_t *handle = ext3_journal_current_handle();
+	struct inode *inode = file->f_mapping->host;
+	unsigned from, to;
+	int ret = 0, ret2;
+
+	struct yuiha_inode_info *yi;
+	struct inode *parent_inode;
 	struct address_space *parent_mapping = NULL;
 	struct page *parent_page = NULL;
 	pgoff_t index;
 
+	if (EXT3_I(inode)->i_flags & YUIHA_PLAIN_FL)
+		return ext3_ordered_write_end(file, mapping, pos, len, copied,
+				page, fsdata);
+
+	ret = yuiha_block_write_end(page, pos, len, copied, fsdata);
 	copied = block_write_end(file, mapping, pos, len, copied, page, fsdata);
 
 	index = pos >> PAGE_CACHE_SHIFT;
 	from = pos & (PAGE_CACHE_SIZE - 1);
-	to = from + copied;
-	ret = walk_page_buffers(handle, page_buffers(page),
-		from, to, NULL, journal_dirty_data_fn);
+	// restored buffers are as dirty as the copied ones
+	to = from + (ret > 0 ? len : copied);
+	if (ret >= 0)
+		ret = walk_page_buffers(handle, page_buffers(page),
+			from, to, NULL, journal_dirty_data_fn);
 
-	if (parent_inode) {
-		ext3_debug("");
-		parent_mapping = parent_inode->i_mapping;
-		parent_page = find_get_page(parent_mapping, index);
+	// Only a page copied to the parent version in write_begin involves it.
+	if (PageShared(page)) {
+		yi = YUIHA_I(inode);
+		mutex_lock(&yi->i_share_mutex);
+		parent_inode = yi->parent_inode;
+		if (parent_inode) {
+			ext3_debug("");
+			parent_mapping = parent_inode->i_mapping;
+			parent_page = find_get_page(parent_mapping, index);
 
-		ext3_debug("parent_page=%p", parent_page);
-		if (parent_page && PageShared(page) && PageDirty(parent_page)) {
-			block_write_end(NULL, parent_mapping, pos, len, copied,
-							parent_page, fsdata);
+			ext3_debug("parent_page=%p", parent_page);
+			/*
+			 * Locked in the same order as write_begin took it,
+			 * below the page and i_share_mutex.  A page truncated
+			 * meanwhile is left alone.
+			 */
+			if (parent_page)
+				lock_page(parent_page);
+			if (parent_page && parent_page->mapping == parent_mapping &&
+					PageDirty(parent_page)) {
+				block_write_end(NULL, parent_mapping, pos, len, copied,
+								parent_page, fsdata);
+				ext3_debug("");
+				if (ret == 0)
+					ret = walk_page_buffers(handle,
+						page_buffers(parent_page), from, to,
+						NULL, journal_dirty_data_fn);
+				if (ret == 0)
+					update_file_sizes(parent_inode, pos, copied);
+			}
+			if (parent_page)
+				unlock_page(parent_page);
 			ext3_debug("");
-			ret = walk_page_buffers(handle, page_buffers(parent_page), 
-							from, to, NULL, journal_dirty_data_fn);
-			ClearPageShared(page);
 		}
-		ext3_debug("");
+		mutex_unlock(&yi->i_share_mutex);
+		// the parent has its copy now
+		ClearPageShared(page);
 	}
 
-	if (ret == 0) {
+	if (ret == 0)
 		update_file_sizes(inode, pos, copied);
-		if (parent_inode)
-			update_file_sizes(parent_inode, pos, copied);
-	}
 	/*
 	 * There may be allocated blocks outside of i_size because
 	 * we failed to copy some data. Prepare for truncate.
@@ -1576,7 +2276,6 @@ static int ext3_ordered_write_end(struct file *file,
 	page_cache_release(page);
 	if (parent_page) {
 		ext3_debug("");
-		unlock_page(parent_page);
 		page_cache_release(parent_page);
 	}
 
@@ -1611,6 +2310,20 @@ static int ext3_writeback_write_end(struct file *file,
 	return ret ? ret : copied;
 }
 
+static int yuiha_writeback_write_end(struct file *file,
+				struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned copied,
+				struct page *page, void *fsdata)
+{
+	int ret, err = 0;
+
+	if (!(EXT3_I(mapping->host)->i_flags & YUIHA_PLAIN_FL))
+		err = yuiha_block_write_end(page, pos, len, copied, fsdata);
+	ret = ext3_writeback_write_end(file, mapping, pos, len, copied,
+			page, fsdata);
+	return ret >= 0 && err < 0 ? err : ret;
+}
+
 static int ext3_journalled_write_end(struct file *file,
 				struct address_space *mapping,
 				loff_t pos, unsigned len, unsigned copied,
@@ -1678,7 +2391,8 @@ static int ext3_journalled_write_end(struct file *file,
  * So, if we see any bmap calls here on a modified, data-journaled file,
  * take extra steps to flush any blocks which might be in the cache.
  */
-static sector_t ext3_bmap(struct address_space *mapping, sector_t block)
+static sector_t __ext3_bmap(struct address_space *mapping, sector_t block,
+			get_block_t *get_block)
 {
 	struct inode *inode = mapping->host;
 	journal_t *journal;
@@ -1713,7 +2427,17 @@ static sector_t ext3_bmap(struct address_space *mapping, sector_t block)
 			return 0;
 	}
 
-	return generic_block_bmap(mapping,block,ext3_get_block);
+	return generic_block_bmap(mapping, block, get_block);
+}
+
+static sector_t ext3_bmap(struct address_space *mapping, sector_t block)
+{
+	return __ext3_bmap(mapping, block, ext3_get_block);
+}
+
+static sector_t yuiha_bmap(struct address_space *mapping, sector_t block)
+{
+	return __ext3_bmap(mapping, block, yuiha_get_block);
 }
 
 static int bget_one(handle_t *handle, struct buffer_head *bh)
@@ -1785,8 +2509,8 @@ static int buffer_unmapped(handle_t *handle, struct buffer_head *bh)
  * AKPM2: if all the page's buffers are mapped to disk and !data=journal,
  * we don't need to open a transaction here.
  */
-static int ext3_ordered_writepage(struct page *page,
-				struct writeback_control *wbc)
+static int __ext3_ordered_writepage(struct page *page,
+				struct writeback_control *wbc, get_block_t *get_block)
 {
 	struct inode *inode = page->mapping->host;
 	struct buffer_head *page_bufs;
@@ -1826,7 +2550,7 @@ static int ext3_ordered_writepage(struct page *page,
 	walk_page_buffers(handle, page_bufs, 0,
 			PAGE_CACHE_SIZE, NULL, bget_one);
 
-	ret = block_write_full_page(page, ext3_get_block, wbc);
+	ret = block_write_full_page(page, get_block, wbc);
 
 	/*
 	 * The page can become unlocked at any point now, and
@@ -1859,8 +2583,20 @@ out_fail:
 	return ret;
 }
 
-static int ext3_writeback_writepage(struct page *page,
+static int ext3_ordered_writepage(struct page *page,
 				struct writeback_control *wbc)
+{
+	return __ext3_ordered_writepage(page, wbc, ext3_get_block);
+}
+
+static int yuiha_ordered_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	return __ext3_ordered_writepage(page, wbc, yuiha_get_block);
+}
+
+static int __ext3_writeback_writepage(struct page *page,
+				struct writeback_control *wbc, get_block_t *get_block)
 {
 	struct inode *inode = page->mapping->host;
 	handle_t *handle = NULL;
@@ -1886,9 +2622,9 @@ static int ext3_writeback_writepage(struct page *page,
 	}
 
 	if (test_opt(inode->i_sb, NOBH) && ext3_should_writeback_data(inode))
-		ret = nobh_writepage(page, ext3_get_block, wbc);
+		ret = nobh_writepage(page, get_block, wbc);
 	else
-		ret = block_write_full_page(page, ext3_get_block, wbc);
+		ret = block_write_full_page(page, get_block, wbc);
 
 	err = ext3_journal_stop(handle);
 	if (!ret)
@@ -1901,8 +2637,20 @@ out_fail:
 	return ret;
 }
 
-static int ext3_journalled_writepage(struct page *page,
+static int ext3_writeback_writepage(struct page *page,
 				struct writeback_control *wbc)
+{
+	return __ext3_writeback_writepage(page, wbc, ext3_get_block);
+}
+
+static int yuiha_writeback_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	return __ext3_writeback_writepage(page, wbc, yuiha_get_block);
+}
+
+static int __ext3_journalled_writepage(struct page *page,
+				struct writeback_control *wbc, get_block_t *get_block)
 {
 	struct inode *inode = page->mapping->host;
 	handle_t *handle = NULL;
@@ -1924,8 +2672,7 @@ static int ext3_journalled_writepage(struct page *page,
 		 * doesn't seem much point in redirtying the page here.
 		 */
 		ClearPageChecked(page);
-		ret = block_prepare_write(page, 0, PAGE_CACHE_SIZE,
-					ext3_get_block);
+		ret = block_prepare_write(page, 0, PAGE_CACHE_SIZE, get_block);
 		if (ret != 0) {
 			ext3_journal_stop(handle);
 			goto out_unlock;
@@ -1945,7 +2692,7 @@ static int ext3_journalled_writepage(struct page *page,
 		 * really know unless we go poke around in the buffer_heads.
 		 * But block_write_full_page will do the right thing.
 		 */
-		ret = block_write_full_page(page, ext3_get_block, wbc);
+		ret = block_write_full_page(page, get_block, wbc);
 	}
 	err = ext3_journal_stop(handle);
 	if (!ret)
@@ -1960,6 +2707,18 @@ out_unlock:
 	goto out;
 }
 
+static int ext3_journalled_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	return __ext3_journalled_writepage(page, wbc, ext3_get_block);
+}
+
+static int yuiha_journalled_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	return __ext3_journalled_writepage(page, wbc, yuiha_get_block);
+}
+
 static int ext3_readpage(struct file *file, struct page *page)
 {
 	return mpage_readpage(page, ext3_get_block);
@@ -1972,6 +2731,18 @@ ext3_readpages(struct file *file, struct address_space *mapping,
 	return mpage_readpages(mapping, pages, nr_pages, ext3_get_block);
 }
 
+static int yuiha_readpage(struct file *file, struct page *page)
+{
+	return mpage_readpage(page, yuiha_get_block);
+}
+
+static int
+yuiha_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages, yuiha_get_block);
+}
+
 static void ext3_invalidatepage(struct page *page, unsigned long offset)
 {
 	struct inode *inode = page->mapping->host;
@@ -2007,9 +2778,9 @@ static int ext3_releasepage(struct page *page, gfp_t wait)
  * crashes then stale disk data _may_ be exposed inside the file. But current
  * VFS code falls back into buffered path in that case so we are safe.
  */
-static ssize_t ext3_direct_IO(int rw, struct kiocb *iocb,
+static ssize_t __ext3_direct_IO(int rw, struct kiocb *iocb,
 			const struct iovec *iov, loff_t offset,
-			unsigned long nr_segs)
+			unsigned long nr_segs, get_block_t *get_block)
 {
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file->f_mapping->host;
@@ -2044,7 +2815,7 @@ static ssize_t ext3_direct_IO(int rw, struct kiocb *iocb,
 retry:
 	ret = blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
 				 offset, nr_segs,
-				 ext3_get_block, NULL);
+				 get_block, NULL);
 	if (ret == -ENOSPC && ext3_should_retry_alloc(inode->i_sb, &retries))
 		goto retry;
 
@@ -2085,6 +2856,83 @@ out:
 	return ret;
 }
 
+static ssize_t ext3_direct_IO(int rw, struct kiocb *iocb,
+			const struct iovec *iov, loff_t offset,
+			unsigned long nr_segs)
+{
+	return __ext3_direct_IO(rw, iocb, iov, offset, nr_segs, ext3_get_block);
+}
+
+/*
+ * Zero what a short direct write left of the blocks it copied-on-write
+ * without their old data, from byte @pos on.  Nobody else has seen them
+ * yet.
+ */
+static int yuiha_dio_zero_nocopy(struct inode *inode, loff_t pos)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	struct super_block *sb = inode->i_sb;
+	unsigned bits = inode->i_blkbits, offset;
+	struct buffer_head *bh;
+	sector_t blk, phys;
+	int err = 0;
+
+	blk = max_t(sector_t, pos >> bits, yi->i_dio_nocopy_start);
+	for (; blk < yi->i_dio_nocopy_end && !err; blk++) {
+		phys = bmap(inode, blk);
+		if (!phys)
+			continue;
+		offset = ((loff_t)blk << bits) < pos ?
+			pos & ((1 << bits) - 1) : 0;
+		bh = offset ? sb_bread(sb, phys) : sb_getblk(sb, phys);
+		if (!bh)
+			return -EIO;
+		lock_buffer(bh);
+		memset(bh->b_data + offset, 0, sb->s_blocksize - offset);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		err = sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+	return err;
+}
+
+static ssize_t yuiha_direct_IO(int rw, struct kiocb *iocb,
+			const struct iovec *iov, loff_t offset,
+			unsigned long nr_segs)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	ssize_t ret;
+	int err;
+
+	if (rw != WRITE)
+		return __ext3_direct_IO(rw, iocb, iov, offset, nr_segs,
+				yuiha_get_block);
+
+	// i_mutex is held, see yuiha_dio_overwrite().  An AIO write may still
+	// be in flight when this returns, too late to zero what it leaves
+	// out, so its blocks are copied as a whole.
+	yi->i_dio_nocopy_start = yi->i_dio_nocopy_end = 0;
+	if (is_sync_kiocb(iocb)) {
+		yi->i_dio_start = offset;
+		yi->i_dio_end = offset + iov_length(iov, nr_segs);
+	}
+	ret = __ext3_direct_IO(rw, iocb, iov, offset, nr_segs,
+			yuiha_dio_write_get_block);
+	if (ret != -EIOCBQUEUED &&
+			yi->i_dio_nocopy_end > yi->i_dio_nocopy_start &&
+			offset + max_t(ssize_t, ret, 0) < yi->i_dio_end) {
+		err = yuiha_dio_zero_nocopy(inode,
+				offset + max_t(ssize_t, ret, 0));
+		if (err && ret >= 0)
+			ret = err;
+	}
+	yi->i_dio_start = yi->i_dio_end = 0;
+	return ret;
+}
+
 /*
  * Pages can be marked dirty completely asynchronously from ext3's journalling
  * activity.  By filemap_sync_pte(), try_to_unmap_one(), etc.  We cannot do
@@ -2151,14 +2999,71 @@ static const struct address_space_operations ext3_journalled_aops = {
 	.error_remove_page	= generic_error_remove_page,
 };
 
+static const struct address_space_operations yuiha_ordered_aops = {
+	.readpage		= yuiha_readpage,
+	.readpages		= yuiha_readpages,
+	.writepage		= yuiha_ordered_writepage,
+	.sync_page		= block_sync_page,
+	.write_begin		= yuiha_write_begin,
+	.write_end		= yuiha_ordered_write_end,
+	.bmap			= yuiha_bmap,
+	.invalidatepage		= ext3_invalidatepage,
+	.releasepage		= ext3_releasepage,
+	.direct_IO		= yuiha_direct_IO,
+	.migratepage		= buffer_migrate_page,
+	.is_partially_uptodate  = block_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
+
+static const struct address_space_operations yuiha_writeback_aops = {
+	.readpage		= yuiha_readpage,
+	.readpages		= yuiha_readpages,
+	.writepage		= yuiha_writeback_writepage,
+	.sync_page		= block_sync_page,
+	.write_begin		= yuiha_write_begin,
+	.write_end		= yuiha_writeback_write_end,
+	.bmap			= yuiha_bmap,
+	.invalidatepage		= ext3_invalidatepage,
+	.releasepage		= ext3_releasepage,
+	.direct_IO		= yuiha_direct_IO,
+	.migratepage		= buffer_migrate_page,
+	.is_partially_uptodate  = block_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
+
+static const struct address_space_operations yuiha_journalled_aops = {
+	.readpage		= yuiha_readpage,
+	.readpages		= yuiha_readpages,
+	.writepage		= yuiha_journalled_writepage,
+	.sync_page		= block_sync_page,
+	.write_begin		= yuiha_write_begin,
+	.write_end		= ext3_journalled_write_end,
+	.set_page_dirty		= ext3_journalled_set_page_dirty,
+	.bmap			= yuiha_bmap,
+	.invalidatepage		= ext3_invalidatepage,
+	.releasepage		= ext3_releasepage,
+	.is_partially_uptodate  = block_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
+
+/*
+ * yuiha_file() inodes get the yuiha operations, which map blocks through
+ * yuiha_get_blocks_handle().  The choice is made once here, nothing on
+ * the ext3 paths looks at producer bits.
+ */
 void ext3_set_aops(struct inode *inode)
 {
+	int yuiha = yuiha_file(inode);
+
 	if (ext3_should_order_data(inode))
-		inode->i_mapping->a_ops = &ext3_ordered_aops;
+		inode->i_mapping->a_ops = yuiha ?
+			&yuiha_ordered_aops : &ext3_ordered_aops;
 	else if (ext3_should_writeback_data(inode))
-		inode->i_mapping->a_ops = &ext3_writeback_aops;
+		inode->i_mapping->a_ops = yuiha ?
+			&yuiha_writeback_aops : &ext3_writeback_aops;
 	else
-		inode->i_mapping->a_ops = &ext3_journalled_aops;
+		inode->i_mapping->a_ops = yuiha ?
+			&yuiha_journalled_aops : &ext3_journalled_aops;
 }
 
 /*
@@ -2212,7 +3117,10 @@ static int ext3_block_truncate_page(handle_t *handle, struct page *page,
 
 	if (!buffer_mapped(bh)) {
 		BUFFER_TRACE(bh, "unmapped");
-		ext3_get_block(inode, iblock, bh, 0);
+		if (yuiha_file(inode))
+			yuiha_get_block(inode, iblock, bh, 0);
+		else
+			ext3_get_block(inode, iblock, bh, 0);
 		/* unmapped? It's a hole - nothing to do */
 		if (!buffer_mapped(bh)) {
 			BUFFER_TRACE(bh, "still unmapped");
@@ -2362,11 +3270,9 @@ no_top:
  * We release `count' blocks on disk, but (last - first) may be greater
  * than `count' because there can be holes in there.
  */
-static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
-		struct buffer_head *bh, ext3_fsblk_t block_to_free,
-		unsigned long count, __le32 *first, __le32 *last)
+static void truncate_extend_transaction(handle_t *handle,
+		struct inode *inode, struct buffer_head *bh)
 {
-	__le32 *p;
 	if (try_to_extend_transaction(handle, inode)) {
 		if (bh) {
 			BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
@@ -2379,6 +3285,15 @@ static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
 			ext3_journal_get_write_access(handle, bh);
 		}
 	}
+}
+
+static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
+		struct buffer_head *bh, ext3_fsblk_t block_to_free,
+		unsigned long count, __le32 *first, __le32 *last)
+{
+	__le32 *p;
+
+	truncate_extend_transaction(handle, inode, bh);
 
 	/*
 	 * Any buffers which are on the journal will be in memory. We find
@@ -2389,7 +3304,7 @@ static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
 	 * AKPM: turn on bforget in journal_forget()!!!
 	 */
 	for (p = first; p < last; p++) {
-		u32 nr = le32_to_cpu(*p);
+		u32 nr = yuiha_block_nr(inode->i_sb, *p);
 		if (nr) {
 			struct buffer_head *bh;
 
@@ -2402,6 +3317,245 @@ static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
 	ext3_free_blocks(handle, inode, block_to_free, count);
 }
 
+/*
+ * Whether the inode being truncated owns the block behind pointer value
+ * @v.  Versioned files own the blocks carrying the producer bit,
+ * everything else, plain versions included, owns every block it maps.
+ */
+static inline int yuiha_owns_block(struct sibling_datablock *sdb, u32 v)
+{
+	if (sdb->versioned && !sdb->refcount && !sdb->plain)
+		return test_producer_flg(v);
+	return v != 0;
+}
+
+/*
+ * Whether the reference map says block @nr is referred to elsewhere too.
+ * A block the map cannot tell about counts as shared.
+ */
+static int yuiha_block_shared(struct inode *inode, ext3_fsblk_t nr)
+{
+	u32 extra;
+
+	return yuiha_refcount_get(inode->i_sb, nr, &extra) || extra;
+}
+
+/*
+ * With the reference map, drop our reference to block @nr.  Returns 0
+ * when it was the last one and the block has to be freed, nonzero when
+ * someone else still refers to it or when the map could not be updated:
+ * the block is then only unlinked, in the same transaction.  @bh is the
+ * indirect block being changed by the caller, if any.
+ */
+static int yuiha_release_block(handle_t *handle, struct inode *inode,
+		struct buffer_head *bh, ext3_fsblk_t nr)
+{
+	truncate_extend_transaction(handle, inode, bh);
+	return yuiha_refcount_release(handle, inode->i_sb, nr) != 0;
+}
+
+/*
+ * Make room for updating a child.  Must not be called with a child's
+ * truncate_mutex held: the restart waits for writers that may need it.
+ */
+static void yuiha_sibling_extend(handle_t *handle, struct inode *inode)
+{
+	if (try_to_extend_transaction(handle, inode)) {
+		ext3_mark_inode_dirty(handle, inode);
+		truncate_restart_transaction(handle, inode);
+	}
+}
+
+/*
+ * Map the array of @ref that lines up with the pointers being cleared.
+ * *@bhp is set when an indirect block had to be read.
+ */
+static __le32 *yuiha_sibling_array(struct sibling_ref *ref,
+		struct buffer_head **bhp)
+{
+	*bhp = NULL;
+	if (!ref->block)
+		return EXT3_I(ref->inode)->i_data;
+
+	*bhp = sb_bread(ref->inode->i_sb, ref->block);
+	if (!*bhp) {
+		ext3_error(ref->inode->i_sb, "yuiha_sibling_array",
+				 "Read failure, inode=%lu, block="E3FSBLK,
+				 ref->inode->i_ino, ref->block);
+		return NULL;
+	}
+	return (__le32 *)(*bhp)->b_data;
+}
+
+/*
+ * Point @sdb at the children's arrays lining up with index @start of the
+ * block reached through @offsets[0 .. @depth-1] (@depth 0: i_data), @block
+ * being our own block there.  A child reaching that very block shares it
+ * and freezes the level, a child with a hole on the way drops out.
+ */
+static void yuiha_sibling_level(struct sibling_datablock *sdb,
+		struct inode **children, int offsets[4], int depth,
+		ext3_fsblk_t block, int start)
+{
+	struct buffer_head *bh;
+	ext3_fsblk_t nr;
+	int i, k;
+
+	sdb->nr_refs = 0;
+	sdb->start = start;
+	sdb->frozen = 0;
+	for (i = 0; i < sdb->count; i++) {
+		struct inode *child = children[i];
+
+		nr = 0;
+		mutex_lock_nested(&EXT3_I(child)->truncate_mutex,
+				SINGLE_DEPTH_NESTING);
+		for (k = 0; k < depth; k++) {
+			if (!k) {
+				nr = le32_to_cpu(EXT3_I(child)->i_data[offsets[0]]);
+			} else {
+				bh = sb_bread(child->i_sb, nr);
+				if (!bh) {
+					nr = 0;
+					break;
+				}
+				nr = le32_to_cpu(((__le32 *)bh->b_data)[offsets[k]]);
+				brelse(bh);
+			}
+			nr = clear_producer_flg(nr);
+			if (!nr)
+				break;
+		}
+		mutex_unlock(&EXT3_I(child)->truncate_mutex);
+
+		if (depth && nr == block) {
+			sdb->frozen = 1;
+			continue;
+		}
+		if (depth && !nr)
+			continue;
+		sdb->refs[sdb->nr_refs].inode = child;
+		sdb->refs[sdb->nr_refs++].block = nr;
+	}
+}
+
+/*
+ * Settle the indirect pointer @v at index @j against the children that
+ * still diverge.  Returns 1 when a child maps the same subtree: its only
+ * child takes over the producer bit, or the version keeps the subtree as
+ * a phantom.  Otherwise @next is filled with the children to compare one
+ * level down.
+ */
+static int yuiha_sibling_descend(handle_t *handle, struct inode *inode,
+		struct sibling_datablock *sdb, int j, u32 v,
+		struct sibling_datablock *next)
+{
+	ext3_fsblk_t nr = clear_producer_flg(v), sibling_nr;
+	struct buffer_head *bh;
+	__le32 *array;
+	int i, shared = 0;
+
+	next->count = sdb->count;
+	next->phantom = 0;
+	next->frozen = 0;
+	next->nr_refs = 0;
+	next->start = 0;
+	next->refs = sdb->refs + sdb->count;
+	next->shared = sdb->shared;
+
+	for (i = 0; i < sdb->nr_refs && !shared; i++) {
+		struct sibling_ref *ref = &sdb->refs[i];
+
+		if (sdb->count == 1)
+			yuiha_sibling_extend(handle, inode);
+		mutex_lock_nested(&EXT3_I(ref->inode)->truncate_mutex,
+				SINGLE_DEPTH_NESTING);
+		array = yuiha_sibling_array(ref, &bh);
+		if (!array)
+			goto next_ref;
+		array += sdb->start + j;
+		sibling_nr = clear_producer_flg(le32_to_cpu(*array));
+
+		if (sibling_nr == nr) {
+			shared = 1;
+			if (sdb->count > 1) {
+				sdb->phantom = 1;
+			} else if (!test_producer_flg(le32_to_cpu(*array))) {
+				if (!bh) {
+					*array = cpu_to_le32(set_producer_flg(v));
+					ext3_mark_inode_dirty(handle, ref->inode);
+				} else if (!ext3_journal_get_write_access(handle, bh)) {
+					*array = cpu_to_le32(set_producer_flg(v));
+					ext3_journal_dirty_metadata(handle, bh);
+				}
+			}
+		} else if (sibling_nr) {
+			next->refs[next->nr_refs].inode = ref->inode;
+			next->refs[next->nr_refs++].block = sibling_nr;
+		}
+next_ref:
+		mutex_unlock(&EXT3_I(ref->inode)->truncate_mutex);
+		brelse(bh);
+	}
+	return shared;
+}
+
+/*
+ * Fold the children's leaf arrays into sdb->shared, bit j standing for a
+ * child that maps the block of first[j].  With a single child the producer
+ * bits of the blocks it shares move over at once.  Every child array is
+ * read a single time, so settling a freed pointer costs one bit test no
+ * matter how many children the version has.
+ */
+static void yuiha_sibling_fold(handle_t *handle, struct inode *inode,
+		struct sibling_datablock *sdb, __le32 *first, __le32 *last)
+{
+	int i, j, n = last - first, writable, pushed;
+	struct buffer_head *bh;
+	__le32 *array;
+	u32 v;
+
+	bitmap_zero(sdb->shared, n);
+	for (i = 0; i < sdb->nr_refs; i++) {
+		struct sibling_ref *ref = &sdb->refs[i];
+
+		if (sdb->count == 1)
+			yuiha_sibling_extend(handle, inode);
+		mutex_lock_nested(&EXT3_I(ref->inode)->truncate_mutex,
+				SINGLE_DEPTH_NESTING);
+		array = yuiha_sibling_array(ref, &bh);
+		if (!array)
+			goto next_ref;
+		array += sdb->start;
+		writable = sdb->count == 1 &&
+				(!bh || !ext3_journal_get_write_access(handle, bh));
+
+		for (j = 0, pushed = 0; j < n; j++) {
+			v = le32_to_cpu(first[j]);
+			if (!yuiha_owns_block(sdb, v) || test_bit(j, sdb->shared))
+				continue;
+			if (clear_producer_flg(le32_to_cpu(array[j])) !=
+					clear_producer_flg(v))
+				continue;
+			__set_bit(j, sdb->shared);
+			if (writable && !test_producer_flg(le32_to_cpu(array[j]))) {
+				array[j] = cpu_to_le32(set_producer_flg(v));
+				pushed = 1;
+			}
+		}
+
+		if (pushed) {
+			if (bh)
+				ext3_journal_dirty_metadata(handle, bh);
+			else
+				ext3_mark_inode_dirty(handle, ref->inode);
+		}
+next_ref:
+		mutex_unlock(&EXT3_I(ref->inode)->truncate_mutex);
+		brelse(bh);
+	}
+}
+
 /**
  * ext3_free_data - free a list of data blocks
  * @handle:	handle for this transaction
@@ -2409,6 +3563,7 @@ static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
  * @this_bh:	indirect buffer_head which contains *@first and *@last
  * @first:	array of block numbers
  * @last:	points immediately past the end of array
+ * @sdb:	children still mapping blocks of @inode
  *
  * We are freeing all blocks refered from that array (numbers are stored as
  * little-endian 32-bit) and updating @inode->i_blocks appropriately.
@@ -2418,6 +3573,11 @@ static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
  * or two bitmap blocks (+ group descriptor(s) and superblock) and we won't
  * actually use a lot of journal space.
  *
+ * Blocks we do not own, or that a child still maps, only get unlinked; with
+ * several children the latter stay mapped and the version becomes a phantom.
+ * With the reference map, the blocks still referred to elsewhere are the
+ * ones unlinked.
+ *
  * @this_bh will be %NULL if @first and @last point into the inode's direct
  * block pointers.
  */
@@ -2433,7 +3593,12 @@ static void ext3_free_data(handle_t *handle, struct inode *inode,
 	ext3_fsblk_t nr;		    /* Current block # */
 	__le32 *p;			    /* Pointer into inode/ind
 								 for current block */
-	int err, shared_boundary = 0, free_flg = 0;
+	int err, shared;
+
+	if (sdb->frozen)
+		return;
+	if (sdb->nr_refs)
+		yuiha_sibling_fold(handle, inode, sdb, first, last);
 
 	if (this_bh) {				/* For indirect block */
 		BUFFER_TRACE(this_bh, "get_write_access");
@@ -2445,87 +3610,53 @@ static void ext3_free_data(handle_t *handle, struct inode *inode,
 	}
 
 	for (p = first; p < last; p++) {
-		nr = clear_producer_flg(le32_to_cpu(*p));
-
-		if (nr && sdb) {
-			int i, offset = p - first, sibling_shared_count = 0;
-			__le32 *offset_p, *first_shared, sibling_nr;
-
-			// if the producer flag is set
-			if (test_producer_flg(le32_to_cpu(*p))) {
-				if (sdb->count == 1) {
-					if (!test_producer_flg(le32_to_cpu(*(sdb->first[0] + offset)))) {
-						// push a producer flg
-						*(sdb->first[0] + offset) = *p;
-						if (count)
-							shared_boundary = free_flg ? 1 : 0;
-						else
-							free_flg = 0;
-					} else {
-						// release a data block
-						if (count)
-							shared_boundary = free_flg ? 0 : 1;
-						else
-							free_flg = 1;
-					}
-				}
-
-				if (sdb->count > 1) {
-					for (i = 0; i < sdb->count; i++) {
-						offset_p = sdb->first[i] + offset;
-						sibling_nr = clear_producer_flg(le32_to_cpu(*offset_p));
-						if (nr == sibling_nr) {
-							//first_shared = sdb->first[i] + offset;
-							sibling_shared_count++;
-						}
-					}
-
-					if (!sibling_shared_count) {
-						// release data block
-						if (count)
-							shared_boundary = free_flg ? 0 : 1;
-						else
-							free_flg = 1;
-					} else {
-						// phantom
-						sdb->phantom = 1;
-						if (count)
-							shared_boundary = free_flg ? 1 : 0;
-						else
-							free_flg = 0;
-					}
-				}
-			} else {
-				if (count)
-					shared_boundary = free_flg ? 1 : 0;
-				else
-					free_flg = 0;
-			}
-		}
-
-		if (nr) {
-			/* accumulate blocks to free if they're contiguous */
-			if (count == 0) {
-				block_to_free = nr;
-				block_to_free_p = p;
-				count = 1;
-			} else if (nr == block_to_free + count && !shared_boundary) {
-				count++;
-			} else {
-				if (free_flg)
-					ext3_clear_blocks(handle, inode, this_bh,
-								block_to_free,
-								count, block_to_free_p, p);
+		nr = yuiha_block_nr(inode->i_sb, *p);
+		if (!nr)
+			continue;
 
-				free_flg = !free_flg;
+		if (sdb->refcount)
+			shared = yuiha_block_shared(inode, nr);
+		else
+			shared = sdb->nr_refs && test_bit(p - first, sdb->shared);
+		if (!yuiha_owns_block(sdb, le32_to_cpu(*p)) || shared) {
+			// not ours to free: end the run and unlink it
+			if (count)
+				ext3_clear_blocks(handle, inode, this_bh,
+						block_to_free, count, block_to_free_p, p);
+			count = 0;
+			if (sdb->refcount &&
+					!yuiha_release_block(handle, inode, this_bh, nr)) {
+				// the other users went away meanwhile
 				block_to_free = nr;
 				block_to_free_p = p;
 				count = 1;
+				continue;
 			}
+			if (shared && sdb->count > 1)
+				sdb->phantom = 1;
+			else
+				*p = 0;
+			continue;
+		}
+
+		/* accumulate blocks to free if they're contiguous */
+		if (count == 0) {
+			block_to_free = nr;
+			block_to_free_p = p;
+			count = 1;
+		} else if (nr == block_to_free + count) {
+			count++;
+		} else {
+			ext3_clear_blocks(handle, inode, this_bh,
+						block_to_free,
+						count, block_to_free_p, p);
+			block_to_free = nr;
+			block_to_free_p = p;
+			count = 1;
 		}
 	}
 
-	if (count > 0 && free_flg)
+	if (count > 0)
 		ext3_clear_blocks(handle, inode, this_bh, block_to_free,
 					count, block_to_free_p, p);
 
@@ -2549,6 +3680,28 @@ static void ext3_free_data(handle_t *handle, struct inode *inode,
 	}
 }
 
+/*
+ * Unlink the pointer at @p, journalling @parent_bh when there is one.
+ */
+static void ext3_clear_branch(handle_t *handle,
+		struct buffer_head *parent_bh, __le32 *p)
+{
+	if (!parent_bh) {
+		*p = 0;
+		return;
+	}
+	/*
+	 * The block which we have just freed is
+	 * pointed to by an indirect block: journal it
+	 */
+	BUFFER_TRACE(parent_bh, "get_write_access");
+	if (!ext3_journal_get_write_access(handle, parent_bh)) {
+		*p = 0;
+		BUFFER_TRACE(parent_bh, "call ext3_journal_dirty_metadata");
+		ext3_journal_dirty_metadata(handle, parent_bh);
+	}
+}
+
 /**
  *	ext3_free_branches - free an array of branches
  *	@handle: JBD handle for this transaction
@@ -2557,48 +3710,65 @@ static void ext3_free_data(handle_t *handle, struct inode *inode,
  *	@first:	array of block numbers
  *	@last:	pointer immediately past the end of array
  *	@depth:	depth of the branches to free
+ *	@sdb:	children still mapping blocks of @inode
  *
  *	We are freeing all blocks refered from these branches (numbers are
  *	stored as little-endian 32-bit) and updating @inode->i_blocks
- *	appropriately.
+ *	appropriately.  Pointers to released branches are zeroed, also
+ *	when @first and @last do not point into @parent_bh; branches kept
+ *	for a child stay in place.
  */
 static void ext3_free_branches(handle_t *handle, struct inode *inode,
 						 struct buffer_head *parent_bh,
 						 __le32 *first, __le32 *last, int depth,
 						 struct sibling_datablock *sdb)
 {
-	ext3_fsblk_t nr, sibling_nr;
+	struct sibling_datablock next_sdb;
+	ext3_fsblk_t nr;
 	__le32 *p;
-	int i;
+	u32 v;
 
 	if (is_handle_aborted(handle))
 		return;
+	if (sdb->frozen)
+		return;
 
-	// forst of producer flag is unset 
 	if (depth--) {
-		struct buffer_head *bh, *sibling_bh[10];
-		int addr_per_block = EXT3_ADDR_PER_BLOCK(inode->i_sb), offset, ind_free = 1;
-		__le32 *offset_p;
+		struct buffer_head *bh;
+		int addr_per_block = EXT3_ADDR_PER_BLOCK(inode->i_sb);
 
 		p = last;
 		while (--p >= first) {
-			if (!test_producer_flg(le32_to_cpu(*p)))
-				continue;
+			v = le32_to_cpu(*p);
+			nr = yuiha_block_nr(inode->i_sb, *p);
+			if (!nr)
+				continue;		/* A hole */
 
-			if (sdb && sdb->count == 1) {
-				offset = last - p;
-				offset_p = sdb->last[0] - offset;
+			if (!yuiha_owns_block(sdb, v) || (sdb->refcount &&
+					yuiha_release_block(handle, inode, NULL, nr))) {
+				ext3_clear_branch(handle, parent_bh, p);
+				continue;
+			}
 
-				if (!test_producer_flg(le32_to_cpu(*offset_p))) {
-					*offset_p = *p;
+			next_sdb.count = 0;
+			next_sdb.nr_refs = 0;
+			next_sdb.frozen = 0;
+			next_sdb.phantom = 0;
+			next_sdb.versioned = sdb->versioned;
+			next_sdb.plain = sdb->plain;
+			next_sdb.refcount = sdb->refcount;
+			if (sdb->nr_refs && yuiha_sibling_descend(handle, inode,
+						sdb, p - first, v, &next_sdb)) {
+				if (sdb->count != 1)
 					continue;
-				}
+				// the child owns it now, down to the last level
+				if (sdb->plain)
+					yuiha_mark_branch(handle, inode, nr,
+							depth + 1, 1);
+				ext3_clear_branch(handle, parent_bh, p);
+				continue;
 			}
 
-			nr = clear_producer_flg(le32_to_cpu(*p));
-			if (!nr)
-				continue;		/* A hole */
-
 			/* Go read the buffer for the next level down */
 			bh = sb_bread(inode->i_sb, nr);
 
@@ -2613,27 +3783,19 @@ static void ext3_free_branches(handle_t *handle, struct inode *inode,
 				continue;
 			}
 
-			struct sibling_datablock next_sdb = {
-				.count = sdb->count,
-			};
-			for (i = 0; i < sdb->count; i++) {
-				offset_p = sdb->last[i] - offset;
-				sibling_nr = clear_producer_flg(le32_to_cpu(*offset_p));
-				if (sibling_nr == nr)
-					ind_free = 0;
-
-				sibling_bh[i] = sb_bread(inode->i_sb, sibling_nr);
-				next_sdb.first[i] = (__le32 *)sibling_bh[i]->b_data;
-				next_sdb.last[i] = (__le32 *)sibling_bh[i]->b_data + addr_per_block;
-			}
-
 			/* This zaps the entire block.  Bottom up. */
 			BUFFER_TRACE(bh, "free child branches");
 			ext3_free_branches(handle, inode, bh,
 						 (__le32*)bh->b_data,
 						 (__le32*)bh->b_data + addr_per_block,
 						 depth, &next_sdb);
-			sdb->phantom = next_sdb.phantom;
+
+			if (next_sdb.phantom) {
+				// a child still maps something below
+				sdb->phantom = 1;
+				brelse(bh);
+				continue;
+			}
 
 			/*
 			 * We've probably journalled the indirect block several
@@ -2654,8 +3816,7 @@ static void ext3_free_branches(handle_t *handle, struct inode *inode,
 			 * revoke records must be emitted *before* clearing
 			 * this block's bit in the bitmaps.
 			 */
-			if (!sdb->phantom || ind_free)
-				ext3_forget(handle, 1, inode, bh, bh->b_blocknr);
+			ext3_forget(handle, 1, inode, bh, bh->b_blocknr);
 
 			/*
 			 * Everything below this this pointer has been
@@ -2680,25 +3841,8 @@ static void ext3_free_branches(handle_t *handle, struct inode *inode,
 				truncate_restart_transaction(handle, inode);
 			}
 
-
-			if (!sdb->phantom || ind_free)
-				ext3_free_blocks(handle, inode, nr, 1);
-
-			if (parent_bh) {
-				/*
-				 * The block which we have just freed is
-				 * pointed to by an indirect block: journal it
-				 */
-				BUFFER_TRACE(parent_bh, "get_write_access");
-				if (!ext3_journal_get_write_access(handle,
-									 parent_bh)){
-					*p = 0;
-					BUFFER_TRACE(parent_bh,
-					"call ext3_journal_dirty_metadata");
-					ext3_journal_dirty_metadata(handle,
-										parent_bh);
-				}
-			}
+			ext3_free_blocks(handle, inode, nr, 1);
+			ext3_clear_branch(handle, parent_bh, p);
 		}
 	} else {
 		/* We have reached the bottom of the tree. */
@@ -2720,6 +3864,54 @@ int ext3_can_truncate(struct inode *inode)
 	return 0;
 }
 
+/*
+ * Grab the children of @inode into a freshly allocated array.  Returns
+ * their number or a negative errno.
+ */
+static int yuiha_grab_children(struct inode *inode, struct inode ***children)
+{
+	struct yuiha_inode_info *yi;
+	struct inode **array = NULL, **tmp, *child;
+	unsigned long ino;
+	int count = 0, size = 0, err;
+
+	*children = NULL;
+	if (!yuiha_file(inode))
+		return 0;
+	yi = YUIHA_I(inode);
+	ino = yi->i_child_ino;
+	if (!ino)
+		return 0;
+
+	do {
+		if (count == size) {
+			size = size ? size * 2 : 16;
+			tmp = krealloc(array, size * sizeof(*array), GFP_NOFS);
+			if (!tmp) {
+				err = -ENOMEM;
+				goto fail;
+			}
+			array = tmp;
+		}
+		child = yuiha_ilookup(inode->i_sb, ino);
+		if (IS_ERR(child)) {
+			err = PTR_ERR(child);
+			goto fail;
+		}
+		array[count++] = child;
+		ino = YUIHA_I(child)->i_sibling_next_ino;
+	} while (ino && ino != yi->i_child_ino);
+
+	*children = array;
+	return count;
+
+fail:
+	while (count--)
+		iput(array[count]);
+	kfree(array);
+	return err;
+}
+
 /*
  * ext3_truncate()
  *
@@ -2748,7 +3940,7 @@ int ext3_can_truncate(struct inode *inode)
  * that's fine - as long as they are linked from the inode, the post-crash
  * ext3_truncate() run will find them and release them.
  */
-void ext3_truncate(struct inode *inode)
+static int __ext3_truncate(struct inode *inode, struct inode *heir)
 {
 	handle_t *handle;
 	struct ext3_inode_info *ei = EXT3_I(inode);
@@ -2759,17 +3951,72 @@ void ext3_truncate(struct inode *inode)
 	Indirect chain[4];
 	Indirect *partial;
 	__le32 nr = 0;
-	int n, i;
+	int n, i, count = 0, teardown, err = 0;
 	long last_block;
 	unsigned blocksize = inode->i_sb->s_blocksize;
 	struct page *page;
+	struct inode **children = NULL;
+	struct sibling_datablock sdb = {
+		.count = 0,
+		.refs = NULL,
+		.shared = NULL,
+	};
 
 	if (!ext3_can_truncate(inode))
-		goto out_notrans;
+		return -EPERM;
 
 	if (inode->i_size == 0 && ext3_should_writeback_data(inode))
 		ei->i_state |= EXT3_STATE_FLUSH_ON_CLOSE;
 
+	/*
+	 * Children are grabbed before anything changes: without them the
+	 * blocks they share cannot be told from ours, and a truncate given
+	 * up after i_disksize moved would leave blocks past it.  They are
+	 * grabbed before truncate_mutex as well, ext3_iget() may have to
+	 * read them.  Their own truncate_mutex is only held while one of
+	 * their arrays is looked at or updated.  The block reference map
+	 * answers for them.  A squash settles the version against @heir, the
+	 * version that stays below it, instead.
+	 */
+	// a plain version that has been snapshotted shares with its child
+	sdb.plain = yuiha_file(inode) && !yuiha_versioned(inode);
+	sdb.versioned = yuiha_versioned(inode) || (sdb.plain &&
+			(YUIHA_I(inode)->i_parent_ino || YUIHA_I(inode)->i_child_ino));
+	sdb.refcount = sdb.versioned && yuiha_refcount_enabled(inode->i_sb);
+	// a tree going away whole has nobody left to hand blocks to
+	teardown = ei->i_flags & YUIHA_TEARDOWN_FL;
+	if (!sdb.refcount && !teardown && heir) {
+		children = kmalloc(sizeof(*children), GFP_NOFS);
+		count = children ? 1 : -ENOMEM;
+		if (children)
+			children[0] = igrab(heir);
+		if (children && !children[0])
+			count = -ENOENT;
+	} else if (!sdb.refcount && !teardown) {
+		count = yuiha_grab_children(inode, &children);
+	}
+	if (count < 0) {
+		ext3_warning(inode->i_sb, "ext3_truncate",
+			     "inode %lu: cannot read its children (%d), "
+			     "not truncated", inode->i_ino, count);
+		err = count;
+		count = 0;
+		goto out_notrans;
+	}
+	sdb.count = count;
+	if (count) {
+		sdb.refs = kmalloc(4 * count * sizeof(*sdb.refs), GFP_NOFS);
+		sdb.shared = kmalloc(BITS_TO_LONGS(addr_per_block) *
+				sizeof(unsigned long), GFP_NOFS);
+		if (!sdb.refs || !sdb.shared) {
+			ext3_warning(inode->i_sb, "ext3_truncate",
+				     "inode %lu: no memory for %d children, "
+				     "not truncated", inode->i_ino, count);
+			err = -ENOMEM;
+			goto out_notrans;
+		}
+	}
+
 	/*
 	 * We have to lock the EOF page here, because lock_page() nests
 	 * outside journal_start().
@@ -2780,12 +4027,15 @@ void ext3_truncate(struct inode *inode)
 	} else {
 		page = grab_cache_page(mapping,
 				inode->i_size >> PAGE_CACHE_SHIFT);
-		if (!page)
+		if (!page) {
+			err = -ENOMEM;
 			goto out_notrans;
+		}
 	}
 
 	handle = start_transaction(inode);
 	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
 		if (page) {
 			clear_highpage(page);
 			flush_dcache_page(page);
@@ -2802,8 +4052,10 @@ void ext3_truncate(struct inode *inode)
 		ext3_block_truncate_page(handle, page, mapping, inode->i_size);
 
 	n = ext3_block_to_path(inode, last_block, offsets, NULL);
-	if (n == 0)
+	if (n == 0) {
+		err = -EIO;
 		goto out_stop;	/* error */
+	}
 
 	/*
 	 * OK.  This truncate is going to happen.  We add the inode to the
@@ -2814,7 +4066,8 @@ void ext3_truncate(struct inode *inode)
 	 * Implication: the file must always be in a sane, consistent
 	 * truncatable state while each transaction commits.
 	 */
-	if (ext3_orphan_add(handle, inode))
+	err = ext3_orphan_add(handle, inode);
+	if (err)
 		goto out_stop;
 
 	/*
@@ -2832,32 +4085,8 @@ void ext3_truncate(struct inode *inode)
 	 */
 	mutex_lock(&ei->truncate_mutex);
 
-	//tmp
-	struct yuiha_inode_info *yi = YUIHA_I(inode), *sibling_yi;
-	struct inode *siblings[10];
-	struct sibling_datablock sdb = {.count = 0, .phantom = 0};
-	__le32 *sibling_i_data;
-
-	if (yi->i_child_ino) {
-		int sibling_ino = yi->i_child_ino;
-
-		do {
-			siblings[sdb.count] = yuiha_ilookup(inode->i_sb, sibling_ino);
-			sibling_yi = YUIHA_I(siblings[sdb.count]);
-			sibling_ino = sibling_yi->i_sibling_next_ino;
-			mutex_lock(&siblings[sdb.count]->i_mutex);
-			sdb.count++;
-		} while (sibling_ino != yi->i_child_ino);
-	}
-
 	if (n == 1) {		/* direct blocks */
-		for (i = 0; i < sdb.count; i++) {
-			sibling_yi = YUIHA_I(siblings[i]);
-			sibling_i_data = sibling_yi->i_ext3.i_data;
-
-			sdb.first[i] = sibling_i_data + offsets[0];
-			sdb.last[i] = sibling_i_data + EXT3_NDIR_BLOCKS;
-		}
+		yuiha_sibling_level(&sdb, children, offsets, 0, 0, offsets[0]);
 		ext3_free_data(handle, inode, NULL, i_data+offsets[0],
 						 i_data + EXT3_NDIR_BLOCKS, &sdb);
 		goto do_indirects;
@@ -2868,9 +4097,11 @@ void ext3_truncate(struct inode *inode)
 	if (nr) {
 		if (partial == chain) {
 			/* Shared branch grows from the inode */
+			yuiha_sibling_level(&sdb, children, offsets, 0, 0,
+					partial->p - i_data);
 			ext3_free_branches(handle, inode, NULL,
 						 &nr, &nr+1, (chain+n-1) - partial, &sdb);
-			*partial->p = 0;
+			*partial->p = nr;
 			/*
 			 * We mark the inode dirty prior to restart,
 			 * and prior to stop.  No need for it here.
@@ -2878,6 +4109,9 @@ void ext3_truncate(struct inode *inode)
 		} else {
 			/* Shared branch grows from an indirect block */
 			BUFFER_TRACE(partial->bh, "get_write_access");
+			yuiha_sibling_level(&sdb, children, offsets,
+					partial - chain, partial->bh->b_blocknr,
+					partial->p - (__le32 *)partial->bh->b_data);
 			ext3_free_branches(handle, inode, partial->bh,
 					partial->p,
 					partial->p+1, (chain+n-1) - partial, &sdb);
@@ -2885,6 +4119,9 @@ void ext3_truncate(struct inode *inode)
 	}
 	/* Clear the ends of indirect blocks on the shared branch */
 	while (partial > chain) {
+		yuiha_sibling_level(&sdb, children, offsets,
+				partial - chain, partial->bh->b_blocknr,
+				partial->p + 1 - (__le32 *)partial->bh->b_data);
 		ext3_free_branches(handle, inode, partial->bh, partial->p + 1,
 					 (__le32*)partial->bh->b_data+addr_per_block,
 					 (chain+n-1) - partial, &sdb);
@@ -2897,53 +4134,27 @@ do_indirects:
 	switch (offsets[0]) {
 	default:
 		nr = i_data[EXT3_IND_BLOCK];
-		if (test_producer_flg(le32_to_cpu(nr))) {
-			for (i = 0; i < sdb.count; i++) {
-				sibling_yi = YUIHA_I(siblings[i]);
-				sibling_i_data = sibling_yi->i_ext3.i_data;
-
-				sdb.first[i] = &sibling_i_data[EXT3_IND_BLOCK];
-				sdb.last[i] = &sibling_i_data[EXT3_IND_BLOCK + 1];
-			}
-			if (nr) {
-				ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 1, &sdb);
-				if (!sdb.phantom)
-					i_data[EXT3_IND_BLOCK] = 0;
-			}
+		if (nr) {
+			yuiha_sibling_level(&sdb, children, offsets, 0, 0,
+					EXT3_IND_BLOCK);
+			ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 1, &sdb);
+			i_data[EXT3_IND_BLOCK] = nr;
 		}
 	case EXT3_IND_BLOCK:
 		nr = i_data[EXT3_DIND_BLOCK];
-		if (test_producer_flg(le32_to_cpu(nr))) {
-			for (i = 0; i < sdb.count; i++) {
-				sibling_yi = YUIHA_I(siblings[i]);
-				sibling_i_data = sibling_yi->i_ext3.i_data;
-
-				sdb.first[i] = &sibling_i_data[EXT3_DIND_BLOCK];
-				sdb.last[i] = &sibling_i_data[EXT3_DIND_BLOCK + 1];
-			}
-			if (nr) {
-				ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 2, &sdb);
-				i_data[EXT3_DIND_BLOCK] = 0;
-				if (!sdb.phantom)
-					i_data[EXT3_IND_BLOCK] = 0;
-			}
+		if (nr) {
+			yuiha_sibling_level(&sdb, children, offsets, 0, 0,
+					EXT3_DIND_BLOCK);
+			ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 2, &sdb);
+			i_data[EXT3_DIND_BLOCK] = nr;
 		}
 	case EXT3_DIND_BLOCK:
 		nr = i_data[EXT3_TIND_BLOCK];
-		if (test_producer_flg(le32_to_cpu(nr))) {
-			for (i = 0; i < sdb.count; i++) {
-				sibling_yi = YUIHA_I(siblings[i]);
-				sibling_i_data = sibling_yi->i_ext3.i_data;
-
-				sdb.first[i] = &sibling_i_data[EXT3_TIND_BLOCK];
-				sdb.last[i] = &sibling_i_data[EXT3_TIND_BLOCK + 1];
-			}
-			if (nr) {
-				ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 3, &sdb);
-				i_data[EXT3_TIND_BLOCK] = 0;
-				if (!sdb.phantom)
-					i_data[EXT3_IND_BLOCK] = 0;
-			}
+		if (nr) {
+			yuiha_sibling_level(&sdb, children, offsets, 0, 0,
+					EXT3_TIND_BLOCK);
+			ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 3, &sdb);
+			i_data[EXT3_TIND_BLOCK] = nr;
 		}
 	case EXT3_TIND_BLOCK:
 		;
@@ -2954,7 +4165,10 @@ do_indirects:
 	mutex_unlock(&ei->truncate_mutex);
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
 
-	if (!sdb.phantom)
+	// only a version truncated away entirely leaves its tree, a squash
+	// takes the versions out all at once
+	if (sdb.versioned && !sdb.phantom && !inode->i_size && !teardown &&
+			!heir)
 		yuiha_detach_version(handle, inode);
 	ext3_mark_inode_dirty(handle, inode);
 
@@ -2975,14 +4189,10 @@ out_stop:
 	if (inode->i_nlink)
 		ext3_orphan_del(handle, inode);
 
-	for (i = 0; i < sdb.count; i++) {
-		mutex_unlock(&siblings[i]->i_mutex);
-		ext3_mark_inode_dirty(handle, siblings[i]);
-		iput(siblings[i]);
-	}
-
+	if (!err && is_handle_aborted(handle))
+		err = -EIO;
 	ext3_journal_stop(handle);
-	return;
+	goto out_free;
 out_notrans:
 	/*
 	 * Delete the inode from orphan list so that it doesn't stay there
@@ -2990,6 +4200,283 @@ out_notrans:
 	 */
 	if (inode->i_nlink)
 		ext3_orphan_del(NULL, inode);
+out_free:
+	for (i = 0; i < count; i++)
+		iput(children[i]);
+	kfree(children);
+	kfree(sdb.refs);
+	kfree(sdb.shared);
+	return err;
+}
+
+void ext3_truncate(struct inode *inode)
+{
+	__ext3_truncate(inode, NULL);
+}
+
+/*
+ * Empty @inode, a deleted version of a chain being squashed, into @heir,
+ * the version that stays below the chain: what @heir still maps becomes
+ * its own, the rest is freed.  @inode stays in its tree.  Called with its
+ * i_mutex held.
+ */
+int yuiha_truncate_into(struct inode *inode, struct inode *heir)
+{
+	i_size_write(inode, 0);
+	truncate_inode_pages(inode->i_mapping, 0);
+	return __ext3_truncate(inode, heir);
+}
+
+/*
+ * Set (@own) or clear the producer bit on every pointer in indirect block
+ * @block and in the @depth - 1 levels below it.
+ */
+static int yuiha_mark_branch(handle_t *handle, struct inode *inode,
+		ext3_fsblk_t block, int depth, int own)
+{
+	int addr_per_block = EXT3_ADDR_PER_BLOCK(inode->i_sb);
+	struct buffer_head *bh;
+	__le32 *p;
+	u32 v;
+	int i, err;
+
+	if (try_to_extend_transaction(handle, inode)) {
+		ext3_mark_inode_dirty(handle, inode);
+		truncate_restart_transaction(handle, inode);
+	}
+
+	bh = sb_bread(inode->i_sb, block);
+	if (!bh)
+		return -EIO;
+	BUFFER_TRACE(bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err)
+		goto out;
+
+	p = (__le32 *)bh->b_data;
+	for (i = 0; i < addr_per_block; i++) {
+		v = le32_to_cpu(p[i]);
+		if (v)
+			p[i] = cpu_to_le32(own ? set_producer_flg(v) :
+					clear_producer_flg(v));
+	}
+	err = ext3_journal_dirty_metadata(handle, bh);
+
+	// this level is in the transaction before a restart below commits it
+	for (i = 0; !err && depth > 1 && i < addr_per_block; i++) {
+		v = clear_producer_flg(le32_to_cpu(p[i]));
+		if (v)
+			err = yuiha_mark_branch(handle, inode, v, depth - 1,
+					own);
+	}
+out:
+	brelse(bh);
+	return err;
+}
+
+/*
+ * Walk every block pointer of @inode, setting or clearing the producer
+ * bit.  Called outside a transaction, the walk may take several.
+ */
+static int yuiha_mark_blocks(struct inode *inode, int own)
+{
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	__le32 *i_data = ei->i_data;
+	handle_t *handle;
+	u32 v;
+	int n, err, err2;
+
+	handle = ext3_journal_start(inode, blocks_for_truncate(inode));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	mutex_lock(&ei->truncate_mutex);
+	err = 0;
+	for (n = 0; !err && n < EXT3_N_BLOCKS; n++) {
+		v = le32_to_cpu(i_data[n]);
+		if (!v)
+			continue;
+		i_data[n] = cpu_to_le32(own ? set_producer_flg(v) :
+				clear_producer_flg(v));
+		if (n >= EXT3_IND_BLOCK)
+			err = yuiha_mark_branch(handle, inode,
+					clear_producer_flg(v),
+					n - EXT3_IND_BLOCK + 1, own);
+	}
+	mutex_unlock(&ei->truncate_mutex);
+
+	err2 = ext3_mark_inode_dirty(handle, inode);
+	if (!err)
+		err = err2;
+	err2 = ext3_journal_stop(handle);
+	return err ? err : err2;
+}
+
+/*
+ * Strip the producer bits of @inode for the fulladdr format.  With the
+ * reference map a pointer without the bit is merely claimed again on its
+ * next write, so a file left half done by a crash is still consistent.
+ */
+int yuiha_strip_blocks(struct inode *inode)
+{
+	return yuiha_mark_blocks(inode, 0);
+}
+
+/*
+ * Unlink the data block behind @leaf, freeing it if nobody else maps
+ * it.  Called with truncate_mutex held.
+ */
+static int yuiha_punch_leaf(handle_t *handle, struct inode *inode,
+		Indirect *leaf)
+{
+	struct super_block *sb = inode->i_sb;
+	__le32 v = *leaf->p;
+	ext3_fsblk_t nr = yuiha_block_nr(sb, v);
+	int err, owned;
+
+	if (yuiha_refcount_enabled(sb))
+		owned = !yuiha_block_shared(inode, nr) ||
+			!yuiha_release_block(handle, inode, leaf->bh, nr);
+	else
+		owned = EXT3_I(inode)->i_flags & YUIHA_PLAIN_FL ||
+			yuiha_ptr_owned(sb, v);
+
+	if (leaf->bh) {
+		BUFFER_TRACE(leaf->bh, "get_write_access");
+		err = ext3_journal_get_write_access(handle, leaf->bh);
+		if (err)
+			return err;
+		*leaf->p = 0;
+		err = ext3_journal_dirty_metadata(handle, leaf->bh);
+	} else {
+		*leaf->p = 0;
+		err = ext3_mark_inode_dirty(handle, inode);
+	}
+	if (!err && owned)
+		ext3_free_blocks(handle, inode, nr, 1);
+	return err;
+}
+
+/*
+ * Turn the @count blocks from @iblock of @inode into holes.  Their pages
+ * are dropped from the page cache, so the range has to cover whole pages.
+ * A borrowed block is only unlinked.  Below a borrowed indirect block the
+ * path is copied first, the way a write copies it, and the block is
+ * looked at again.  Called with i_mutex held.
+ */
+int yuiha_punch_blocks(struct inode *inode, sector_t iblock,
+		unsigned long count)
+{
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct super_block *sb = inode->i_sb;
+	int plain = ei->i_flags & YUIHA_PLAIN_FL;
+	int offsets[4], blocks_to_boundary = 0;
+	Indirect chain[4], *partial;
+	struct buffer_head dummy;
+	handle_t *handle;
+	int depth, level, borrowed, err = 0, err2;
+
+	truncate_inode_pages_range(inode->i_mapping,
+			(loff_t)iblock << inode->i_blkbits,
+			((loff_t)(iblock + count) << inode->i_blkbits) - 1);
+
+	while (count && !err) {
+		depth = ext3_block_to_path(inode, iblock, offsets,
+				&blocks_to_boundary);
+		if (!depth)
+			return -EIO;
+		handle = ext3_journal_start(inode,
+				ext3_writepage_trans_blocks(inode));
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+
+		mutex_lock(&ei->truncate_mutex);
+		partial = yuiha_get_branch(inode, depth, offsets, chain, &err,
+				NULL);
+		borrowed = 0;
+		for (level = 0; !partial && !plain && level < depth - 1; level++)
+			if (!yuiha_ptr_owned(sb, *chain[level].p)) {
+				borrowed = 1;
+				break;
+			}
+		if (!partial && !borrowed)
+			err = yuiha_punch_leaf(handle, inode, chain + depth - 1);
+		mutex_unlock(&ei->truncate_mutex);
+
+		for (partial = partial ? partial : chain + depth - 1;
+				partial > chain; partial--)
+			brelse(partial->bh);
+
+		if (!err && borrowed) {
+			memset(&dummy, 0, sizeof(dummy));
+			err = yuiha_get_blocks_handle(handle, inode, iblock, 1,
+					&dummy, 1);
+			if (err > 0)
+				err = 0;
+		} else {
+			iblock++;
+			count--;
+		}
+		err2 = ext3_journal_stop(handle);
+		if (!err)
+			err = err2;
+		cond_resched();
+	}
+	return err;
+}
+
+static int yuiha_count_branch(struct super_block *sb, __le32 *p, __le32 *end,
+		int depth, u64 *owned)
+{
+	struct buffer_head *bh;
+	int err;
+
+	for (; p < end; p++) {
+		if (!*p || !yuiha_ptr_owned(sb, *p))
+			continue;
+		(*owned)++;
+		if (!depth)
+			continue;
+		bh = sb_bread(sb, yuiha_block_nr(sb, *p));
+		if (!bh)
+			return -EIO;
+		err = yuiha_count_branch(sb, (__le32 *)bh->b_data,
+				(__le32 *)bh->b_data + EXT3_ADDR_PER_BLOCK(sb),
+				depth - 1, owned);
+		brelse(bh);
+		if (err)
+			return err;
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * Count the blocks, data and indirect, @inode owns.  Only owned indirect
+ * blocks are descended: what hangs below a borrowed one is borrowed too,
+ * so the walk costs what the version owns, not its size.  A file never
+ * versioned owns everything it maps.
+ */
+int yuiha_owned_blocks(struct inode *inode, u64 *owned)
+{
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct super_block *sb = inode->i_sb;
+	int n, err = 0;
+
+	*owned = 0;
+	if (ei->i_flags & YUIHA_PLAIN_FL) {
+		*owned = inode->i_blocks >> (sb->s_blocksize_bits - 9);
+		return 0;
+	}
+
+	mutex_lock(&ei->truncate_mutex);
+	err = yuiha_count_branch(sb, ei->i_data, ei->i_data + EXT3_NDIR_BLOCKS,
+			0, owned);
+	for (n = EXT3_IND_BLOCK; !err && n < EXT3_N_BLOCKS; n++)
+		err = yuiha_count_branch(sb, ei->i_data + n, ei->i_data + n + 1,
+				n - EXT3_IND_BLOCK + 1, owned);
+	mutex_unlock(&ei->truncate_mutex);
+	return err;
 }
 
 static ext3_fsblk_t ext3_get_inode_block(struct super_block *sb,
@@ -3026,6 +4513,56 @@ static ext3_fsblk_t ext3_get_inode_block(struct super_block *sb,
 	return block;
 }
 
+/*
+ * Read the version-tree links of @ino straight from the inode table,
+ * without instantiating the inode.  Used by the topology cache.  An inode
+ * without links is -ESTALE unless @unlinked asks for its links anyway.
+ */
+int yuiha_read_vnode(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn, int unlinked)
+{
+	struct ext3_iloc iloc;
+	struct yuiha_inode *raw_inode;
+	ext3_fsblk_t block;
+
+	block = ext3_get_inode_block(sb, ino, &iloc);
+	if (!block)
+		return -EIO;
+	iloc.bh = sb_bread(sb, block);
+	if (!iloc.bh) {
+		ext3_error(sb, "yuiha_read_vnode",
+				"unable to read inode block - "
+				"inode=%lu, block="E3FSBLK, ino, block);
+		return -EIO;
+	}
+
+	raw_inode = (struct yuiha_inode *)ext3_raw_inode(&iloc);
+	if (!raw_inode->i_ext3.i_links_count && !unlinked) {
+		brelse(iloc.bh);
+		return -ESTALE;
+	}
+
+	vn->ino = ino;
+	vn->generation = le32_to_cpu(raw_inode->i_ext3.i_generation);
+	vn->parent = le32_to_cpu(raw_inode->i_parent_ino);
+	vn->child = le32_to_cpu(raw_inode->i_child_ino);
+	vn->sibling_next = le32_to_cpu(raw_inode->i_sibling_next_ino);
+	vn->sibling_prev = le32_to_cpu(raw_inode->i_sibling_prev_ino);
+	vn->phantom_root = le32_to_cpu(raw_inode->i_phantom_root_ino);
+	vn->flags = le32_to_cpu(raw_inode->i_ext3.i_flags);
+	vn->nlink = le16_to_cpu(raw_inode->i_ext3.i_links_count);
+	vn->size = le32_to_cpu(raw_inode->i_ext3.i_size) |
+		((loff_t)le32_to_cpu(raw_inode->i_ext3.i_size_high) << 32);
+	vn->blocks = le32_to_cpu(raw_inode->i_ext3.i_blocks);
+	vn->mtime = le32_to_cpu(raw_inode->i_ext3.i_mtime);
+	vn->tags = 0;
+	if (le16_to_cpu(raw_inode->i_ext3.i_extra_isize) >=
+			YUIHA_INODE_EXTRA_ISIZE_V1)
+		vn->tags = le16_to_cpu(raw_inode->i_tags);
+	brelse(iloc.bh);
+	return 0;
+}
+
 /*
  * ext3_get_inode_loc returns with an extra refcount against the inode's
  * underlying buffer_head on success. If 'in_mem' is true, we have all
@@ -3214,7 +4751,7 @@ struct inode *ext3_iget(struct super_block *sb, unsigned long ino)
 	long ret;
 	int block;
 	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
-	int is_not_journal_file;
+	int is_not_journal_file, yuiha_fresh = 0, yuiha_grown = 0;
 
 	inode = iget_locked(sb, ino);
 	if (!inode)
@@ -3227,6 +4764,11 @@ struct inode *ext3_iget(struct super_block *sb, unsigned long ino)
 		yi = YUIHA_I(inode);
 		ei = &yi->i_ext3;
 		yi->parent_inode = NULL;
+		yi->i_seq = 0;
+		yi->i_crtime = 0;
+		yi->i_tags = 0;
+		yi->i_origin_seq = 0;
+		yi->i_origin_crtime = 0;
 	} else {
 		ei = EXT3_I(inode);
 	}
@@ -3340,7 +4882,16 @@ struct inode *ext3_iget(struct super_block *sb, unsigned long ino)
 			ret = -EIO;
 			goto bad_inode;
 		}
-		if (ei->i_extra_isize == 0) {
+		if (yi && ei->i_extra_isize < YUIHA_INODE_EXTRA_ISIZE_V1) {
+			/*
+			 * Older yuiha inodes kept in-inode xattrs on top of
+			 * the version links, which overwrote them again.
+			 * The xattr space moves behind the links, the fields
+			 * it did not cover start out empty.
+			 */
+			ei->i_extra_isize = YUIHA_INODE_EXTRA_ISIZE;
+			yuiha_fresh = 1;
+		} else if (ei->i_extra_isize == 0) {
 			/* The extra space is currently unused. Use it. */
 			ei->i_extra_isize = sizeof(struct ext3_inode) -
 							EXT3_GOOD_OLD_INODE_SIZE;
@@ -3351,6 +4902,14 @@ struct inode *ext3_iget(struct super_block *sb, unsigned long ino)
 			if (*magic == cpu_to_le32(EXT3_XATTR_MAGIC))
 				 ei->i_state |= EXT3_STATE_XATTR;
 		}
+		// the origin fields are taken unless in-inode xattrs are there
+		if (yi && ei->i_extra_isize < YUIHA_INODE_EXTRA_ISIZE &&
+				!(ei->i_state & EXT3_STATE_XATTR) &&
+				EXT3_GOOD_OLD_INODE_SIZE + YUIHA_INODE_EXTRA_ISIZE <=
+				EXT3_INODE_SIZE(inode->i_sb)) {
+			ei->i_extra_isize = YUIHA_INODE_EXTRA_ISIZE;
+			yuiha_grown = 1;
+		}
 	} else
 		ei->i_extra_isize = 0;
 
@@ -3376,6 +4935,21 @@ struct inode *ext3_iget(struct super_block *sb, unsigned long ino)
 
 			yi->i_phantom_root_ino = le32_to_cpu(yuiha_raw_inode->i_phantom_root_ino);
 			yi->i_vtree_nlink = le16_to_cpu(yuiha_raw_inode->i_vtree_nlink);
+
+			if (ei->i_extra_isize >= YUIHA_INODE_EXTRA_ISIZE_V1 &&
+					!yuiha_fresh) {
+				yi->i_seq = le64_to_cpu(yuiha_raw_inode->i_seq);
+				yi->i_crtime =
+					le32_to_cpu(yuiha_raw_inode->i_crtime);
+				yi->i_tags = le16_to_cpu(yuiha_raw_inode->i_tags);
+			}
+			if (ei->i_extra_isize >= YUIHA_INODE_EXTRA_ISIZE &&
+					!yuiha_fresh && !yuiha_grown) {
+				yi->i_origin_seq =
+					le64_to_cpu(yuiha_raw_inode->i_origin_seq);
+				yi->i_origin_crtime =
+					le32_to_cpu(yuiha_raw_inode->i_origin_crtime);
+			}
 		} else {
 			inode->i_fop = &ext3_file_operations;
 		}
@@ -3552,6 +5126,21 @@ again:
 
 		yuiha_raw_inode->i_phantom_root_ino = cpu_to_le32(yi->i_phantom_root_ino);
 		yuiha_raw_inode->i_vtree_nlink = cpu_to_le16(yi->i_vtree_nlink);
+		if (ei->i_extra_isize >= YUIHA_INODE_EXTRA_ISIZE_V1) {
+			yuiha_raw_inode->i_tags = cpu_to_le16(yi->i_tags);
+			yuiha_raw_inode->i_crtime = cpu_to_le32(yi->i_crtime);
+			yuiha_raw_inode->i_seq = cpu_to_le64(yi->i_seq);
+		}
+		if (ei->i_extra_isize >= YUIHA_INODE_EXTRA_ISIZE) {
+			yuiha_raw_inode->i_origin_seq =
+				cpu_to_le64(yi->i_origin_seq);
+			yuiha_raw_inode->i_origin_crtime =
+				cpu_to_le32(yi->i_origin_crtime);
+			yuiha_raw_inode->i_origin_reserved = 0;
+		}
+
+		if (S_ISREG(inode->i_mode))
+			yuiha_vtree_update(inode);
 	}
 
 	BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
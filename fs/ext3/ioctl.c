@@ -17,8 +17,37 @@
 #include <linux/compat.h>
 #include <asm/uaccess.h>
 
+#include "super.h"
 #include "yuiha.h"
 
+/*
+ * The version tree commands.  Plain ext3 mounts share ext3_ioctl(), and
+ * their inodes have no yuiha_inode_info to work on.
+ */
+static int yuiha_ioctl_cmd(unsigned int cmd)
+{
+	switch (cmd) {
+	case YUIHA_IOC_SNAPSHOT_SET:
+	case YUIHA_IOC_RECLAIM_STATS:
+	case YUIHA_IOC_PRUNE:
+	case YUIHA_IOC_SQUASH:
+	case YUIHA_IOC_GET_VTREE:
+	case YUIHA_IOC_FIND_VERSION:
+	case YUIHA_IOC_TAG:
+	case YUIHA_IOC_LOOKUP_TAG:
+	case YUIHA_IOC_DIFF:
+	case YUIHA_IOC_SEND:
+	case YUIHA_IOC_RECEIVE:
+	case YUIHA_IOC_DUMP:
+	case YUIHA_IOC_RESTORE:
+	case YUIHA_IOC_OPEN_VERSION:
+	case YUIHA_IOC_PROMOTE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 long ext3_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct inode *inode = filp->f_dentry->d_inode;
@@ -28,6 +57,9 @@ long ext3_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	ext3_debug ("cmd = %u, arg = %lu\n", cmd, arg);
 
+	if (yuiha_ioctl_cmd(cmd) && !ext3_judge_yuiha(inode->i_sb))
+		return -ENOTTY;
+
 	switch (cmd) {
 	case EXT3_IOC_GETFLAGS:
 		ext3_get_inode_flags(ei);
@@ -297,6 +329,9 @@ group_add_out:
 		mutex_unlock(&inode->i_mutex);
 		mnt_drop_write(filp->f_path.mnt);
 
+		// the blocks are freed in the background
+		if (!err)
+			yuiha_reclaim_queue(inode);
 		return err;
 	}
 	case YUIHA_IOC_LINK_VERSION: {
@@ -308,11 +343,77 @@ group_add_out:
 		int err;
 
 		phantom_root_ino = YUIHA_I(inode)->i_phantom_root_ino;
+		if (!phantom_root_ino) {
+			// No version has been created yet, so there is no
+			// phantom root and the file is its own root.
+			if (ei->i_flags & YUIHA_PHANTOM_ROOT_VERSION_FL)
+				return put_user(YUIHA_I(inode)->i_child_ino,
+						(int __user *) arg);
+			return put_user(inode->i_ino, (int __user *) arg);
+		}
+
 		phantom_root_inode = yuiha_ilookup(inode->i_sb, phantom_root_ino);
+		if (IS_ERR(phantom_root_inode))
+			return PTR_ERR(phantom_root_inode);
 		err = put_user(YUIHA_I(phantom_root_inode)->i_child_ino, (int __user *) arg);
 		iput(phantom_root_inode);
 		return err;
 	}
+	case YUIHA_IOC_SNAPSHOT_SET: {
+		return yuiha_snapshot_set(filp,
+				(struct yuiha_snapshot_set __user *) arg);
+	}
+	case YUIHA_IOC_RECLAIM_STATS: {
+		struct yuiha_reclaim_stats stats;
+
+		yuiha_reclaim_stats(inode->i_sb, &stats);
+		if (copy_to_user((struct yuiha_reclaim_stats __user *) arg,
+				&stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+	case YUIHA_IOC_PRUNE: {
+		return yuiha_prune(filp, (struct yuiha_prune __user *) arg);
+	}
+	case YUIHA_IOC_SQUASH: {
+		return yuiha_squash(filp, (struct yuiha_squash __user *) arg);
+	}
+	case YUIHA_IOC_GET_VTREE: {
+		return yuiha_get_vtree(filp,
+				(struct yuiha_get_vtree __user *) arg);
+	}
+	case YUIHA_IOC_FIND_VERSION: {
+		return yuiha_find_version(filp,
+				(struct yuiha_find_version __user *) arg);
+	}
+	case YUIHA_IOC_TAG: {
+		return yuiha_tag(filp, (struct yuiha_tag __user *) arg);
+	}
+	case YUIHA_IOC_LOOKUP_TAG: {
+		return yuiha_lookup_tag(filp, (struct yuiha_tag __user *) arg);
+	}
+	case YUIHA_IOC_DIFF: {
+		return yuiha_diff(filp, (struct yuiha_diff __user *) arg);
+	}
+	case YUIHA_IOC_SEND: {
+		return yuiha_send(filp, (struct yuiha_send __user *) arg);
+	}
+	case YUIHA_IOC_RECEIVE: {
+		return yuiha_receive(filp, (struct yuiha_receive __user *) arg);
+	}
+	case YUIHA_IOC_DUMP: {
+		return yuiha_dump(filp, (struct yuiha_dump __user *) arg);
+	}
+	case YUIHA_IOC_RESTORE: {
+		return yuiha_restore(filp, (struct yuiha_dump __user *) arg);
+	}
+	case YUIHA_IOC_OPEN_VERSION: {
+		return yuiha_open_version(filp,
+				(struct yuiha_open_version __user *) arg);
+	}
+	case YUIHA_IOC_PROMOTE: {
+		return yuiha_promote(filp, (struct yuiha_promote __user *) arg);
+	}
 
 	default:
 		return -ENOTTY;
@@ -40,6 +40,10 @@
 #include <linux/namei.h>
 #include <linux/dcache.h>
 #include <linux/mount.h>
+#include <linux/file.h>
+#include <linux/fdtable.h>
+#include <linux/sort.h>
+#include <asm/uaccess.h>
 
 #include "namei.h"
 #include "xattr.h"
@@ -1033,6 +1037,24 @@ errout:
 	return NULL;
 }
 
+/*
+ * Take the reference to the parent version @inode keeps while it is in
+ * use, see parent_inode.
+ */
+static void yuiha_hold_parent(struct inode *inode)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+
+	mutex_lock(&yi->i_share_mutex);
+	if (!yi->parent_inode && yi->i_parent_ino) {
+		ext3_debug();
+		yi->parent_inode = ilookup(inode->i_sb, yi->i_parent_ino);
+		if (!yi->parent_inode)
+			yi->parent_inode = ext3_iget(inode->i_sb, yi->i_parent_ino);
+	}
+	mutex_unlock(&yi->i_share_mutex);
+}
+
 static struct dentry *ext3_lookup(struct inode * dir,
 		struct dentry *dentry, struct nameidata *nd)
 {
@@ -1157,12 +1179,7 @@ static struct dentry *ext3_lookup(struct inode * dir,
 						yuiha_create_snapshot(dentry->d_parent, inode, dentry);				
 			}
 
-			if (!yi->parent_inode && yi->i_parent_ino) {
-				ext3_debug();
-				yi->parent_inode = ilookup(dir->i_sb, yi->i_parent_ino);
-				if (!yi->parent_inode)
-					yi->parent_inode = ext3_iget(dir->i_sb, yi->i_parent_ino);
-			}
+			yuiha_hold_parent(inode);
 
 			unsigned long hash = dentry->d_name.hash;
 			hash = partial_name_hash(hash, inode->i_generation);
@@ -2038,12 +2055,10 @@ static int ext3_create (struct inode * dir, struct dentry * dentry, int mode,
 		struct nameidata *nd)
 {
 	handle_t *handle;
-	struct inode *inode, *new_version_inode;
+	struct inode *inode;
 	int err, retries = 0;
 	unsigned long hash = dentry->d_name.hash;
 	struct yuiha_inode_info *yi;
-	struct dentry *new_version_dentry;
-	struct super_block *sb = dir->i_sb;
 	ext3_debug("");
 
 retry:
@@ -2064,6 +2079,15 @@ retry:
 			yi = YUIHA_I(inode);
 			yuiha_sibling_link_self(handle, yi);
 
+			// The phantom root is only allocated together with the
+			// first version, see yuiha_create_phantom_root().
+			// Its pointers get no producer bit until its first
+			// version, see yuiha_versioned().
+			EXT3_I(inode)->i_flags |=
+				YUIHA_ROOT_VERSION_FL | YUIHA_PLAIN_FL;
+			ext3_set_inode_flags(inode);
+			yi->i_phantom_root_ino = 0;
+
 			hash = partial_name_hash(hash, inode->i_generation);
 			hash = partial_name_hash(hash, inode->i_ino);
 			dentry->d_name.hash = end_name_hash(hash);
@@ -2079,21 +2103,6 @@ retry:
 		ext3_set_aops(inode);
 		err = ext3_add_nondir(handle, dentry, inode);
 	}
-
-	if (ext3_judge_yuiha(sb)) {
-		new_version_dentry = yuiha_create_snapshot(dentry->d_parent, inode, dentry);
-		new_version_inode = new_version_dentry->d_inode;
-
-		EXT3_I(inode)->i_flags |= YUIHA_ROOT_VERSION_FL;
-		ext3_set_inode_flags(inode);
-		YUIHA_I(inode)->i_phantom_root_ino = new_version_inode->i_ino;
-		err = ext3_mark_inode_dirty(handle, inode);
-
-		EXT3_I(new_version_inode)->i_flags |= YUIHA_PHANTOM_ROOT_VERSION_FL;
-		ext3_set_inode_flags(new_version_inode);
-		YUIHA_I(new_version_inode)->i_phantom_root_ino = 0;
-		err = ext3_mark_inode_dirty(handle, new_version_inode);
-	}
 	ext3_journal_stop(handle);
 	if (err == -ENOSPC && ext3_should_retry_alloc(dir->i_sb, &retries))
 		goto retry;
@@ -2146,7 +2155,8 @@ static int yuiha_copy_inode_info(
 	
 	memcpy(dst_ext3_ei->i_data, src_ext3_ei->i_data,
 			sizeof(dst_ext3_ei->i_data));
-	dst_ext3_ei->i_flags = src_ext3_ei->i_flags;
+	// a pin belongs to the version it was set on
+	dst_ext3_ei->i_flags = src_ext3_ei->i_flags & ~YUIHA_PINNED_FL;
 	dst_ext3_ei->i_file_acl = src_ext3_ei->i_file_acl;
 	dst_ext3_ei->i_dir_acl = src_ext3_ei->i_dir_acl;
 	dst_ext3_ei->i_dtime = src_ext3_ei->i_dtime;
@@ -2156,6 +2166,9 @@ static int yuiha_copy_inode_info(
 	dst_ext3_ei->i_extra_isize = src_ext3_ei->i_extra_isize;
 	dst_yi->i_phantom_root_ino = src_yi->i_phantom_root_ino;
 	dst_yi->i_vtree_nlink = src_yi->i_vtree_nlink;
+	// a version of a replica is a replica of the same version
+	dst_yi->i_origin_seq = src_yi->i_origin_seq;
+	dst_yi->i_origin_crtime = src_yi->i_origin_crtime;
 
 	dst_inode->i_mode = src_inode->i_mode;
 	dst_inode->i_uid = src_inode->i_uid;
@@ -2184,11 +2197,10 @@ static void yuiha_clear_producer_flg(struct inode *version_i)
 {
 	int i;
 	struct ext3_inode_info *ei = EXT3_I(version_i);
+	__le32 producer = yuiha_producer_le(version_i->i_sb);
 
-	for (i = 0; i < EXT3_N_BLOCKS; i++) {
-		ei->i_data[i] = 
-				cpu_to_le32(clear_producer_flg(le32_to_cpu(ei->i_data[i])));	
-	}
+	for (i = 0; i < EXT3_N_BLOCKS; i++)
+		ei->i_data[i] &= ~producer;
 }
 
 struct inode *yuiha_ilookup(struct super_block *sb, unsigned long ino)
@@ -2237,8 +2249,8 @@ yuiha_add_version_to_tree(
 		yuiha_child_set_zero(handle, target_version_yi);
 		yuiha_sibling_link_self(handle, target_version_yi);
 
-		if (parent_inode)
-			parent_yi->i_child_ino = new_version_inode->i_ino;
+		if (parent_inode && parent_yi->i_child_ino == target_version_inode->i_ino)
+			yuiha_link_child(handle, parent_yi, new_version_yi);
 
 		if (prev_target_version_inode)
 			iput(prev_target_version_inode);
@@ -2290,137 +2302,288 @@ yuiha_add_version_to_tree(
 			iput(prev_target_version_inode);
 	}
 
+	mutex_lock(&target_version_yi->i_share_mutex);
 	target_version_yi->parent_inode = new_version_inode;
+	mutex_unlock(&target_version_yi->i_share_mutex);
 	iput(parent_inode);	
 
 	return 0;
 }
 
-int yuiha_buffer_head_shared(struct inode *version_i)
+/*
+ * Link the leaf @child in among the children of @parent.
+ */
+static void
+yuiha_add_child_to_tree(
+		handle_t *handle,
+		struct yuiha_inode_info *child,
+		struct yuiha_inode_info *parent)
 {
-	struct address_space *mapping = version_i->i_mapping;
-	struct buffer_head *head, *bh;
-	struct pagevec pvec;
-	pgoff_t index, end, done_index;
-	int done = 0, nr_pages;
-	unsigned blocksize = 1 << version_i->i_blkbits;
+	struct inode *first_inode;
+	struct super_block *sb = parent->i_ext3.vfs_inode.i_sb;
 
-	pagevec_init(&pvec, 0);
+	yuiha_link_parent(handle, child, parent);
+	yuiha_child_set_zero(handle, child);
 
-	index = 0;
-	end = version_i->i_size >> PAGE_CACHE_SHIFT;
-	done_index = index;
+	if (!parent->i_child_ino) {
+		yuiha_sibling_link_self(handle, child);
+		yuiha_link_child(handle, parent, child);
+		return;
+	}
+	first_inode = yuiha_ilookup(sb, parent->i_child_ino);
+	yuiha_insert_to_sibling(handle, YUIHA_I(first_inode), child);
+	iput(first_inode);
+}
 
-	while (!done && (index <= end)) {
-		int i;
+/*
+ * Files start out without a phantom root.  It is allocated here, right
+ * before the first version of @root is created, and linked in as the
+ * parent of @root.  It owns no blocks and takes over the tree's
+ * i_vtree_nlink, which lives on the top of the tree.
+ */
+static int yuiha_create_phantom_root(
+				handle_t *handle,
+				struct inode *dir,
+				struct inode *root)
+{
+	struct inode *phantom_root;
+	struct yuiha_inode_info *root_yi = YUIHA_I(root), *phantom_root_yi;
+
+	phantom_root = ext3_new_inode(handle, dir, root->i_mode);
+	if (IS_ERR(phantom_root))
+		return PTR_ERR(phantom_root);
+	phantom_root_yi = YUIHA_I(phantom_root);
+
+	phantom_root->i_uid = root->i_uid;
+	phantom_root->i_gid = root->i_gid;
+	phantom_root->i_op = root->i_op;
+	phantom_root->i_fop = root->i_fop;
+	phantom_root->i_nlink = 1;
+	ext3_set_aops(phantom_root);
+
+	EXT3_I(phantom_root)->i_flags |= YUIHA_PHANTOM_ROOT_VERSION_FL;
+	ext3_set_inode_flags(phantom_root);
+	phantom_root_yi->i_phantom_root_ino = 0;
+	phantom_root_yi->i_vtree_nlink = root_yi->i_vtree_nlink;
+
+	yuiha_sibling_link_self(handle, phantom_root_yi);
+	yuiha_link_child(handle, phantom_root_yi, root_yi);
+	yuiha_link_parent(handle, root_yi, phantom_root_yi);
+	root_yi->i_phantom_root_ino = phantom_root->i_ino;
+	ext3_mark_inode_dirty(handle, root);
+
+	unlock_new_inode(phantom_root);
+	iput(phantom_root);
 
-		nr_pages = pagevec_lookup(&pvec, mapping, index,
-						min(end - index, (pgoff_t)PAGEVEC_SIZE-1) + 1);
+	return 0;
+}
 
-		if (nr_pages == 0)
-			break;
+static int yuiha_need_phantom_root(struct inode *inode)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
 
-		for (i = 0; i < nr_pages; i++) {
-			struct page *page = pvec.pages[i];
-			/*
-			 * At this point, the page may be truncated or
-			 * invalidated (changing page->mapping to NULL), or
-			 * even swizzled back from swapper_space to tmpfs file
-			 * mapping. However, page->index will not change
-			 * because we have a reference on the page.
-			*/
-			if (page->index > end) {
-				done = 1;
-				break;
-			}
+	return !yi->i_parent_ino && !yi->i_phantom_root_ino &&
+		!(EXT3_I(inode)->i_flags & YUIHA_PHANTOM_ROOT_VERSION_FL);
+}
 
-			done_index = page->index + 1;
+/*
+ * Allocate the inode for a new version of @target, everything that can
+ * fail about a snapshot.  The caller holds the target's i_mutex and a
+ * running handle.  Nothing here depends on the size of the file: the
+ * cached pages of the target are picked up lazily by the write path
+ * through i_snapshot_gen.  yuiha_snapshot_link() makes it the target's
+ * parent, yuiha_snapshot_abort() gives it back.
+ */
+static struct inode *yuiha_snapshot_alloc(
+				handle_t *handle,
+				struct inode *dir,
+				struct inode *new_version_target_i)
+{
+	struct inode *new_version_i;
+	int refcount = yuiha_refcount_enabled(dir->i_sb);
+	int err;
 
-			lock_page(page);
+	err = yuiha_mark_versioned(handle, dir->i_sb);
+	if (err)
+		return ERR_PTR(err);
 
-			if (unlikely(page->mapping != mapping)) {
-				unlock_page(page);
-				continue;
-			}
+	// the new version shares everything the target points at
+	if (refcount) {
+		err = yuiha_refcount_share(handle, new_version_target_i, 1);
+		if (err)
+			return ERR_PTR(err);
+	}
 
-			if (!page_has_buffers(page)) {
-				create_empty_buffers(page, blocksize, 0);
-			}
+	// a phantom root left behind by a failure is only allocated early
+	if (yuiha_need_phantom_root(new_version_target_i)) {
+		err = yuiha_create_phantom_root(handle, dir, new_version_target_i);
+		if (err)
+			goto out_unshare;
+	}
 
-			head = page_buffers(page);
-			bh = head;
-			do {
-				set_buffer_shared(bh);
-				bh = bh->b_this_page;
-			} while (bh != head);
+	new_version_i = ext3_new_inode(handle, dir,
+					new_version_target_i->i_mode);
+	if (IS_ERR(new_version_i)) {
+		err = PTR_ERR(new_version_i);
+		goto out_unshare;
+	}
+	return new_version_i;
 
-			SetPageShared(page);
-			unlock_page(page);
-		}
-		index += nr_pages;
-		pagevec_release(&pvec);
+out_unshare:
+	if (refcount)
+		yuiha_refcount_share(handle, new_version_target_i, -1);
+	return ERR_PTR(err);
+}
+
+/*
+ * Give back a version yuiha_snapshot_alloc() allocated for @target.
+ */
+static void yuiha_snapshot_abort(
+				handle_t *handle,
+				struct inode *new_version_target_i,
+				struct inode *new_version_i)
+{
+	if (yuiha_refcount_enabled(new_version_i->i_sb))
+		yuiha_refcount_share(handle, new_version_target_i, -1);
+	drop_nlink(new_version_i);
+	unlock_new_inode(new_version_i);
+	iput(new_version_i);
+}
+
+/*
+ * Link @new_version_i into the version tree as the parent of @target.
+ * Nothing here fails.
+ */
+static void yuiha_snapshot_link(
+				handle_t *handle,
+				struct inode *new_version_target_i,
+				struct inode *new_version_i)
+{
+	struct yuiha_inode_info *new_version_target_yi, *new_version_yi;
+	int err;
+
+	new_version_target_yi = YUIHA_I(new_version_target_i);
+	new_version_yi = YUIHA_I(new_version_i);
+
+	// A plain target hands YUIHA_PLAIN_FL on with its pointers: they
+	// stay unflagged and the new version owns them as they are, while
+	// the target starts borrowing them.  Under truncate_mutex so that
+	// an allocation sees the flag and the bits change together.
+	mutex_lock(&EXT3_I(new_version_target_i)->truncate_mutex);
+	yuiha_copy_inode_info(new_version_yi, new_version_target_yi);
+	EXT3_I(new_version_target_i)->i_flags &= ~YUIHA_PLAIN_FL;
+	yuiha_clear_producer_flg(new_version_target_i);
+	mutex_unlock(&EXT3_I(new_version_target_i)->truncate_mutex);
+	new_version_target_i->i_flags &= ~S_ROOT_VERSION;
+	EXT3_I(new_version_target_i)->i_flags &= ~YUIHA_ROOT_VERSION_FL;
+	ext3_debug("inode %d %d %d", new_version_target_i->i_ino,
+			new_version_target_i->i_flags & S_ROOT_VERSION,
+			EXT3_I(new_version_target_i)->i_flags & YUIHA_ROOT_VERSION_FL);
+
+	new_version_i->i_nlink = 1;
+	yuiha_add_version_to_tree(handle, new_version_yi, new_version_target_yi);
+	yuiha_bump_snapshot_gen(new_version_target_i);
+
+	// the version stands without its index entry, it is just not found
+	err = yuiha_index_add(handle, new_version_i);
+	if (err)
+		ext3_warning(new_version_i->i_sb, __func__,
+			     "version %lu not indexed: %d",
+			     new_version_i->i_ino, err);
+
+	ext3_mark_inode_dirty(handle, new_version_target_i);
+	ext3_mark_inode_dirty(handle, new_version_i);
+}
+
+/*
+ * Allocate a new version of @target and link it into the version tree as
+ * the target's parent.  The caller holds the target's i_mutex and a
+ * running handle.
+ */
+static struct inode *yuiha_snapshot_inode(
+				handle_t *handle,
+				struct inode *dir,
+				struct inode *new_version_target_i)
+{
+	struct inode *new_version_i;
+
+	new_version_i = yuiha_snapshot_alloc(handle, dir, new_version_target_i);
+	if (!IS_ERR(new_version_i))
+		yuiha_snapshot_link(handle, new_version_target_i, new_version_i);
+	return new_version_i;
+}
+
+/*
+ * Allocate a leaf under @version that maps the blocks of @version without
+ * owning any, like the target of a snapshot.  Writing it moves blocks off
+ * @version one by one, so nothing is copied here.  The caller holds
+ * @version's i_mutex and a running handle, and unlocks the new inode.
+ */
+static struct inode *yuiha_branch_inode(
+				handle_t *handle,
+				struct inode *dir,
+				struct inode *version)
+{
+	struct inode *branch;
+	int refcount = yuiha_refcount_enabled(dir->i_sb);
+	int err;
+
+	// the branch shares everything the version points at
+	if (refcount) {
+		err = yuiha_refcount_share(handle, version, 1);
+		if (err)
+			return ERR_PTR(err);
 	}
 
-	return 0;
+	branch = ext3_new_inode(handle, dir, version->i_mode);
+	if (IS_ERR(branch)) {
+		if (refcount)
+			yuiha_refcount_share(handle, version, -1);
+		return branch;
+	}
+
+	yuiha_copy_inode_info(YUIHA_I(branch), YUIHA_I(version));
+	// the root version is the top of the tree, not a leaf
+	branch->i_flags &= ~(S_ROOT_VERSION);
+	// it borrows every block, even those a plain version owns
+	EXT3_I(branch)->i_flags &= ~(YUIHA_ROOT_VERSION_FL | YUIHA_PLAIN_FL);
+	branch->i_nlink = 1;
+	yuiha_clear_producer_flg(branch);
+	yuiha_add_child_to_tree(handle, YUIHA_I(branch), YUIHA_I(version));
+	ext3_mark_inode_dirty(handle, branch);
+
+	return branch;
 }
 
-struct dentry * __yuiha_create_snapshot(
+/*
+ * Allocate and insert a d_entry for a version created by
+ * yuiha_snapshot_inode() and unlock the new inode.
+ */
+static struct dentry *yuiha_snapshot_dentry(
 				struct dentry *parent,
-				struct inode *new_version_target_i,
+				struct inode *new_version_i,
 				struct dentry *lookup_dentry)
 {
-	int err;
-	struct inode *new_version_i, *dir = parent->d_inode;
-	struct yuiha_inode_info *new_version_target_yi, *new_version_yi;
-	struct dentry *new_version = NULL;
+	struct dentry *new_version;
 	unsigned long hash;
-	handle_t *handle;
-
-	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS(dir->i_sb) +
-					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 3 +
-					2 * EXT3_QUOTA_INIT_BLOCKS(dir->i_sb));
-	if (IS_ERR(handle))
-		return PTR_ERR(handle);
 
-	new_version_i = ext3_new_inode(handle, dir,
-					new_version_target_i->i_mode);
-	err = PTR_ERR(new_version_i);
-
-	if (!IS_ERR(new_version_i)) {
-		new_version_target_yi = YUIHA_I(new_version_target_i);
-		new_version_yi = YUIHA_I(new_version_i);
-
-		yuiha_copy_inode_info(new_version_yi, new_version_target_yi);
-		new_version_target_i->i_flags &= ~S_ROOT_VERSION;
-		EXT3_I(new_version_target_i)->i_flags &= ~YUIHA_ROOT_VERSION_FL;
-		ext3_debug("inode %d %d %d", new_version_target_i->i_ino,
-				new_version_target_i->i_flags & S_ROOT_VERSION,
-				EXT3_I(new_version_target_i)->i_flags & YUIHA_ROOT_VERSION_FL);
-
-		new_version_i->i_nlink = 1;
-		yuiha_add_version_to_tree(handle, new_version_yi, new_version_target_yi);
-		yuiha_buffer_head_shared(new_version_target_i);
-		yuiha_clear_producer_flg(new_version_target_i);
-
-		ext3_mark_inode_dirty(handle, new_version_target_i);
-		ext3_mark_inode_dirty(handle, new_version_i);
-
-		// allocate and insert a newversion d_entry
-		new_version = d_alloc(parent, &lookup_dentry->d_name);
-		hash = new_version->d_name.hash;
-		hash = partial_name_hash(hash, new_version_i->i_generation);
-		hash = partial_name_hash(hash, new_version_i->i_ino);
-		new_version->d_name.hash = end_name_hash(hash);
-		ext3_debug("new_version->d_name.hash=%u", new_version->d_name.hash);
-
-		d_splice_alias(new_version_i, new_version);
-		atomic_inc(&new_version_i->i_count);
+	new_version = d_alloc(parent, &lookup_dentry->d_name);
+	if (!new_version) {
 		unlock_new_inode(new_version_i);
-		dput(new_version);
+		iput(new_version_i);
+		return ERR_PTR(-ENOMEM);
 	}
 
-	ext3_debug("new_version_i->i_ino=%u", new_version_i->i_ino);
-	ext3_journal_stop(handle);
+	hash = new_version->d_name.hash;
+	hash = partial_name_hash(hash, new_version_i->i_generation);
+	hash = partial_name_hash(hash, new_version_i->i_ino);
+	new_version->d_name.hash = end_name_hash(hash);
+	ext3_debug("new_version->d_name.hash=%u", new_version->d_name.hash);
+
+	d_splice_alias(new_version_i, new_version);
+	atomic_inc(&new_version_i->i_count);
+	unlock_new_inode(new_version_i);
+	dput(new_version);
 
 	return new_version;
 }
@@ -2430,38 +2593,549 @@ struct dentry * yuiha_create_snapshot(
 				struct inode *new_version_target_i,
 				struct dentry *lookup_dentry)
 {
-	struct dentry *new_version;
+	struct inode *new_version_i, *dir = lookup_dentry->d_parent->d_inode;
+	handle_t *handle;
 	ext3_debug("");
 
+	// i_mutex has to be taken before the handle is started, the same
+	// order as the rest of ext3.  It only covers the tree update.
 	mutex_lock(&new_version_target_i->i_mutex);
 
-	new_version =
-		__yuiha_create_snapshot(lookup_dentry->d_parent,
-				new_version_target_i, lookup_dentry);
+	handle = ext3_journal_start(dir, YUIHA_SNAPSHOT_TRANS_BLOCKS(dir->i_sb));
+	if (IS_ERR(handle)) {
+		mutex_unlock(&new_version_target_i->i_mutex);
+		return ERR_CAST(handle);
+	}
+
+	new_version_i = yuiha_snapshot_inode(handle, dir, new_version_target_i);
+	ext3_journal_stop(handle);
 
 	mutex_unlock(&new_version_target_i->i_mutex);
 
-	return new_version;
+	if (IS_ERR(new_version_i))
+		return ERR_CAST(new_version_i);
+	ext3_debug("new_version_i->i_ino=%lu", new_version_i->i_ino);
+
+	return yuiha_snapshot_dentry(lookup_dentry->d_parent,
+			new_version_i, lookup_dentry);
+}
+
+struct yuiha_set_entry {
+	struct file *file;
+	struct inode *version;
+	int index;
+};
+
+static int yuiha_cmp_set_entry(const void *a, const void *b)
+{
+	unsigned long a_ino =
+		((struct yuiha_set_entry *)a)->file->f_dentry->d_inode->i_ino;
+	unsigned long b_ino =
+		((struct yuiha_set_entry *)b)->file->f_dentry->d_inode->i_ino;
+
+	if (a_ino < b_ino)
+		return -1;
+	return a_ino > b_ino;
+}
+
+/*
+ * YUIHA_IOC_SNAPSHOT_SET: create a version of every file in the set
+ * inside one transaction.  All the targets' i_mutex are held while the
+ * versions are created, so the set is consistent at a single point in
+ * time.  They are taken in inode number order, each in a lockdep subclass
+ * of its own, which is what caps the set size.  Every version is allocated before the
+ * first is linked in, so a failure gives them all back and the set is
+ * versioned whole or not at all.  The set has to fit one transaction.
+ */
+int yuiha_snapshot_set(struct file *filp,
+		struct yuiha_snapshot_set __user *uarg)
+{
+	struct super_block *sb = filp->f_dentry->d_inode->i_sb;
+	struct yuiha_snapshot_set set;
+	struct yuiha_set_entry *entries = NULL;
+	__s32 *fds = NULL;
+	__u32 *inos = NULL;
+	handle_t *handle;
+	int i, nr_files = 0, nr_locked = 0, err;
+
+#ifdef CONFIG_LOCKDEP
+	BUILD_BUG_ON(YUIHA_SNAPSHOT_SET_MAX > MAX_LOCKDEP_SUBCLASSES);
+#endif
+	if (copy_from_user(&set, uarg, sizeof(set)))
+		return -EFAULT;
+	if (!set.count || set.count > YUIHA_SNAPSHOT_SET_MAX)
+		return -EINVAL;
+	if (set.count * YUIHA_SNAPSHOT_TRANS_BLOCKS(sb) >
+			EXT3_SB(sb)->s_journal->j_max_transaction_buffers)
+		return -E2BIG;
+
+	err = -ENOMEM;
+	fds = kcalloc(set.count, sizeof(*fds), GFP_KERNEL);
+	inos = kcalloc(set.count, sizeof(*inos), GFP_KERNEL);
+	entries = kcalloc(set.count, sizeof(*entries), GFP_KERNEL);
+	if (!fds || !inos || !entries)
+		goto out;
+
+	err = -EFAULT;
+	if (copy_from_user(fds, (void __user *)(unsigned long)set.fds,
+				set.count * sizeof(*fds)))
+		goto out;
+
+	for (nr_files = 0; nr_files < set.count; nr_files++) {
+		struct file *f = fget(fds[nr_files]);
+		struct inode *inode;
+
+		err = -EBADF;
+		if (!f)
+			goto out;
+
+		inode = f->f_dentry->d_inode;
+		if (inode->i_sb != sb)
+			err = -EXDEV;
+		else if (!S_ISREG(inode->i_mode))
+			err = -EINVAL;
+		else if (!(f->f_mode & FMODE_WRITE))
+			err = -EBADF;
+		else
+			err = mnt_want_write(f->f_path.mnt);
+		if (err) {
+			fput(f);
+			goto out;
+		}
+		entries[nr_files].file = f;
+		entries[nr_files].index = nr_files;
+	}
+
+	sort(entries, set.count, sizeof(*entries), yuiha_cmp_set_entry, NULL);
+	for (i = 1; i < set.count; i++) {
+		err = -EINVAL;
+		if (entries[i].file->f_dentry->d_inode ==
+				entries[i - 1].file->f_dentry->d_inode)
+			goto out;
+	}
+
+	for (nr_locked = 0; nr_locked < set.count; nr_locked++)
+		mutex_lock_nested(
+			&entries[nr_locked].file->f_dentry->d_inode->i_mutex,
+			nr_locked);
+
+	handle = ext3_journal_start_sb(sb,
+			set.count * YUIHA_SNAPSHOT_TRANS_BLOCKS(sb));
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out;
+	}
+
+	err = 0;
+	for (i = 0; i < set.count; i++) {
+		struct dentry *dentry = entries[i].file->f_dentry;
+		struct inode *version;
+
+		version = yuiha_snapshot_alloc(handle,
+				dentry->d_parent->d_inode, dentry->d_inode);
+		if (IS_ERR(version)) {
+			err = PTR_ERR(version);
+			break;
+		}
+		entries[i].version = version;
+	}
+	for (i = 0; i < set.count && entries[i].version; i++) {
+		struct inode *target = entries[i].file->f_dentry->d_inode;
+
+		if (err) {
+			yuiha_snapshot_abort(handle, target, entries[i].version);
+			entries[i].version = NULL;
+		} else {
+			yuiha_snapshot_link(handle, target, entries[i].version);
+		}
+	}
+	ext3_journal_stop(handle);
+
+	while (nr_locked)
+		mutex_unlock(&entries[--nr_locked].file->f_dentry->d_inode->i_mutex);
+
+	for (i = 0; i < set.count && entries[i].version; i++) {
+		struct dentry *dentry = entries[i].file->f_dentry;
+
+		inos[entries[i].index] = entries[i].version->i_ino;
+		yuiha_snapshot_dentry(dentry->d_parent, entries[i].version, dentry);
+	}
+
+	if (copy_to_user((void __user *)(unsigned long)set.inos, inos,
+				set.count * sizeof(*inos)))
+		err = -EFAULT;
+
+out:
+	while (nr_locked)
+		mutex_unlock(&entries[--nr_locked].file->f_dentry->d_inode->i_mutex);
+	for (i = 0; i < nr_files; i++) {
+		mnt_drop_write(entries[i].file->f_path.mnt);
+		fput(entries[i].file);
+	}
+	kfree(entries);
+	kfree(inos);
+	kfree(fds);
+	return err;
+}
+
+/*
+ * Whether @a and @b are versions of the same tree.  The phantom root
+ * tells right away, a tree from before the phantom roots is walked up.
+ */
+int yuiha_same_tree(struct inode *a, struct inode *b)
+{
+	struct inode *ra, *rb;
+	int same;
+
+	if (a == b)
+		return 1;
+	if (YUIHA_I(a)->i_phantom_root_ino)
+		return YUIHA_I(a)->i_phantom_root_ino ==
+			YUIHA_I(b)->i_phantom_root_ino;
+	if (YUIHA_I(b)->i_phantom_root_ino)
+		return 0;
+
+	ra = yuiha_trace_root(a);
+	rb = yuiha_trace_root(b);
+	same = (ra ? ra : a) == (rb ? rb : b);
+	if (ra)
+		iput(ra);
+	if (rb)
+		iput(rb);
+	return same;
 }
 
+/*
+ * The inode number @arg asks for, relative to @inode.  The walk goes
+ * through the topology cache.
+ */
+static int yuiha_resolve_version(struct inode *inode,
+		struct yuiha_open_version *arg, unsigned long *ino)
+{
+	struct super_block *sb = inode->i_sb;
+	struct yuiha_vnode vn;
+	unsigned long first;
+	__u32 n;
+	int err;
+
+	*ino = inode->i_ino;
+	switch (arg->how) {
+	case YUIHA_OPEN_INO:
+		*ino = arg->ino;
+		return 0;
+	case YUIHA_OPEN_ANCESTOR:
+		for (n = 0; n < arg->nr; n++) {
+			err = yuiha_vtree_lookup(sb, *ino, &vn);
+			if (err)
+				return err;
+			if (!vn.parent)
+				return -ENOENT;
+			*ino = vn.parent;
+		}
+		return 0;
+	case YUIHA_OPEN_CHILD:
+		err = yuiha_vtree_lookup(sb, *ino, &vn);
+		if (err)
+			return err;
+		// children are a ring through their sibling links
+		first = *ino = vn.child;
+		for (n = 0; *ino && n < arg->nr; n++) {
+			err = yuiha_vtree_lookup(sb, *ino, &vn);
+			if (err)
+				return err;
+			*ino = vn.sibling_next;
+			if (*ino == first)
+				return -ENOENT;
+		}
+		return *ino ? 0 : -ENOENT;
+	}
+	return -EINVAL;
+}
+
+/*
+ * The dentry of version @inode under the name @head was opened by, hashed
+ * the way ext3_lookup() hashes it.  Consumes the reference to @inode.
+ */
+struct dentry *yuiha_version_dentry(struct dentry *head,
+		struct inode *inode)
+{
+	struct dentry *parent = head->d_parent, *dentry;
+	struct qstr name = head->d_name;
+	unsigned long hash;
+
+	if (head->d_inode == inode) {
+		iput(inode);
+		return dget(head);
+	}
+
+	hash = full_name_hash(name.name, name.len);
+	hash = partial_name_hash(hash, inode->i_generation);
+	hash = partial_name_hash(hash, inode->i_ino);
+	name.hash = end_name_hash(hash);
+
+	mutex_lock(&parent->d_inode->i_mutex);
+	dentry = d_lookup(parent, &name);
+	if (dentry && dentry->d_inode != inode) {
+		dput(dentry);
+		dentry = NULL;
+	}
+	if (dentry) {
+		iput(inode);
+	} else {
+		dentry = d_alloc(parent, &name);
+		if (dentry) {
+			yuiha_hold_parent(inode);
+			d_add(dentry, inode);
+		} else {
+			iput(inode);
+			dentry = ERR_PTR(-ENOMEM);
+		}
+	}
+	mutex_unlock(&parent->d_inode->i_mutex);
+	return dentry;
+}
+
+/*
+ * Open another version of the tree the version @filp is open on belongs
+ * to, by inode and generation, ancestor or child.  Frozen versions open
+ * read-only: writing one branches it, which takes a name to open by.
+ */
+int yuiha_open_version(struct file *filp,
+		struct yuiha_open_version __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *version;
+	struct yuiha_open_version arg;
+	struct dentry *dentry;
+	struct file *f;
+	unsigned long ino;
+	int acc, mask = 0, fd, err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~(O_ACCMODE | O_APPEND | O_NONBLOCK | O_CLOEXEC) ||
+			arg.reserved)
+		return -EINVAL;
+	acc = arg.flags & O_ACCMODE;
+	if (acc == O_ACCMODE)
+		return -EINVAL;
+	if (acc != O_WRONLY)
+		mask |= MAY_READ;
+	if (acc != O_RDONLY)
+		mask |= MAY_WRITE;
+
+	err = yuiha_resolve_version(inode, &arg, &ino);
+	if (err)
+		return err == -ESTALE ? -ENOENT : err;
+	version = yuiha_ilookup(inode->i_sb, ino);
+	if (IS_ERR(version))
+		return PTR_ERR(version) == -ESTALE ? -ENOENT :
+			PTR_ERR(version);
+
+	err = -ENOENT;
+	if (!yuiha_file(version) || !version->i_nlink ||
+			EXT3_I(version)->i_flags & (YUIHA_PHANTOM_VERSION_FL |
+				YUIHA_PHANTOM_ROOT_VERSION_FL) ||
+			(arg.how == YUIHA_OPEN_INO &&
+			 version->i_generation != arg.generation) ||
+			!yuiha_same_tree(inode, version))
+		goto out_iput;
+	err = -EROFS;
+	if (mask & MAY_WRITE && YUIHA_I(version)->i_child_ino)
+		goto out_iput;
+	err = inode_permission(version, mask);
+	if (err)
+		goto out_iput;
+
+	arg.ino = version->i_ino;
+	arg.generation = version->i_generation;
+	err = -EFAULT;
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		goto out_iput;
+
+	dentry = yuiha_version_dentry(filp->f_dentry, version);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	// get_unused_fd_flags() is not there for modules
+	fd = get_unused_fd();
+	if (fd < 0) {
+		dput(dentry);
+		return fd;
+	}
+	if (arg.flags & O_CLOEXEC) {
+		spin_lock(&current->files->file_lock);
+		FD_SET(fd, files_fdtable(current->files)->close_on_exec);
+		spin_unlock(&current->files->file_lock);
+	}
+	f = dentry_open(dentry, mntget(filp->f_path.mnt),
+			arg.flags | O_LARGEFILE, current_cred());
+	if (IS_ERR(f)) {
+		put_unused_fd(fd);
+		return PTR_ERR(f);
+	}
+	fd_install(fd, f);
+	return fd;
+
+out_iput:
+	iput(version);
+	return err;
+}
+
+/*
+ * YUIHA_IOC_PROMOTE: make a version of the tree the head of the name
+ * @filp was opened by.  The directory entry is pointed at a leaf holding
+ * the version: the version itself if it is a leaf, a new branch under it
+ * if it is frozen.  The old head stays in the tree as a leaf of its own,
+ * it has lost a name and the new head has gained one, so no link count
+ * changes.  No block is copied or written, the cost does not depend on
+ * the size of the file.
+ */
+int yuiha_promote(struct file *filp, struct yuiha_promote __user *uarg)
+{
+	struct dentry *dentry = filp->f_dentry;
+	struct inode *inode = dentry->d_inode, *dir, *version, *head = NULL;
+	struct super_block *sb = inode->i_sb;
+	struct ext3_dir_entry_2 *de;
+	struct buffer_head *bh = NULL;
+	struct yuiha_promote arg;
+	handle_t *handle;
+	int err, err2;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	// the promoted version replaces what is written through the name
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	version = yuiha_ilookup(sb, arg.ino);
+	if (IS_ERR(version))
+		return PTR_ERR(version) == -ESTALE ? -ENOENT :
+			PTR_ERR(version);
+	err = -ENOENT;
+	if (!yuiha_file(version) || !version->i_nlink ||
+			version->i_generation != arg.generation ||
+			EXT3_I(version)->i_flags & (YUIHA_PHANTOM_VERSION_FL |
+				YUIHA_PHANTOM_ROOT_VERSION_FL |
+				YUIHA_TEARDOWN_FL) ||
+			!yuiha_same_tree(inode, version))
+		goto out;
+	err = inode_permission(version, MAY_READ);
+	if (err)
+		goto out;
+
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		goto out;
+	dir = dentry->d_parent->d_inode;
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	err = inode_permission(dir, MAY_WRITE | MAY_EXEC);
+	if (err)
+		goto out_unlock_dir;
+
+	// @filp has to be open by the name, not as another version
+	err = -ENOENT;
+	bh = ext3_find_entry(dir, &dentry->d_name, &de);
+	if (!bh || le32_to_cpu(de->inode) != inode->i_ino)
+		goto out_unlock_dir;
+	if (version == inode) {
+		head = igrab(inode);
+		err = 0;
+		goto out_unlock_dir;
+	}
+
+	mutex_lock(&version->i_mutex);
+	handle = ext3_journal_start(dir, YUIHA_SNAPSHOT_TRANS_BLOCKS(sb));
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out_unlock;
+	}
+	if (IS_DIRSYNC(dir))
+		handle->h_sync = 1;
+
+	BUFFER_TRACE(bh, "get write access");
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err)
+		goto out_stop;
+
+	if (YUIHA_I(version)->i_child_ino) {
+		head = yuiha_branch_inode(handle, dir, version);
+		if (IS_ERR(head)) {
+			err = PTR_ERR(head);
+			head = NULL;
+			goto out_stop;
+		}
+		unlock_new_inode(head);
+	} else {
+		head = igrab(version);
+	}
+
+	de->inode = cpu_to_le32(head->i_ino);
+	ext3_set_de_type(sb, de, head->i_mode);
+	dir->i_version++;
+	dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
+	ext3_mark_inode_dirty(handle, dir);
+	BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
+	err = ext3_journal_dirty_metadata(handle, bh);
+	// ext3 has no d_revalidate, the next lookup of the name has to miss
+	// the dcache and read the entry again
+	if (!err)
+		d_drop(dentry);
+
+	inode->i_ctime = head->i_ctime = dir->i_ctime;
+	ext3_mark_inode_dirty(handle, inode);
+	ext3_mark_inode_dirty(handle, head);
+out_stop:
+	err2 = ext3_journal_stop(handle);
+	if (!err)
+		err = err2;
+out_unlock:
+	mutex_unlock(&version->i_mutex);
+out_unlock_dir:
+	mutex_unlock(&dir->i_mutex);
+	brelse(bh);
+	mnt_drop_write(filp->f_path.mnt);
+out:
+	iput(version);
+	if (!head)
+		return err;
+
+	// the dentry @filp holds is unhashed and stays that of a version like
+	// any other, lookups of the name instantiate the new head
+	arg.head_ino = head->i_ino;
+	arg.head_generation = head->i_generation;
+	iput(head);
+	if (!err && copy_to_user(uarg, &arg, sizeof(arg)))
+		err = -EFAULT;
+	return err;
+}
+
+/*
+ * Return the top of the version tree @inode belongs to, or NULL when the
+ * inode has no parent.  The walk goes through the topology cache, only
+ * the top itself is instantiated.
+ */
 struct inode *yuiha_trace_root(struct inode *inode)
 {
 	struct yuiha_inode_info *yi = YUIHA_I(inode);
-	struct inode *ancestor_inode = NULL;
-	unsigned long ancestor_ino;
+	struct yuiha_vnode vn;
+	struct inode *root_inode;
+	unsigned long ancestor_ino, root_ino = 0;
 
 	ancestor_ino = yi->i_parent_ino;
-	while(ancestor_ino) {
-		if (!NULL)
-			iput(ancestor_inode);
-
-		ancestor_inode = ilookup(inode->i_sb, ancestor_ino);
-		if (!ancestor_inode)
-			ancestor_inode = ext3_iget(inode->i_sb, ancestor_ino);
-		ancestor_ino = YUIHA_I(ancestor_inode)->i_parent_ino;
+	while (ancestor_ino) {
+		root_ino = ancestor_ino;
+		if (yuiha_vtree_lookup(inode->i_sb, ancestor_ino, &vn))
+			return NULL;
+		ancestor_ino = vn.parent;
 	}
+	if (!root_ino)
+		return NULL;
 
-	return ancestor_inode;
+	root_inode = yuiha_ilookup(inode->i_sb, root_ino);
+	if (IS_ERR(root_inode))
+		return NULL;
+	return root_inode;
 }
 
 int yuiha_drop_vtree_nlink(struct inode *inode)
@@ -2506,6 +3180,10 @@ int yuiha_detach_version(handle_t *handle, struct inode *inode)
 	// if deleted version has sibling versions
 	if (yuiha_test_sibling_link_self(yi)) {
 		if (!parent_yi) {
+			// A file that has never been versioned has neither a
+			// parent nor a child version, nothing to detach from
+			if (!child_yi)
+				goto out;
 			if (!yuiha_test_sibling_link_self(child_yi))
 				error = -1; // TODO: error handling
 			child_yi->i_parent_ino = 0;
@@ -2590,33 +3268,92 @@ out:
 	return error;
 }
 
+/*
+ * Drop the in-core parent pointers the children of @deleted_inode hold.
+ * Children that are not in core cannot hold one, so they are skipped
+ * rather than read in.
+ */
 void yuiha_detatch_parent(struct inode *deleted_inode)
 {
 	struct yuiha_inode_info *yi = YUIHA_I(deleted_inode), *sibling_yi;
 	struct inode *sibling;
 	struct super_block *sb = deleted_inode->i_sb;
-	__u32 sibling_ino;
-
-	if (!yi->i_child_ino)
-		return;
+	struct yuiha_vnode vn;
+	unsigned long sibling_ino;
+	int put;
 
 	sibling_ino = yi->i_child_ino;
-	do {
-		sibling = yuiha_ilookup(sb, sibling_ino);
-		sibling_yi = YUIHA_I(sibling);
+	while (sibling_ino) {
+		sibling = ilookup(sb, sibling_ino);
+		if (sibling) {
+			sibling_yi = YUIHA_I(sibling);
+			mutex_lock(&sibling_yi->i_share_mutex);
+			put = sibling_yi->parent_inode == deleted_inode;
+			if (put)
+				sibling_yi->parent_inode = NULL;
+			mutex_unlock(&sibling_yi->i_share_mutex);
+			// may be the last reference, so not under i_share_mutex
+			if (put)
+				iput(deleted_inode);
+			iput(sibling);
+		}
 
-		if (sibling_yi->parent_inode) {
-			//mutex_lock(&sibling->i_mutex);
-			sibling_yi->parent_inode = NULL;
-			//mutex_unlock(&sibling->i_mutex);
+		if (yuiha_vtree_lookup(sb, sibling_ino, &vn))
+			break;
+		sibling_ino = vn.sibling_next;
+		if (sibling_ino == yi->i_child_ino)
+			break;
+	}
+}
 
-			sibling_ino = sibling_yi->i_sibling_next_ino;
-			iput(deleted_inode);
+/*
+ * Cut the chain of versions @chain[0 .. @nr-1], nearest to @survivor
+ * first, out of the tree: @survivor takes the place of the last among the
+ * children of its parent.  The chain versions are left without any links,
+ * so their last iput() frees them without touching the tree.  Called
+ * with @survivor's i_mutex held, the parent's is taken here.
+ */
+int yuiha_squash_link(handle_t *handle, struct inode *survivor,
+		struct inode **chain, int nr)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(survivor), *top_yi, *parent_yi;
+	struct inode *top = chain[nr - 1], *parent, *prev;
+	struct super_block *sb = survivor->i_sb;
+	int i, err;
+
+	top_yi = YUIHA_I(top);
+	parent = yuiha_ilookup(sb, top_yi->i_parent_ino);
+	if (IS_ERR(parent))
+		return PTR_ERR(parent);
+	parent_yi = YUIHA_I(parent);
+	mutex_lock_nested(&parent->i_mutex, I_MUTEX_PARENT);
+
+	if (!yuiha_test_sibling_link_self(top_yi)) {
+		prev = yuiha_ilookup(sb, top_yi->i_sibling_prev_ino);
+		if (IS_ERR(prev)) {
+			err = PTR_ERR(prev);
+			goto out;
 		}
-		iput(sibling);
-	} while (sibling_ino != yi->i_child_ino);
-
-	return;
+		yuiha_remove_from_sibling(handle, top_yi);
+		yuiha_insert_to_sibling(handle, YUIHA_I(prev), yi);
+		iput(prev);
+	}
+	if (parent_yi->i_child_ino == top->i_ino)
+		yuiha_link_child(handle, parent_yi, yi);
+	yuiha_link_parent(handle, yi, parent_yi);
+
+	for (i = 0; i < nr; i++) {
+		top_yi = YUIHA_I(chain[i]);
+		top_yi->i_parent_ino = 0;
+		top_yi->i_parent_generation = 0;
+		yuiha_child_set_zero(handle, top_yi);
+		yuiha_sibling_link_self(handle, top_yi);
+	}
+	err = ext3_mark_inode_dirty(handle, parent);
+out:
+	mutex_unlock(&parent->i_mutex);
+	iput(parent);
+	return err;
 }
 
 int yuiha_delete_version(handle_t *handle,
@@ -2661,6 +3398,8 @@ int yuiha_delete_version(handle_t *handle,
 		retval = ext3_delete_entry(handle, dir, de, bh);
 		if (retval)
 			goto end_delete_version;
+		// the name is gone, the last close must not keep the inode
+		d_drop(filp->f_dentry);
 
 		dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
 		ext3_update_dx_flag(dir);
@@ -2671,9 +3410,17 @@ int yuiha_delete_version(handle_t *handle,
 
 		vtree_nlink = yuiha_drop_vtree_nlink(root_version_inode);
 		if (!vtree_nlink) {
-			// TODO: Free all versions
+			// No name leads into the tree any more, its top takes
+			// every version along when it goes.
+			EXT3_I(root_version_inode)->i_flags |= YUIHA_TEARDOWN_FL;
+			if (root_version_inode->i_nlink) {
+				clear_nlink(root_version_inode);
+				ext3_orphan_add(handle, root_version_inode);
+			}
 		}
-		mark_inode_dirty(root_version_inode);
+		ext3_mark_inode_dirty(handle, root_version_inode);
+		if (!vtree_nlink)
+			yuiha_reclaim_queue(root_version_inode);
 		iput(root_version_inode);
 	}
 
@@ -2691,6 +3438,199 @@ end_delete_version:
 	return retval;
 }
 
+// versions put on the orphan list per transaction by a teardown
+#define YUIHA_TEARDOWN_BATCH	16
+
+/*
+ * Whether inode @ino is still allocated.  Only asked during orphan
+ * recovery, when ext3_iget() hands out freed inodes as well.
+ */
+static int yuiha_inode_in_use(struct super_block *sb, unsigned long ino)
+{
+	unsigned long group = (ino - 1) / EXT3_INODES_PER_GROUP(sb);
+	struct buffer_head *bitmap_bh;
+	int used;
+
+	bitmap_bh = ext3_read_inode_bitmap(sb, group);
+	if (!bitmap_bh)
+		return -EIO;
+	used = ext3_test_bit((ino - 1) % EXT3_INODES_PER_GROUP(sb),
+			bitmap_bh->b_data);
+	brelse(bitmap_bh);
+	return used;
+}
+
+/*
+ * Collect the versions below @root into a freshly allocated array, top
+ * down.  The links come from the topology cache.  Every version has to
+ * point back at the one it was reached from, so a damaged tree can
+ * neither pull in unrelated inodes nor loop.  Returns their number or a
+ * negative errno.
+ */
+int yuiha_collect_tree(struct inode *root, unsigned long **inos)
+{
+	struct super_block *sb = root->i_sb;
+	unsigned long limit = le32_to_cpu(EXT3_SB(sb)->s_es->s_inodes_count);
+	unsigned long *array = NULL, *tmp, parent, first, ino;
+	struct yuiha_vnode vn;
+	int count = 0, size = 0, next = 0, err;
+
+	*inos = NULL;
+	parent = root->i_ino;
+	first = YUIHA_I(root)->i_child_ino;
+	for (;;) {
+		for (ino = first; ino; ino = vn.sibling_next) {
+			if (count == size) {
+				err = -EIO;
+				if (size >= limit)
+					goto corrupt;
+				size = size ? size * 2 : 16;
+				tmp = krealloc(array, size * sizeof(*array),
+						GFP_NOFS);
+				err = -ENOMEM;
+				if (!tmp)
+					goto fail;
+				array = tmp;
+			}
+			err = yuiha_vtree_lookup(sb, ino, &vn);
+			// deleted versions still hold the tree together
+			if (err == -ESTALE)
+				err = yuiha_read_vnode(sb, ino, &vn, 1);
+			if (err)
+				goto fail;
+			if (vn.parent != parent) {
+				err = -EIO;
+				goto corrupt;
+			}
+			array[count++] = ino;
+			if (vn.sibling_next == first)
+				break;
+		}
+		if (next == count)
+			break;
+		parent = array[next++];
+		err = yuiha_vtree_lookup(sb, parent, &vn);
+		if (err == -ESTALE)
+			err = yuiha_read_vnode(sb, parent, &vn, 1);
+		if (err)
+			goto fail;
+		first = vn.child;
+	}
+
+	*inos = array;
+	return count;
+
+corrupt:
+	ext3_error(sb, "yuiha_collect_tree",
+			"damaged version tree below inode %lu at inode %lu",
+			root->i_ino, ino);
+fail:
+	kfree(array);
+	return err;
+}
+
+/*
+ * Free every version below @root, the top of a tree no name leads to any
+ * more.  Each version is flagged YUIHA_TEARDOWN_FL and put on the orphan
+ * list, YUIHA_TEARDOWN_BATCH of them per transaction, and the tree is cut
+ * off @root before the versions are let go.  A flagged version is
+ * truncated on its own: it frees the blocks it owns and drops the
+ * pointers to everything else without asking its children or leaving the
+ * tree, so every block goes exactly once and every pointer tree is
+ * walked once.  A crash leaves the rest to the orphan cleanup, which
+ * frees flagged versions the same way and starts over on @root.
+ *
+ * Returns the number of versions let go, -EBUSY while one of them is
+ * still in use.
+ */
+int yuiha_teardown_tree(struct inode *root)
+{
+	struct super_block *sb = root->i_sb;
+	int orphan_fs = EXT3_SB(sb)->s_mount_state & EXT3_ORPHAN_FS;
+	struct inode **versions = NULL, *inode;
+	unsigned long *inos;
+	handle_t *handle;
+	int count, i, err;
+
+	count = yuiha_collect_tree(root, &inos);
+	if (count <= 0)
+		return count;
+	err = -ENOMEM;
+	versions = kcalloc(count, sizeof(*versions), GFP_NOFS);
+	if (!versions)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		if (orphan_fs) {
+			// freed by the orphan cleanup already
+			err = yuiha_inode_in_use(sb, inos[i]);
+			if (err < 0)
+				goto out;
+			if (!err)
+				continue;
+		}
+		inode = yuiha_ilookup(sb, inos[i]);
+		if (IS_ERR(inode)) {
+			err = PTR_ERR(inode);
+			if (err == -ESTALE)
+				continue;
+			goto out;
+		}
+		versions[i] = inode;
+		d_prune_aliases(inode);
+		err = -EBUSY;
+		if (atomic_read(&inode->i_count) > 1)
+			goto out;
+	}
+
+	handle = NULL;
+	for (i = 0; i < count; i++) {
+		inode = versions[i];
+		if (!inode)
+			continue;
+		if (!handle) {
+			handle = ext3_journal_start_sb(sb,
+					3 * YUIHA_TEARDOWN_BATCH + 2);
+			err = PTR_ERR(handle);
+			if (IS_ERR(handle))
+				goto out;
+		}
+		EXT3_I(inode)->i_flags |= YUIHA_TEARDOWN_FL;
+		if (inode->i_nlink) {
+			clear_nlink(inode);
+			ext3_orphan_add(handle, inode);
+		}
+		ext3_mark_inode_dirty(handle, inode);
+		if (i % YUIHA_TEARDOWN_BATCH == YUIHA_TEARDOWN_BATCH - 1) {
+			ext3_journal_stop(handle);
+			handle = NULL;
+		}
+	}
+
+	if (!handle) {
+		handle = ext3_journal_start_sb(sb, 1);
+		err = PTR_ERR(handle);
+		if (IS_ERR(handle))
+			goto out;
+	}
+	YUIHA_I(root)->i_child_ino = 0;
+	err = ext3_mark_inode_dirty(handle, root);
+	ext3_journal_stop(handle);
+	if (!err)
+		for (i = 0; i < count; i++)
+			err += versions[i] != NULL;
+
+out:
+	// each version is freed by its last iput()
+	if (versions) {
+		for (i = 0; i < count; i++)
+			iput(versions[i]);
+		kfree(versions);
+	}
+	kfree(inos);
+	return err;
+}
+
 static int ext3_mkdir(struct inode * dir, struct dentry * dentry, int mode)
 {
 	handle_t *handle;
@@ -16,6 +16,8 @@
 #include <linux/errno.h>
 #include <linux/slab.h>
 
+#include "yuiha.h"
+
 
 #define outside(b, first, last)	((b) < (first) || (b) >= (last))
 #define inside(b, first, last)	((b) >= (first) && (b) < (last))
@@ -782,6 +784,13 @@ int ext3_group_add(struct super_block *sb, struct ext3_new_group_data *input)
 		return -EINVAL;
 	}
 
+	if (yuiha_producer_limit(sb, le32_to_cpu(es->s_blocks_count) +
+				input->blocks_count)) {
+		ext3_warning(sb, __func__, "past the producer bit, "
+			     "mount with -o fulladdr\n");
+		return -EINVAL;
+	}
+
 	if (le32_to_cpu(es->s_inodes_count) + EXT3_INODES_PER_GROUP(sb) <
 	    le32_to_cpu(es->s_inodes_count)) {
 		ext3_warning(sb, __func__, "inodes_count overflow\n");
@@ -1017,6 +1026,12 @@ int ext3_group_extend(struct super_block *sb, struct ext3_super_block *es,
 		return -EINVAL;
 	}
 
+	if (yuiha_producer_limit(sb, o_blocks_count + add)) {
+		ext3_warning(sb, __func__, "past the producer bit, "
+			     "mount with -o fulladdr");
+		return -EINVAL;
+	}
+
 	if (o_blocks_count + add > n_blocks_count)
 		add = n_blocks_count - o_blocks_count;
 
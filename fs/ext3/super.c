@@ -44,6 +44,7 @@
 #include "acl.h"
 #include "namei.h"
 #include "super.h"
+#include "yuiha.h"
 
 #ifdef CONFIG_EXT3_DEFAULTS_TO_ORDERED
   #define EXT3_MOUNT_DEFAULT_DATA_MODE EXT3_MOUNT_ORDERED_DATA
@@ -402,6 +403,10 @@ static void ext3_put_super (struct super_block * sb)
 	lock_kernel();
 
 	ext3_xattr_put_super(sb);
+	if (ext3_judge_yuiha(sb)) {
+		yuiha_refcount_put_super(sb);
+		yuiha_vtree_put_super(sb);
+	}
 	err = journal_destroy(sbi->s_journal);
 	sbi->s_journal = NULL;
 	if (err < 0)
@@ -469,6 +474,9 @@ static struct inode *ext3_alloc_inode(struct super_block *sb)
 		if (!yi)
 				return NULL;
 		ei = &yi->i_ext3;
+		yuiha_init_page_gen(&ei->vfs_inode);
+		mutex_init(&yi->i_share_mutex);
+		yi->i_dio_start = yi->i_dio_end = 0;
 	} else {
 		ei = kmem_cache_alloc(ext3_inode_cachep, GFP_NOFS);
 		if (!ei)
@@ -558,6 +566,8 @@ static void ext3_clear_inode(struct inode *inode)
 	EXT3_I(inode)->i_block_alloc_info = NULL;
 	if (unlikely(rsv))
 		kfree(rsv);
+	if (ext3_judge_yuiha(inode->i_sb))
+		yuiha_free_page_gen(inode);
 }
 
 static inline void ext3_show_quota_options(struct seq_file *seq, struct super_block *sb)
@@ -668,6 +678,8 @@ static int ext3_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_puts(seq, ",barrier=1");
 	if (test_opt(sb, NOBH))
 		seq_puts(seq, ",nobh");
+	if (sbi->s_reclaim_rate)
+		seq_printf(seq, ",reclaim_rate=%lu", sbi->s_reclaim_rate);
 
 	seq_printf(seq, ",data=%s", data_mode_string(sbi->s_mount_opt &
 						     EXT3_MOUNT_DATA_FLAGS));
@@ -828,7 +840,7 @@ enum {
 	Opt_usrjquota, Opt_grpjquota, Opt_offusrjquota, Opt_offgrpjquota,
 	Opt_jqfmt_vfsold, Opt_jqfmt_vfsv0, Opt_quota, Opt_noquota,
 	Opt_ignore, Opt_barrier, Opt_err, Opt_resize, Opt_usrquota,
-	Opt_grpquota
+	Opt_grpquota, Opt_refcount, Opt_fulladdr, Opt_reclaim_rate
 };
 
 static const match_table_t tokens = {
@@ -881,6 +893,9 @@ static const match_table_t tokens = {
 	{Opt_usrquota, "usrquota"},
 	{Opt_barrier, "barrier=%u"},
 	{Opt_resize, "resize"},
+	{Opt_refcount, "refcount"},
+	{Opt_fulladdr, "fulladdr"},
+	{Opt_reclaim_rate, "reclaim_rate=%u"},
 	{Opt_err, NULL},
 };
 
@@ -1238,6 +1253,21 @@ set_qf_format:
 		case Opt_bh:
 			clear_opt(sbi->s_mount_opt, NOBH);
 			break;
+		case Opt_refcount:
+			set_opt(sbi->s_mount_opt, YUIHA_REFCOUNT);
+			break;
+		case Opt_fulladdr:
+			// ownership then comes from the reference map alone
+			set_opt(sbi->s_mount_opt, YUIHA_REFCOUNT);
+			set_opt(sbi->s_mount_opt, YUIHA_FULLADDR);
+			break;
+		case Opt_reclaim_rate:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_reclaim_rate = option;
+			break;
 		default:
 			printk (KERN_ERR
 				"EXT3-fs: Unrecognized mount option \"%s\" "
@@ -1586,6 +1616,33 @@ static ext3_fsblk_t descriptor_loc(struct super_block *sb,
 	return (has_super + ext3_group_first_block_no(sb, bg));
 }
 
+static int ext3_is_yuiha_type(struct super_block *sb)
+{
+	return strncmp(sb->s_type->name, "yuiha", strlen("yuiha")) == 0;
+}
+
+/*
+ * Only yuiha keeps the block reference map up to date, a plain ext3
+ * mount of such a filesystem has to stay read-only.
+ */
+static unsigned int ext3_ro_compat_supp(struct super_block *sb)
+{
+	if (ext3_is_yuiha_type(sb))
+		return EXT3_FEATURE_RO_COMPAT_SUPP |
+			EXT3_FEATURE_RO_COMPAT_YUIHA_REFCOUNT;
+	return EXT3_FEATURE_RO_COMPAT_SUPP;
+}
+
+/*
+ * Block pointers without producer bits only make sense to yuiha.
+ */
+static unsigned int ext3_incompat_supp(struct super_block *sb)
+{
+	if (ext3_is_yuiha_type(sb))
+		return EXT3_FEATURE_INCOMPAT_SUPP |
+			EXT3_FEATURE_INCOMPAT_YUIHA_FULLADDR;
+	return EXT3_FEATURE_INCOMPAT_SUPP;
+}
 
 static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 {
@@ -1624,6 +1681,11 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	sbi->s_resuid = EXT3_DEF_RESUID;
 	sbi->s_resgid = EXT3_DEF_RESGID;
 	sbi->s_sb_block = sb_block;
+	/*
+	 * Decides which cache ext3_alloc_inode() takes inodes from, so it is
+	 * known before the journal and root inodes are read.
+	 */
+	sbi->s_is_yuiha = ext3_is_yuiha_type(sb);
 
 	unlock_kernel();
 
@@ -1712,14 +1774,37 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	 * previously didn't change the revision level when setting the flags,
 	 * so there is a chance incompat flags are set on a rev 0 filesystem.
 	 */
-	features = EXT3_HAS_INCOMPAT_FEATURE(sb, ~EXT3_FEATURE_INCOMPAT_SUPP);
+	features = EXT3_HAS_INCOMPAT_FEATURE(sb, ~ext3_incompat_supp(sb));
 	if (features) {
 		printk(KERN_ERR "EXT3-fs: %s: couldn't mount because of "
 		       "unsupported optional features (%x).\n",
 		       sb->s_id, le32_to_cpu(features));
 		goto failed_mount;
 	}
-	features = EXT3_HAS_RO_COMPAT_FEATURE(sb, ~EXT3_FEATURE_RO_COMPAT_SUPP);
+	if (EXT3_HAS_INCOMPAT_FEATURE(sb, EXT3_FEATURE_INCOMPAT_YUIHA_FULLADDR)) {
+		if (!EXT3_HAS_RO_COMPAT_FEATURE(sb,
+				EXT3_FEATURE_RO_COMPAT_YUIHA_REFCOUNT)) {
+			printk(KERN_ERR "EXT3-fs: %s: full block numbers "
+			       "without a block reference map\n", sb->s_id);
+			goto failed_mount;
+		}
+		sbi->s_producer_le = 0;
+	} else {
+		sbi->s_producer_le = PRODUCER_FLG_LE;
+		/*
+		 * Bit 31 of a block pointer is the producer bit, a block
+		 * past it cannot be addressed until the pointers are
+		 * converted.
+		 */
+		if (ext3_is_yuiha_type(sb) &&
+		    !test_opt(sb, YUIHA_FULLADDR) &&
+		    le32_to_cpu(es->s_blocks_count) > (1U << PRODUCER_BITS)) {
+			printk(KERN_ERR "EXT3-fs: %s: too large for producer "
+			       "bits, mount with -o fulladdr\n", sb->s_id);
+			goto failed_mount;
+		}
+	}
+	features = EXT3_HAS_RO_COMPAT_FEATURE(sb, ~ext3_ro_compat_supp(sb));
 	if (!(sb->s_flags & MS_RDONLY) && features) {
 		printk(KERN_ERR "EXT3-fs: %s: couldn't mount RDWR because of "
 		       "unsupported optional features (%x).\n",
@@ -1788,6 +1873,11 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 			goto failed_mount;
 		}
 	}
+	if (sbi->s_is_yuiha && sbi->s_inode_size < sizeof(struct yuiha_inode)) {
+		printk(KERN_ERR "EXT3-fs: %s: inodes of %d bytes have no room "
+		       "for the version links\n", sb->s_id, sbi->s_inode_size);
+		goto failed_mount;
+	}
 	sbi->s_frag_size = EXT3_MIN_FRAG_SIZE <<
 				   le32_to_cpu(es->s_log_frag_size);
 	if (blocksize != sbi->s_frag_size) {
@@ -2013,6 +2103,24 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	}
 
 	ext3_setup_super (sb, es, sb->s_flags & MS_RDONLY);
+
+	/*
+	 * Set up before the orphans are truncated: they may have versions,
+	 * and the block reference map decides which of their blocks go.
+	 */
+	if (sbi->s_is_yuiha) {
+		mutex_init(&sbi->s_index_mutex);
+		ret = yuiha_vtree_setup(sb);
+		if (!ret)
+			ret = yuiha_refcount_setup(sb);
+		if (ret) {
+			yuiha_vtree_put_super(sb);
+			dput(sb->s_root);
+			sb->s_root = NULL;
+			goto failed_mount4;
+		}
+	}
+
 	/*
 	 * akpm: core read_super() calls in here with the superblock locked.
 	 * That deadlocks, because orphan cleanup needs to lock the superblock
@@ -2027,16 +2135,18 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	if (needs_recovery)
 		printk (KERN_INFO "EXT3-fs: recovery complete.\n");
 	ext3_mark_recovery_complete(sb, es);
+	if (sbi->s_is_yuiha) {
+		yuiha_fulladdr_setup(sb);
+		if (yuiha_reclaim_start(sb))
+			printk(KERN_WARNING "EXT3-fs: %s: no reclaim thread, "
+			       "deleted versions go with their last close\n",
+			       sb->s_id);
+	}
 	printk (KERN_INFO "EXT3-fs: mounted filesystem with %s data mode.\n",
 		test_opt(sb,DATA_FLAGS) == EXT3_MOUNT_JOURNAL_DATA ? "journal":
 		test_opt(sb,DATA_FLAGS) == EXT3_MOUNT_ORDERED_DATA ? "ordered":
 		"writeback");
 
-	if (strncmp(sb->s_type->name, "yuiha", strlen("yuiha")) == 0)
-		sbi->s_is_yuiha = 1;
-	else
-		sbi->s_is_yuiha = 0;
-
 	lock_kernel();
 	return 0;
 
@@ -2554,6 +2664,7 @@ static int ext3_remount (struct super_block * sb, int * flags, char * data)
 	old_opts.s_resuid = sbi->s_resuid;
 	old_opts.s_resgid = sbi->s_resgid;
 	old_opts.s_commit_interval = sbi->s_commit_interval;
+	old_opts.s_reclaim_rate = sbi->s_reclaim_rate;
 #ifdef CONFIG_QUOTA
 	old_opts.s_jquota_fmt = sbi->s_jquota_fmt;
 	for (i = 0; i < MAXQUOTAS; i++)
@@ -2611,7 +2722,7 @@ static int ext3_remount (struct super_block * sb, int * flags, char * data)
 		} else {
 			__le32 ret;
 			if ((ret = EXT3_HAS_RO_COMPAT_FEATURE(sb,
-					~EXT3_FEATURE_RO_COMPAT_SUPP))) {
+					~ext3_ro_compat_supp(sb)))) {
 				printk(KERN_WARNING "EXT3-fs: %s: couldn't "
 				       "remount RDWR because of unsupported "
 				       "optional features (%x).\n",
@@ -2665,6 +2776,7 @@ restore_opts:
 	sbi->s_resuid = old_opts.s_resuid;
 	sbi->s_resgid = old_opts.s_resgid;
 	sbi->s_commit_interval = old_opts.s_commit_interval;
+	sbi->s_reclaim_rate = old_opts.s_reclaim_rate;
 #ifdef CONFIG_QUOTA
 	sbi->s_jquota_fmt = old_opts.s_jquota_fmt;
 	for (i = 0; i < MAXQUOTAS; i++) {
@@ -3041,11 +3153,22 @@ static struct file_system_type ext3_fs_type = {
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 
+/*
+ * The reclaim thread holds deleted versions, they have to go before the
+ * inodes are evicted.
+ */
+static void yuiha_kill_sb(struct super_block *sb)
+{
+	if (sb->s_fs_info)
+		yuiha_reclaim_stop(sb);
+	kill_block_super(sb);
+}
+
 static struct file_system_type yuiha_fs_type = {
 	.owner = THIS_MODULE,
 	.name = "yuiha",
 	.get_sb = ext3_get_sb,
-	.kill_sb = kill_block_super,
+	.kill_sb = yuiha_kill_sb,
 	.fs_flags = FS_REQUIRES_DEV,
 };
 
@@ -3057,12 +3180,17 @@ static int __init init_ext3_fs(void)
 	err = init_inodecache();
 	if (err)
 		goto out1;
+	err = init_yuiha_vtree();
+	if (err)
+		goto out2;
         err = register_filesystem(&ext3_fs_type);
         err = register_filesystem(&yuiha_fs_type);
 	if (err)
 		goto out;
 	return 0;
 out:
+	exit_yuiha_vtree();
+out2:
 	destroy_inodecache();
 out1:
 	exit_ext3_xattr();
@@ -3073,6 +3201,7 @@ static void __exit exit_ext3_fs(void)
 {
 	unregister_filesystem(&ext3_fs_type);
 	unregister_filesystem(&yuiha_fs_type);
+	exit_yuiha_vtree();
 	destroy_inodecache();
 	exit_ext3_xattr();
 }
@@ -7,16 +7,162 @@ extern int yuiha_delete_version(handle_t *handle,
 		struct file *filp, unsigned long vno);
 extern struct inode *yuiha_ilookup(struct super_block *sb, unsigned long ino);
 extern int yuiha_detach_version(handle_t *handle, struct inode *inode);
+extern struct inode *yuiha_trace_root(struct inode *inode);
+extern int yuiha_same_tree(struct inode *a, struct inode *b);
+extern struct dentry *yuiha_version_dentry(struct dentry *head,
+		struct inode *inode);
+extern void yuiha_detatch_parent(struct inode *deleted_inode);
+extern int yuiha_squash_link(handle_t *handle, struct inode *survivor,
+		struct inode **chain, int nr);
+extern int yuiha_collect_tree(struct inode *root, unsigned long **inos);
+extern int yuiha_teardown_tree(struct inode *root);
 extern int yuiha_vlink(struct file *filp, const char __user *newname);
+extern int yuiha_snapshot_set(struct file *filp,
+		struct yuiha_snapshot_set __user *uarg);
+extern int yuiha_open_version(struct file *filp,
+		struct yuiha_open_version __user *uarg);
+extern int yuiha_promote(struct file *filp,
+		struct yuiha_promote __user *uarg);
+
+/*
+ * Credits for creating one version: the new inode plus the inodes whose
+ * tree links change, same estimate as ext3_create, and the superblock
+ * for the first version, and a block of the version index.  The first
+ * version of a file also allocates its phantom root, a second inode of
+ * the same estimate.  The block reference map extends the handle.
+ */
+#define YUIHA_SNAPSHOT_TRANS_BLOCKS(sb) (3 * EXT3_DATA_TRANS_BLOCKS(sb) + \
+		EXT3_INDEX_EXTRA_TRANS_BLOCKS + 4 + 3 * EXT3_QUOTA_INIT_BLOCKS(sb))
+
+// fs/ext3/yuiha_vtree.c
+struct yuiha_vnode {
+	unsigned long ino;
+	__u32 generation;
+	unsigned long parent;
+	unsigned long child;
+	unsigned long sibling_next;
+	unsigned long sibling_prev;
+	unsigned long phantom_root;
+	__u32 flags;			// ext3 i_flags
+	unsigned int nlink;
+	loff_t size;
+	blkcnt_t blocks;		// 512-byte sectors, as i_blocks
+	__u32 mtime;
+	unsigned int tags;
+};
+
+extern int yuiha_vtree_lookup(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn);
+extern void yuiha_vtree_update(struct inode *inode);
+extern void yuiha_vtree_forget(struct super_block *sb, unsigned long ino);
+extern int yuiha_vtree_setup(struct super_block *sb);
+extern void yuiha_vtree_put_super(struct super_block *sb);
+extern int init_yuiha_vtree(void);
+extern void exit_yuiha_vtree(void);
+
+// fs/ext3/yuiha_refcount.c
+static inline int yuiha_refcount_enabled(struct super_block *sb)
+{
+	return EXT3_SB(sb)->s_refcount_inode != NULL;
+}
+
+extern void yuiha_refcount_lock(struct super_block *sb);
+extern void yuiha_refcount_unlock(struct super_block *sb);
+extern int yuiha_refcount_get(struct super_block *sb, ext3_fsblk_t blk,
+		u32 *extra);
+extern int yuiha_refcount_add(handle_t *handle, struct super_block *sb,
+		__le32 *p, int nr, int delta);
+extern int yuiha_refcount_release(handle_t *handle, struct super_block *sb,
+		ext3_fsblk_t blk);
+extern int yuiha_refcount_credits(struct super_block *sb, __le32 *p, int nr);
+extern int yuiha_refcount_share(handle_t *handle, struct inode *inode,
+		int delta);
+extern int yuiha_mark_versioned(handle_t *handle, struct super_block *sb);
+extern int yuiha_refcount_setup(struct super_block *sb);
+extern void yuiha_fulladdr_setup(struct super_block *sb);
+extern void yuiha_refcount_put_super(struct super_block *sb);
+
+// fs/ext3/yuiha_prune.c
+extern int yuiha_prune(struct file *filp, struct yuiha_prune __user *uarg);
+extern int yuiha_squash(struct file *filp, struct yuiha_squash __user *uarg);
+
+// fs/ext3/yuiha_query.c
+extern int yuiha_get_vtree(struct file *filp,
+		struct yuiha_get_vtree __user *uarg);
+extern int yuiha_diff_ranges(struct inode *inode, struct inode *other,
+		u64 from, struct yuiha_diff_range *r, u32 count, u64 *next);
+extern int yuiha_diff(struct file *filp, struct yuiha_diff __user *uarg);
+
+// fs/ext3/yuiha_index.c
+extern int yuiha_index_add(handle_t *handle, struct inode *version);
+extern int yuiha_find_version(struct file *filp,
+		struct yuiha_find_version __user *uarg);
+
+// fs/ext3/yuiha_tag.c
+extern int yuiha_tag(struct file *filp, struct yuiha_tag __user *uarg);
+extern int yuiha_lookup_tag(struct file *filp, struct yuiha_tag __user *uarg);
+
+// fs/ext3/yuiha_send.c
+extern int yuiha_send(struct file *filp, struct yuiha_send __user *uarg);
+extern int yuiha_receive(struct file *filp,
+		struct yuiha_receive __user *uarg);
+extern int yuiha_dump(struct file *filp, struct yuiha_dump __user *uarg);
+extern int yuiha_restore(struct file *filp, struct yuiha_dump __user *uarg);
+
+// fs/ext3/yuiha_reclaim.c
+extern void yuiha_reclaim_queue(struct inode *inode);
+extern void yuiha_reclaim_stats(struct super_block *sb,
+		struct yuiha_reclaim_stats *stats);
+extern int yuiha_reclaim_start(struct super_block *sb);
+extern void yuiha_reclaim_stop(struct super_block *sb);
+
+// fs/ext3/inode.c
+extern int yuiha_read_vnode(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn, int unlinked);
+extern int yuiha_file(struct inode *inode);
+extern int yuiha_versioned(struct inode *inode);
+extern int yuiha_punch_blocks(struct inode *inode, sector_t iblock,
+		unsigned long count);
+extern int yuiha_strip_blocks(struct inode *inode);
+extern int yuiha_truncate_into(struct inode *inode, struct inode *heir);
+extern int yuiha_owned_blocks(struct inode *inode, u64 *owned);
+extern int yuiha_ptr_owned(struct super_block *sb, __le32 v);
 
 // fs/ext3/yuiha_buffer_head.c
 #define PRODUCER_BITS 31
+// the producer bit of a block pointer as it is stored
+#define PRODUCER_FLG_LE cpu_to_le32(1U << PRODUCER_BITS)
+
+/*
+ * The producer bit as this filesystem stores it: 0 in the fulladdr
+ * format, where pointers hold full 32-bit block numbers and the block
+ * reference map alone tells ownership.
+ */
+static inline __le32 yuiha_producer_le(struct super_block *sb)
+{
+	return EXT3_SB(sb)->s_producer_le;
+}
+
+static inline ext3_fsblk_t yuiha_block_nr(struct super_block *sb, __le32 v)
+{
+	return le32_to_cpu(v & ~yuiha_producer_le(sb));
+}
+
+// whether a yuiha filesystem of @blocks blocks needs the fulladdr format
+static inline int yuiha_producer_limit(struct super_block *sb,
+		ext3_fsblk_t blocks)
+{
+	return EXT3_SB(sb)->s_is_yuiha && yuiha_producer_le(sb) &&
+		blocks > (1UL << PRODUCER_BITS);
+}
 
 enum {
 	BH_Shared = BH_PrivateStart + 10,
+	BH_Overwrite = BH_PrivateStart + 11,	// COW may skip reading old data
 };
 
 BUFFER_FNS(Shared, shared)
+BUFFER_FNS(Overwrite, overwrite)
 
 enum {
 	PG_shared = 0x20,
@@ -26,10 +172,15 @@ PAGEFLAG(Shared, shared)
 TESTSCFLAG(Shared, shared)
 __CLEARPAGEFLAG(Shared, shared)
 
+void yuiha_init_page_gen(struct inode *inode);
+void yuiha_free_page_gen(struct inode *inode);
+void yuiha_bump_snapshot_gen(struct inode *inode);
 int yuiha_block_write_begin(struct file *file, struct address_space *mapping,
 				loff_t pos, unsigned len, unsigned flags,
 				struct page **pagep, void **fsdata,
 				get_block_t *get_block);
+int yuiha_block_write_end(struct page *page, loff_t pos, unsigned len,
+				unsigned copied, void *fsdata);
 
 inline int test_producer_flg(__u32 datablock_number);
 inline int set_producer_flg(__u32 datablock_number);
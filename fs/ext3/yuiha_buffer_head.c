@@ -25,12 +25,178 @@
 #include <linux/journal-head.h>
 #include "yuiha.h"
 
+/*
+ * Pages checked against the snapshot generation are tracked in chunks of
+ * YUIHA_GEN_CHUNK_PAGES.  A chunk stamped with an older generation counts
+ * as empty, so taking a snapshot never has to touch the chunks.
+ */
+#define YUIHA_GEN_CHUNK_SHIFT	12
+#define YUIHA_GEN_CHUNK_PAGES	(1UL << YUIHA_GEN_CHUNK_SHIFT)
+
+struct yuiha_gen_chunk {
+	unsigned long key;
+	unsigned long gen;
+	unsigned long map[BITS_TO_LONGS(YUIHA_GEN_CHUNK_PAGES)];
+};
+
+void yuiha_init_page_gen(struct inode *inode)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+
+	yi->i_snapshot_gen = 0;
+	yi->i_snapshot_size = 0;
+	spin_lock_init(&yi->i_page_gen_lock);
+	INIT_RADIX_TREE(&yi->i_page_gen, GFP_ATOMIC);
+}
+
+void yuiha_free_page_gen(struct inode *inode)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	struct yuiha_gen_chunk *chunks[16];
+	unsigned long index = 0;
+	int i, nr;
+
+	do {
+		nr = radix_tree_gang_lookup(&yi->i_page_gen, (void **)chunks,
+						index, ARRAY_SIZE(chunks));
+		for (i = 0; i < nr; i++) {
+			index = chunks[i]->key + 1;
+			radix_tree_delete(&yi->i_page_gen, chunks[i]->key);
+			kfree(chunks[i]);
+		}
+	} while (nr);
+}
+
+/*
+ * Called by the snapshot code with the target's i_mutex held.  Everything
+ * cached up to the current size is shared with the new parent version
+ * from now on.
+ */
+void yuiha_bump_snapshot_gen(struct inode *inode)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+
+	spin_lock(&yi->i_page_gen_lock);
+	yi->i_snapshot_size = i_size_read(inode);
+	yi->i_snapshot_gen++;
+	spin_unlock(&yi->i_page_gen_lock);
+}
+
+/*
+ * Returns 1 if @page has not been looked at since the latest snapshot
+ * and records that it has been now.  A missing chunk is made of *@new,
+ * or -EAGAIN returned if there is none.
+ */
+static int yuiha_test_set_page_gen(struct yuiha_inode_info *yi,
+		struct yuiha_gen_chunk **new, pgoff_t index)
+{
+	struct yuiha_gen_chunk *chunk;
+	unsigned long key = index >> YUIHA_GEN_CHUNK_SHIFT,
+								bit = index & (YUIHA_GEN_CHUNK_PAGES - 1);
+
+	chunk = radix_tree_lookup(&yi->i_page_gen, key);
+	if (!chunk) {
+		if (!*new)
+			return -EAGAIN;
+		chunk = *new;
+		if (radix_tree_insert(&yi->i_page_gen, key, chunk))
+			return -ENOMEM;
+		*new = NULL;
+		chunk->key = key;
+		chunk->gen = 0;
+	}
+
+	if (chunk->gen != yi->i_snapshot_gen) {
+		memset(chunk->map, 0, sizeof(chunk->map));
+		chunk->gen = yi->i_snapshot_gen;
+	}
+	return !__test_and_set_bit(bit, chunk->map);
+}
+
+/*
+ * Mark a page shared the first time it is written after a snapshot.  This
+ * does lazily what used to be a walk of the whole page cache at snapshot
+ * time.  Pages beyond the size the file had when the snapshot was taken
+ * never held shared blocks.
+ */
+static int yuiha_check_snapshot_gen(struct inode *inode, struct page *page)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	struct yuiha_gen_chunk *new = NULL;
+	struct buffer_head *head, *bh;
+	int ret;
+
+	if (!yi->i_snapshot_gen ||
+			page_offset(page) >= yi->i_snapshot_size)
+		return 0;
+
+	// the chunk is there for all but the first page written in it
+	spin_lock(&yi->i_page_gen_lock);
+	ret = yuiha_test_set_page_gen(yi, &new, page->index);
+	spin_unlock(&yi->i_page_gen_lock);
+
+	if (ret == -EAGAIN) {
+		new = kmalloc(sizeof(*new), GFP_NOFS);
+		if (!new)
+			return -ENOMEM;
+		if (radix_tree_preload(GFP_NOFS)) {
+			kfree(new);
+			return -ENOMEM;
+		}
+		spin_lock(&yi->i_page_gen_lock);
+		ret = yuiha_test_set_page_gen(yi, &new, page->index);
+		spin_unlock(&yi->i_page_gen_lock);
+		radix_tree_preload_end();
+		kfree(new);
+	}
+
+	if (ret <= 0)
+		return ret;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, 1 << inode->i_blkbits, 0);
+	head = page_buffers(page);
+	bh = head;
+	do {
+		set_buffer_shared(bh);
+		bh = bh->b_this_page;
+	} while (bh != head);
+	SetPageShared(page);
+
+	return 0;
+}
+
+/*
+ * Shared buffers that the write covers completely are copied-on-write
+ * without reading their old data first.  Should copying from user space
+ * then fall short, the old data has to be brought back into the new
+ * block, so the old block numbers travel to write_end in @fsdata.
+ */
+struct yuiha_overwrite {
+	unsigned long map;
+	sector_t old_blocknr[MAX_BUF_PER_PAGE];
+};
+
+static int yuiha_can_overwrite(struct inode *inode, struct page *page,
+		struct buffer_head *bh, void **fsdata)
+{
+	if (!fsdata || PageUptodate(page) || buffer_uptodate(bh) ||
+			!buffer_mapped(bh) || !buffer_shared(bh))
+		return 0;
+	// journalled data would have to be journalled again on a short copy
+	if (ext3_should_journal_data(inode))
+		return 0;
+	if (!*fsdata)
+		*fsdata = kzalloc(sizeof(struct yuiha_overwrite), GFP_NOFS);
+	return *fsdata != NULL;
+}
+
 static int __yuiha_block_prepare_write(
 		struct inode *inode, struct page *page, struct page *parent_page, 
-		unsigned from, unsigned to, get_block_t *get_block)
+		unsigned from, unsigned to, get_block_t *get_block, void **fsdata)
 {
 	unsigned block_start, block_end;
-	sector_t block;
+	sector_t block, old_blocknr;
 	int err = 0;
 	unsigned blocksize, bbits;
 	struct buffer_head *bh, *parent_bh, *head, *parent_head,
@@ -107,7 +273,24 @@ static int __yuiha_block_prepare_write(
 		if (!buffer_mapped(bh) || buffer_shared(bh)) {
 			WARN_ON(bh->b_size != blocksize);
 			ext3_debug("inode->i_ino=%lu", inode->i_ino);
+			old_blocknr = bh->b_blocknr;
+			if (block_start >= from && block_end <= to &&
+					yuiha_can_overwrite(inode, page, bh, fsdata))
+				set_buffer_overwrite(bh);
 			err = get_block(inode, block, bh, 1);
+			if (buffer_overwrite(bh)) {
+				// unread either way, so not uptodate below
+				clear_buffer_overwrite(bh);
+				clear_buffer_shared(bh);
+				// the copy left the old data behind
+				if (!err && bh->b_blocknr != old_blocknr) {
+					struct yuiha_overwrite *ow = *fsdata;
+					int nr = block_start >> bbits;
+
+					ow->map |= 1UL << nr;
+					ow->old_blocknr[nr] = old_blocknr;
+				}
+			}
 			if (err)
 				break;
 
@@ -161,14 +344,15 @@ static int __yuiha_block_prepare_write(
 
 static int yuiha_block_prepare_write(
 		struct inode *inode, struct page *page, struct page *parent_page, 
-		unsigned start, unsigned end, get_block_t *get_block) {
+		unsigned start, unsigned end, get_block_t *get_block,
+		void **fsdata) {
 
 	int status = 0;
 	if (parent_page && PageShared(page))
 		BUG_ON(!PageLocked(parent_page));
 
 	status = __yuiha_block_prepare_write(inode, page, parent_page, 
-					start, end, get_block);
+					start, end, get_block, fsdata);
 
 	if (parent_page && PageShared(page))
 		unlock_page(parent_page);
@@ -176,6 +360,117 @@ static int yuiha_block_prepare_write(
 	return status;
 }
 
+/*
+ * Hand the cached data shared with the parent version over to the parent
+ * rather than copying it there.  @page moves to the parent's page cache at
+ * the same index and the writer gets a fresh page, into which the blocks
+ * it does not overwrite completely are copied.  The shared data then lives
+ * in memory once and is never written back through two mappings.
+ *
+ * Only a clean, unmapped and uptodate page whose buffers can be released
+ * can move, and only to a parent that has no page of its own there.
+ * Returns the fresh page, locked, NULL if @page has to be copied as
+ * before, or an ERR_PTR.  Once @page has left the writer's mapping it
+ * does not go back: if the parent cannot take it, the parent reads the
+ * unchanged blocks from disk later.
+ *
+ * @page is detached with invalidate_inode_pages2_range(), which wants it
+ * unlocked.  Relocking it under i_share_mutex is safe: the only ones who
+ * take i_share_mutex with a page locked are the writers of the file, and
+ * i_mutex keeps them out.
+ */
+static struct page *yuiha_handoff_page(struct inode *inode,
+		struct inode *parent_inode, struct page *page,
+		unsigned from, unsigned to, unsigned flags, get_block_t *get_block)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct page *new_page;
+	struct buffer_head *head, *bh;
+	unsigned blocksize = 1 << inode->i_blkbits, block_start, block_end;
+	pgoff_t index = page->index;
+	sector_t block;
+	char *src, *dst;
+	int partial = 0, err;
+
+	if (!PageUptodate(page) || PageDirty(page) || PageWriteback(page) ||
+			page_mapped(page))
+		return NULL;
+	new_page = find_get_page(parent_inode->i_mapping, page->index);
+	if (new_page) {
+		page_cache_release(new_page);
+		return NULL;
+	}
+
+	// releases the buffers and drops the reference of the writer's mapping
+	unlock_page(page);
+	err = invalidate_inode_pages2_range(mapping, index, index);
+	lock_page(page);
+	// buffers still held by the journal, or dirtied meanwhile
+	if (page->mapping == mapping)
+		return NULL;
+	if (err)
+		return ERR_PTR(err);
+
+	ClearPageShared(page);
+	// -EEXIST if the parent read its own page in meanwhile, which is as
+	// good, and -ENOMEM leaves the parent to read the blocks from disk
+	err = add_to_page_cache_locked(page, parent_inode->i_mapping, index,
+			GFP_NOFS);
+	if (err && err != -EEXIST && err != -ENOMEM)
+		return ERR_PTR(err);
+
+	new_page = grab_cache_page_write_begin(mapping, index,
+			flags | AOP_FLAG_NOFS);
+	if (!new_page)
+		return ERR_PTR(-ENOMEM);
+
+	if (!page_has_buffers(new_page))
+		create_empty_buffers(new_page, blocksize, 0);
+	head = page_buffers(new_page);
+
+	if (!PageUptodate(new_page)) {
+		src = kmap(page);
+		dst = kmap(new_page);
+		for (bh = head, block_start = 0; bh != head || !block_start;
+				block_start = block_end, bh = bh->b_this_page) {
+			block_end = block_start + blocksize;
+			if (block_start >= from && block_end <= to) {
+				partial = 1;
+				continue;
+			}
+			memcpy(dst + block_start, src + block_start, blocksize);
+			set_buffer_uptodate(bh);
+		}
+		kunmap(new_page);
+		kunmap(page);
+		if (!partial)
+			SetPageUptodate(new_page);
+	}
+
+	// Whether a block is still shared is up to get_block to tell.
+	block = (sector_t)new_page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+	bh = head;
+	do {
+		// an unread block must be mapped to be overwritten without a read
+		if (!buffer_uptodate(bh) && !buffer_mapped(bh)) {
+			err = get_block(inode, block, bh, 0);
+			if (err) {
+				unlock_page(new_page);
+				page_cache_release(new_page);
+				return ERR_PTR(err);
+			}
+		}
+		block++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	do {
+		set_buffer_shared(bh);
+		bh = bh->b_this_page;
+	} while (bh != head);
+	return new_page;
+}
+
 /*
  * block_write_begin takes care of the basic task of block allocation and
  * bringing partial write blocks uptodate first.
@@ -194,15 +489,15 @@ int yuiha_block_write_begin(struct file *file, struct address_space *mapping,
 	struct page *page;
 	pgoff_t index;
 	unsigned start, end;
-	int ownpage = 0, parent_ownpage = 0;
+	int ownpage = 0;
 	struct yuiha_inode_info *yi = YUIHA_I(inode);
-	struct inode *parent_inode = yi->parent_inode;
-	struct address_space *parent_mapping = NULL;
-	struct page *parent_page = NULL;
+	struct inode *parent_inode;
+	struct page *parent_page = NULL, *new_page;
 
 	index = pos >> PAGE_CACHE_SHIFT;
 	start = pos & (PAGE_CACHE_SIZE - 1);
 	end = start + len;
+	*fsdata = NULL;
 
 	page = *pagep;
 	if (page == NULL) {
@@ -216,34 +511,61 @@ int yuiha_block_write_begin(struct file *file, struct address_space *mapping,
 	} else
 		BUG_ON(!PageLocked(page));
 
+	status = yuiha_check_snapshot_gen(inode, page);
+	if (unlikely(status)) {
+		if (ownpage) {
+			unlock_page(page);
+			page_cache_release(page);
+			*pagep = NULL;
+		}
+		goto out;
+	}
 
-	if (parent_inode)
-		mutex_lock(&parent_inode->i_mutex);
-
-	if (parent_inode && PageShared(page)) {
-		ext3_debug("index=%ld", index);
-		parent_ownpage = 1;
-		parent_mapping = parent_inode->i_mapping;
-		parent_page = grab_cache_page_write_begin(parent_mapping, index, flags);
-		if (!parent_page) {
-			status = -ENOMEM;
-			goto out;
-		} else
-			BUG_ON(!PageLocked(page));
+	// Only a page still shared with the parent version involves it.
+	if (PageShared(page)) {
+		mutex_lock(&yi->i_share_mutex);
+		parent_inode = yi->parent_inode;
+		if (parent_inode) {
+			new_page = yuiha_handoff_page(inode, parent_inode, page,
+					start, end, flags, get_block);
+			if (IS_ERR(new_page))
+				status = PTR_ERR(new_page);
+			else if (new_page) {
+				unlock_page(page);
+				page_cache_release(page);
+				*pagep = page = new_page;
+			}
+		}
+		if (!status && parent_inode && PageShared(page)) {
+			ext3_debug("index=%ld", index);
+			parent_page = grab_cache_page_write_begin(parent_inode->i_mapping,
+					index, flags | AOP_FLAG_NOFS);
+			if (!parent_page)
+				status = -ENOMEM;
+		}
+		mutex_unlock(&yi->i_share_mutex);
 	}
 
 	ext3_debug();
-	status = yuiha_block_prepare_write(inode, page, parent_page, 
-					start, end, get_block);
-	if (parent_inode)
-		mutex_unlock(&parent_inode->i_mutex);
+	if (!status)
+		status = yuiha_block_prepare_write(inode, page, parent_page,
+						start, end, get_block, fsdata);
+	else if (parent_page)
+		unlock_page(parent_page);
 	ext3_debug();
 
+	// yuiha_block_prepare_write() unlocked it
+	if (parent_page) {
+		if (unlikely(status))
+			ClearPageUptodate(parent_page);
+		page_cache_release(parent_page);
+	}
+
 	if (unlikely(status)) {
 		ext3_debug();
+		kfree(*fsdata);
+		*fsdata = NULL;
 		ClearPageUptodate(page);
-		if (parent_page)
-			ClearPageUptodate(parent_page);
 
 		if (ownpage) {
 			unlock_page(page);
@@ -258,17 +580,53 @@ int yuiha_block_write_begin(struct file *file, struct address_space *mapping,
 			if (pos + len > inode->i_size)
 				vmtruncate(inode, inode->i_size);
 		}
-
-		if (parent_ownpage && parent_page) {
-			unlock_page(parent_page);
-			page_cache_release(parent_page);
-		}
 	}
 
 out:
 	return status;
 }
 
+/*
+ * Undo the skipped reads of yuiha_block_write_begin() for a write that
+ * copied less than @len: block_write_end() drops such a copy, so the
+ * buffers that were never read get their old data back from the blocks
+ * they were copied from.  Returns the number of buffers restored or a
+ * negative errno, and frees @fsdata.
+ */
+int yuiha_block_write_end(struct page *page, loff_t pos, unsigned len,
+		unsigned copied, void *fsdata)
+{
+	struct yuiha_overwrite *ow = fsdata;
+	struct buffer_head *bh;
+	sector_t new_blocknr;
+	int nr, restored = 0, err = 0;
+
+	if (!ow)
+		return 0;
+	if (copied >= len || PageUptodate(page))
+		goto out;
+
+	for (bh = page_buffers(page), nr = 0; ow->map >> nr;
+			bh = bh->b_this_page, nr++) {
+		if (!(ow->map & (1UL << nr)))
+			continue;
+		new_blocknr = bh->b_blocknr;
+		bh->b_blocknr = ow->old_blocknr[nr];
+		ll_rw_block(READ, 1, &bh);
+		wait_on_buffer(bh);
+		bh->b_blocknr = new_blocknr;
+		if (!buffer_uptodate(bh)) {
+			err = -EIO;
+			continue;
+		}
+		mark_buffer_dirty(bh);
+		restored++;
+	}
+out:
+	kfree(ow);
+	return err ? err : restored;
+}
+
 inline int test_producer_flg(__u32 datablock_number) {
 	if (datablock_number & (1 << PRODUCER_BITS))
 		return 1;
@@ -0,0 +1,234 @@
+/*
+ *  linux/fs/ext3/yuiha_index.c
+ *
+ *  Version index of a tree, by sequence number and creation time.
+ *
+ *  Finding the version a file had at some point used to mean following
+ *  the parent links back from the head and reading one inode per version
+ *  until the mtime fit.  Every version a snapshot creates now gets the
+ *  next sequence number of its tree and its creation time, and an entry
+ *  in the data blocks of the tree's phantom root.  Entry k belongs to
+ *  sequence number k + 1 and creation times never go backwards within a
+ *  tree, so a sequence number costs one block and a time a binary search
+ *  over the blocks.
+ *
+ *  Entries are only ever appended.  The entry of a deleted version is
+ *  recognised by its inode no longer matching and skipped, the index goes
+ *  with the phantom root.  Versions created before the index have no
+ *  sequence number and are not found.
+ */
+
+#include <linux/fs.h>
+#include <linux/time.h>
+#include <linux/ext3_jbd.h>
+#include <asm/uaccess.h>
+#include "yuiha.h"
+
+struct yuiha_index_entry {
+	__le32	ie_crtime;
+	__le32	ie_ino;
+	__le32	ie_generation;
+	__le32	ie_reserved;
+};
+
+#define YUIHA_INDEX_PER_BLOCK(sb) \
+	((sb)->s_blocksize / sizeof(struct yuiha_index_entry))
+
+static inline u64 yuiha_index_count(struct inode *root)
+{
+	return i_size_read(root) / sizeof(struct yuiha_index_entry);
+}
+
+static int yuiha_index_read(struct inode *root, u64 k,
+		struct yuiha_index_entry *ie)
+{
+	unsigned int per = YUIHA_INDEX_PER_BLOCK(root->i_sb);
+	struct buffer_head *bh;
+	int err = 0;
+
+	bh = ext3_bread(NULL, root, k / per, 0, &err);
+	if (!bh)
+		return err ? err : -EIO;
+	memcpy(ie, bh->b_data + (k % per) * sizeof(*ie), sizeof(*ie));
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Give @version, just created by a snapshot, the next sequence number of
+ * its tree and enter it in the index.  The caller marks @version dirty.
+ */
+int yuiha_index_add(handle_t *handle, struct inode *version)
+{
+	struct super_block *sb = version->i_sb;
+	struct yuiha_inode_info *yi = YUIHA_I(version);
+	unsigned int per = YUIHA_INDEX_PER_BLOCK(sb);
+	struct yuiha_index_entry ie;
+	struct buffer_head *bh;
+	struct inode *root;
+	u32 now = get_seconds();
+	u64 n;
+	int err = 0;
+
+	// a tree from before the phantom roots has no place for it
+	if (!yi->i_phantom_root_ino)
+		return 0;
+	root = yuiha_ilookup(sb, yi->i_phantom_root_ino);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+
+	mutex_lock(&EXT3_SB(sb)->s_index_mutex);
+	n = yuiha_index_count(root);
+	if (n) {
+		err = yuiha_index_read(root, n - 1, &ie);
+		if (err)
+			goto out;
+		now = max(now, le32_to_cpu(ie.ie_crtime));
+	}
+
+	// freed index blocks have to be revoked like any metadata
+	if (!(EXT3_I(root)->i_flags & EXT3_JOURNAL_DATA_FL)) {
+		EXT3_I(root)->i_flags |= EXT3_JOURNAL_DATA_FL;
+		ext3_set_aops(root);
+	}
+
+	bh = ext3_bread(handle, root, n / per, 1, &err);
+	if (!bh)
+		goto out;
+	err = ext3_journal_get_write_access(handle, bh);
+	if (!err) {
+		ie.ie_crtime = cpu_to_le32(now);
+		ie.ie_ino = cpu_to_le32(version->i_ino);
+		ie.ie_generation = cpu_to_le32(version->i_generation);
+		ie.ie_reserved = 0;
+		memcpy(bh->b_data + (n % per) * sizeof(ie), &ie, sizeof(ie));
+		err = ext3_journal_dirty_metadata(handle, bh);
+	}
+	brelse(bh);
+	if (err)
+		goto out;
+
+	i_size_write(root, (n + 1) * sizeof(ie));
+	EXT3_I(root)->i_disksize = root->i_size;
+	err = ext3_mark_inode_dirty(handle, root);
+	if (!err) {
+		yi->i_seq = n + 1;
+		yi->i_crtime = now;
+	}
+out:
+	mutex_unlock(&EXT3_SB(sb)->s_index_mutex);
+	iput(root);
+	return err;
+}
+
+/*
+ * Whether entry @ie of sequence number @seq still stands for a live
+ * version of @root's tree.
+ */
+static int yuiha_index_valid(struct inode *root, u64 seq,
+		struct yuiha_index_entry *ie)
+{
+	struct inode *inode;
+	int valid;
+
+	inode = yuiha_ilookup(root->i_sb, le32_to_cpu(ie->ie_ino));
+	if (IS_ERR(inode))
+		return PTR_ERR(inode) == -ESTALE ? 0 : PTR_ERR(inode);
+	valid = yuiha_file(inode) && inode->i_nlink &&
+		inode->i_generation == le32_to_cpu(ie->ie_generation) &&
+		YUIHA_I(inode)->i_seq == seq &&
+		YUIHA_I(inode)->i_phantom_root_ino == root->i_ino &&
+		!(EXT3_I(inode)->i_flags & YUIHA_PHANTOM_VERSION_FL);
+	iput(inode);
+	return valid;
+}
+
+/*
+ * Set @k to the last entry created at or before @time, -1 if there is none.
+ */
+static int yuiha_index_search(struct inode *root, u64 n, u32 time, s64 *k)
+{
+	struct yuiha_index_entry ie;
+	u64 lo = 0, hi = n, mid;
+	int err;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		err = yuiha_index_read(root, mid, &ie);
+		if (err)
+			return err;
+		if (le32_to_cpu(ie.ie_crtime) <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*k = (s64)lo - 1;
+	return 0;
+}
+
+int yuiha_find_version(struct file *filp,
+		struct yuiha_find_version __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *root;
+	struct super_block *sb = inode->i_sb;
+	struct yuiha_find_version arg;
+	struct yuiha_index_entry ie;
+	unsigned long root_ino;
+	s64 k = -1;
+	int err = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags != YUIHA_FIND_SEQ && arg.flags != YUIHA_FIND_TIME)
+		return -EINVAL;
+
+	root_ino = YUIHA_I(inode)->i_phantom_root_ino;
+	if (EXT3_I(inode)->i_flags & YUIHA_PHANTOM_ROOT_VERSION_FL)
+		root_ino = inode->i_ino;
+	if (!root_ino)
+		return -ENOENT;
+	root = yuiha_ilookup(sb, root_ino);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+
+	mutex_lock(&EXT3_SB(sb)->s_index_mutex);
+	if (arg.flags == YUIHA_FIND_TIME)
+		err = yuiha_index_search(root, yuiha_index_count(root),
+				arg.time, &k);
+	else if (arg.seq && arg.seq <= yuiha_index_count(root))
+		k = arg.seq - 1;
+	mutex_unlock(&EXT3_SB(sb)->s_index_mutex);
+	if (err)
+		goto out;
+
+	// a deleted version yields to the one created before it
+	for (err = -ENOENT; k >= 0; k--) {
+		mutex_lock(&EXT3_SB(sb)->s_index_mutex);
+		err = yuiha_index_read(root, k, &ie);
+		mutex_unlock(&EXT3_SB(sb)->s_index_mutex);
+		if (!err)
+			err = yuiha_index_valid(root, k + 1, &ie);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		if (err < 0)
+			break;
+		err = -ENOENT;
+		if (arg.flags == YUIHA_FIND_SEQ)
+			break;
+		cond_resched();
+	}
+out:
+	iput(root);
+	if (err)
+		return err;
+
+	arg.seq = k + 1;
+	arg.time = le32_to_cpu(ie.ie_crtime);
+	arg.ino = le32_to_cpu(ie.ie_ino);
+	arg.generation = le32_to_cpu(ie.ie_generation);
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		return -EFAULT;
+	return 0;
+}
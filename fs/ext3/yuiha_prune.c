@@ -0,0 +1,640 @@
+/*
+ *  linux/fs/ext3/yuiha_prune.c
+ *
+ *  Retention policies for version trees.
+ *
+ *  YUIHA_IOC_PRUNE weighs a policy against the whole tree of the file it
+ *  is called on and deletes every version the policy does not keep, a
+ *  batch per transaction, instead of one open, ioctl and handle each.
+ *  Only frozen versions are candidates: not the phantom root, not a head
+ *  that is still written to (a version without children), not a version
+ *  with a name of its own and not one that is in use.  The policy is
+ *  weighed on the topology cache, only the versions that go are read in,
+ *  unless there is a max_bytes cap.  Their blocks are left to the
+ *  background reclaim, as for YUIHA_IOC_DEL_VERSION.
+ *
+ *  Versions are aged by their mtime, the last change of the data they
+ *  froze, and hours and days are counted in UTC.  max_bytes is weighed
+ *  against the blocks every version owns, see yuiha_owned_blocks(), so
+ *  a block shared between versions counts once, for its owner.  What a
+ *  deleted version owns and its child still maps moves to the child
+ *  instead of being freed, so the cap may leave the tree above max_bytes
+ *  but never deletes a version the tree had room for.  In the fulladdr
+ *  format a block the reference map counts twice is owned by nobody and
+ *  is not weighed at all.
+ *
+ *  YUIHA_IOC_SQUASH deletes the chain of versions between the file's
+ *  version and one of its ancestors in one go, without the reclaim.  The
+ *  whole chain is marked deleted first, then emptied newest first into
+ *  the file's version, see yuiha_truncate_into(): a block the chain owns
+ *  is looked at once, by its owner, and either becomes the file's if the
+ *  file still maps it or is freed, instead of travelling down the chain a
+ *  version at a time.  Blocks the chain only shares are just unlinked.
+ *  Last the file's version takes the place of the chain under the
+ *  ancestor, in one transaction, and the emptied versions are freed.  The
+ *  file's i_mutex is held throughout.  Pinned and tagged versions,
+ *  versions with a name of their own and versions with more than one
+ *  child stop a squash with EPERM or EINVAL, a version in use or not
+ *  reclaimed yet with EBUSY, before anything is changed.  A squash cut
+ *  short by an error leaves the versions it marked to the reclaim.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/mount.h>
+#include <linux/dcache.h>
+#include <linux/ext3_jbd.h>
+#include <asm/uaccess.h>
+#include "yuiha.h"
+
+// versions deleted per transaction
+#define YUIHA_PRUNE_BATCH	16
+// the superblock, and the inode each version puts on the orphan list
+#define YUIHA_PRUNE_TRANS_BLOCKS	(YUIHA_PRUNE_BATCH + 1)
+// besides the chain: the file, its new parent and their siblings
+#define YUIHA_SQUASH_LINK_BLOCKS	4
+
+struct yuiha_prune_entry {
+	unsigned long	ino;
+	__u32		mtime;
+	blkcnt_t	blocks;
+	int		pinned;
+	int		keep;
+};
+
+// newest first
+static int yuiha_prune_cmp(const void *a, const void *b)
+{
+	const struct yuiha_prune_entry *ea = a, *eb = b;
+
+	if (ea->mtime != eb->mtime)
+		return ea->mtime < eb->mtime ? 1 : -1;
+	if (ea->ino != eb->ino)
+		return ea->ino < eb->ino ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Keep the newest version of each of the last @nr periods of @period
+ * seconds that have a version at all.
+ */
+static void yuiha_prune_keep_periods(struct yuiha_prune_entry *e, int count,
+		__u32 nr, __u32 period)
+{
+	__u32 last = 0, bucket;
+	int i;
+
+	for (i = 0; i < count && nr; i++) {
+		bucket = e[i].mtime / period;
+		if (i && bucket == last)
+			continue;
+		last = bucket;
+		e[i].keep = 1;
+		nr--;
+	}
+}
+
+/*
+ * Mark what @policy keeps of the @count candidates, sorted newest first.
+ * @blocks is what the whole tree owns.  Returns how many go.
+ */
+static int yuiha_prune_select(struct yuiha_prune *policy,
+		struct yuiha_prune_entry *e, int count, blkcnt_t blocks)
+{
+	int i, doomed = 0;
+
+	// without a count or a time rule everything is kept but the cap
+	if (!policy->keep_last && !policy->keep_hourly && !policy->keep_daily)
+		for (i = 0; i < count; i++)
+			e[i].keep = 1;
+
+	for (i = 0; i < count && i < policy->keep_last; i++)
+		e[i].keep = 1;
+	yuiha_prune_keep_periods(e, count, policy->keep_hourly, 3600);
+	yuiha_prune_keep_periods(e, count, policy->keep_daily, 86400);
+
+	for (i = 0; i < count; i++) {
+		if (policy->flags & YUIHA_PRUNE_KEEP_PINNED && e[i].pinned)
+			e[i].keep = 1;
+		if (!e[i].keep)
+			blocks -= e[i].blocks;
+	}
+
+	// the cap goes oldest first through what the rules kept
+	for (i = count - 1; i >= 0 && policy->max_bytes; i--) {
+		if ((u64)blocks << 9 <= policy->max_bytes)
+			break;
+		if (!e[i].keep || (policy->flags & YUIHA_PRUNE_KEEP_PINNED &&
+					e[i].pinned))
+			continue;
+		e[i].keep = 0;
+		blocks -= e[i].blocks;
+	}
+
+	for (i = 0; i < count; i++)
+		doomed += !e[i].keep;
+	return doomed;
+}
+
+/*
+ * Weigh version @ino by the blocks it owns, in 512 byte units like
+ * i_blocks.
+ */
+static int yuiha_prune_weigh(struct super_block *sb, unsigned long ino,
+		blkcnt_t *blocks)
+{
+	struct inode *inode = yuiha_ilookup(sb, ino);
+	u64 owned;
+	int err;
+
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	err = yuiha_owned_blocks(inode, &owned);
+	iput(inode);
+	if (!err)
+		*blocks = owned << (sb->s_blocksize_bits - 9);
+	return err;
+}
+
+/*
+ * Gather the versions of @root's tree that may be deleted at all.  @self
+ * is the version the ioctl came in on, it is never one of them.  With
+ * @weigh every version is weighed, and @blocks gets what the whole tree
+ * owns.
+ */
+static int yuiha_prune_candidates(struct inode *root, struct inode *self,
+		int weigh, struct yuiha_prune_entry **entries, blkcnt_t *blocks)
+{
+	struct super_block *sb = root->i_sb;
+	struct yuiha_prune_entry *e;
+	struct yuiha_vnode vn;
+	unsigned long *inos;
+	blkcnt_t weight = 0;
+	int count, i, nr = 0, err;
+
+	*entries = NULL;
+	*blocks = 0;
+	count = yuiha_collect_tree(root, &inos);
+	if (count <= 0)
+		return count;
+	// the root is not among the versions below it
+	err = weigh ? yuiha_prune_weigh(sb, root->i_ino, blocks) : 0;
+	if (err) {
+		kfree(inos);
+		return err;
+	}
+	e = kcalloc(count, sizeof(*e), GFP_KERNEL);
+	if (!e) {
+		kfree(inos);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		err = yuiha_vtree_lookup(sb, inos[i], &vn);
+		if (!err && weigh)
+			err = yuiha_prune_weigh(sb, inos[i], &weight);
+		if (err == -ESTALE)
+			continue;		// deleted already
+		if (err) {
+			kfree(e);
+			kfree(inos);
+			return err;
+		}
+		*blocks += weight;
+		if (vn.nlink != 1 || !vn.child || vn.ino == self->i_ino ||
+				vn.flags & (YUIHA_PHANTOM_VERSION_FL |
+					YUIHA_PHANTOM_ROOT_VERSION_FL |
+					YUIHA_TEARDOWN_FL))
+			continue;
+		e[nr].ino = vn.ino;
+		e[nr].mtime = vn.mtime;
+		e[nr].blocks = weight;
+		// a tag pins its version
+		e[nr].pinned = (vn.flags & YUIHA_PINNED_FL) || vn.tags;
+		nr++;
+	}
+	kfree(inos);
+
+	sort(e, nr, sizeof(*e), yuiha_prune_cmp, NULL);
+	*entries = e;
+	return nr;
+}
+
+/*
+ * Close the running transaction and hand the versions it deleted to the
+ * reclaim.  Their last iput() may free them, so not under the handle.
+ */
+static int yuiha_prune_flush(handle_t *handle, struct inode **batch, int nr)
+{
+	int err = 0, i;
+
+	if (handle)
+		err = ext3_journal_stop(handle);
+	for (i = 0; i < nr; i++) {
+		yuiha_reclaim_queue(batch[i]);
+		iput(batch[i]);
+	}
+	return err;
+}
+
+/*
+ * Delete the versions of @e that are not kept.  Returns how many went.
+ */
+static int yuiha_prune_versions(struct super_block *sb,
+		struct yuiha_prune_entry *e, int count)
+{
+	struct inode *batch[YUIHA_PRUNE_BATCH], *inode;
+	handle_t *handle = NULL;
+	int i, nr = 0, pruned = 0, err = 0;
+
+	for (i = 0; i < count; i++) {
+		if (e[i].keep)
+			continue;
+		inode = yuiha_ilookup(sb, e[i].ino);
+		if (IS_ERR(inode)) {
+			if (PTR_ERR(inode) == -ESTALE)
+				continue;
+			err = PTR_ERR(inode);
+			break;
+		}
+		// versions somebody has open are kept
+		d_prune_aliases(inode);
+		if (atomic_read(&inode->i_count) > 1) {
+			iput(inode);
+			continue;
+		}
+
+		// i_mutex nests outside the handle
+		if (!mutex_trylock(&inode->i_mutex)) {
+			err = yuiha_prune_flush(handle, batch, nr);
+			handle = NULL;
+			nr = 0;
+			mutex_lock(&inode->i_mutex);
+		}
+		if (!err && !handle) {
+			handle = ext3_journal_start_sb(sb,
+					YUIHA_PRUNE_TRANS_BLOCKS);
+			if (IS_ERR(handle)) {
+				err = PTR_ERR(handle);
+				handle = NULL;
+			}
+		}
+		if (err) {
+			mutex_unlock(&inode->i_mutex);
+			iput(inode);
+			break;
+		}
+
+		// nobody deleted or named it meanwhile
+		if (inode->i_nlink != 1 || EXT3_I(inode)->i_flags &
+				(YUIHA_PHANTOM_VERSION_FL | YUIHA_TEARDOWN_FL)) {
+			mutex_unlock(&inode->i_mutex);
+			iput(inode);
+			continue;
+		}
+		yuiha_detatch_parent(inode);
+		drop_nlink(inode);
+		inode->i_ctime = CURRENT_TIME_SEC;
+		ext3_orphan_add(handle, inode);
+		EXT3_I(inode)->i_flags |= YUIHA_PHANTOM_VERSION_FL;
+		err = ext3_mark_inode_dirty(handle, inode);
+		mutex_unlock(&inode->i_mutex);
+		batch[nr++] = inode;
+		pruned++;
+		if (err)
+			break;
+
+		if (nr == YUIHA_PRUNE_BATCH) {
+			err = yuiha_prune_flush(handle, batch, nr);
+			handle = NULL;
+			nr = 0;
+			if (err)
+				break;
+		}
+	}
+
+	i = yuiha_prune_flush(handle, batch, nr);
+	if (!err)
+		err = i;
+	return err ? err : pruned;
+}
+
+int yuiha_prune(struct file *filp, struct yuiha_prune __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *root;
+	struct yuiha_prune_entry *entries;
+	struct yuiha_prune policy;
+	blkcnt_t blocks;
+	int count, err;
+
+	if (!is_owner_or_cap(inode))
+		return -EACCES;
+	if (copy_from_user(&policy, uarg, sizeof(policy)))
+		return -EFAULT;
+	if (policy.flags & ~YUIHA_PRUNE_FLAGS || policy.reserved)
+		return -EINVAL;
+
+	// a file that was never versioned is its own top
+	root = yuiha_trace_root(inode);
+	if (!root)
+		root = igrab(inode);
+	if (!root)
+		return -ENOENT;
+
+	count = yuiha_prune_candidates(root, inode, policy.max_bytes != 0,
+			&entries, &blocks);
+	iput(root);
+	if (count < 0)
+		return count;
+
+	err = yuiha_prune_select(&policy, entries, count, blocks);
+	if (err && !(policy.flags & YUIHA_PRUNE_DRY_RUN)) {
+		err = mnt_want_write(filp->f_path.mnt);
+		if (!err) {
+			err = yuiha_prune_versions(inode->i_sb, entries, count);
+			mnt_drop_write(filp->f_path.mnt);
+		}
+	}
+	kfree(entries);
+	if (err < 0)
+		return err;
+
+	policy.pruned = err;
+	if (put_user(policy.pruned, &uarg->pruned))
+		return -EFAULT;
+	return 0;
+}
+
+static int yuiha_squash_vnode(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn)
+{
+	int err = yuiha_vtree_lookup(sb, ino, vn);
+
+	// deleted versions stay in the tree until reclaimed
+	if (err == -ESTALE)
+		err = yuiha_read_vnode(sb, ino, vn, 1);
+	return err;
+}
+
+/*
+ * Gather the versions between @self and its ancestor @arg names, nearest
+ * to @self first.
+ */
+static int yuiha_squash_chain(struct inode *self, struct yuiha_squash *arg,
+		struct yuiha_prune_entry **entries)
+{
+	struct super_block *sb = self->i_sb;
+	struct yuiha_prune_entry *e = NULL, *tmp;
+	struct yuiha_vnode vn, below;
+	unsigned long ino;
+	u32 depth = 0, max = le32_to_cpu(EXT3_SB(sb)->s_es->s_inodes_count);
+	int nr = 0, size = 0, err;
+
+	*entries = NULL;
+	err = yuiha_squash_vnode(sb, self->i_ino, &below);
+	for (ino = below.parent; ; ino = vn.parent) {
+		if (err)
+			goto fail;
+		err = -EINVAL;
+		// not an ancestor, or a loop on a damaged tree
+		if (!ino || ++depth > max)
+			goto fail;
+		err = yuiha_squash_vnode(sb, ino, &vn);
+		if (err)
+			goto fail;
+		if (ino == arg->ino)
+			break;
+		// a chain has no branches
+		err = -EINVAL;
+		if (below.sibling_next != below.ino)
+			goto fail;
+		below = vn;
+		// deleted, but the reclaim has not freed it yet
+		err = -EBUSY;
+		if (vn.flags & YUIHA_PHANTOM_VERSION_FL)
+			goto fail;
+
+		err = -EPERM;
+		if (vn.nlink != 1 || vn.flags & YUIHA_PINNED_FL || vn.tags)
+			goto fail;
+		err = -ENOENT;
+		if (vn.flags & (YUIHA_PHANTOM_ROOT_VERSION_FL |
+					YUIHA_TEARDOWN_FL))
+			goto fail;
+
+		if (nr == size) {
+			size = size ? size * 2 : 16;
+			tmp = krealloc(e, size * sizeof(*e), GFP_KERNEL);
+			err = -ENOMEM;
+			if (!tmp)
+				goto fail;
+			e = tmp;
+		}
+		memset(&e[nr], 0, sizeof(*e));
+		e[nr].ino = vn.ino;
+		e[nr].mtime = vn.mtime;
+		e[nr].blocks = vn.blocks;
+		nr++;
+	}
+
+	// the version that stays above the chain
+	err = -ENOENT;
+	if (!vn.nlink || vn.generation != arg->generation ||
+			vn.flags & (YUIHA_PHANTOM_VERSION_FL |
+				YUIHA_PHANTOM_ROOT_VERSION_FL |
+				YUIHA_TEARDOWN_FL))
+		goto fail;
+	*entries = e;
+	return nr;
+
+fail:
+	kfree(e);
+	return err;
+}
+
+/*
+ * Read the versions of the chain in and make sure nobody else uses them.
+ * The children drop their in-core parent pointers first, so only real
+ * users count.  Fills @chain, which the caller puts.
+ */
+static int yuiha_squash_grab(struct super_block *sb,
+		struct yuiha_prune_entry *e, int nr, struct inode **chain)
+{
+	struct inode *inode;
+	int i, busy;
+
+	for (i = 0; i < nr; i++) {
+		inode = yuiha_ilookup(sb, e[i].ino);
+		if (IS_ERR(inode))
+			return PTR_ERR(inode) == -ESTALE ? -EBUSY :
+				PTR_ERR(inode);
+		chain[i] = inode;
+	}
+	for (i = 0; i < nr; i++)
+		yuiha_detatch_parent(chain[i]);
+
+	for (i = 0; i < nr; i++) {
+		inode = chain[i];
+		d_prune_aliases(inode);
+		if (atomic_read(&inode->i_count) > 1)
+			return -EBUSY;
+		// the topology cache may have been behind
+		mutex_lock_nested(&inode->i_mutex, I_MUTEX_PARENT);
+		busy = inode->i_nlink != 1 || YUIHA_I(inode)->i_tags ||
+			EXT3_I(inode)->i_flags & (YUIHA_PHANTOM_VERSION_FL |
+					YUIHA_PHANTOM_ROOT_VERSION_FL |
+					YUIHA_TEARDOWN_FL | YUIHA_PINNED_FL);
+		mutex_unlock(&inode->i_mutex);
+		if (busy)
+			return -EBUSY;
+	}
+	return 0;
+}
+
+/*
+ * Delete the versions of the chain, a batch per transaction.  They stay
+ * in the tree and on the orphan list until they are emptied and cut out,
+ * so a crash leaves them to the orphan cleanup like any deleted version.
+ * *@marked counts the versions deleted.
+ */
+static int yuiha_squash_mark(struct super_block *sb, struct inode **chain,
+		int nr, int *marked)
+{
+	struct inode *inode;
+	handle_t *handle = NULL;
+	int i, err = 0, err2;
+
+	for (i = 0; i < nr && !err; i++) {
+		inode = chain[i];
+		// i_mutex nests outside the handle
+		if (!mutex_trylock(&inode->i_mutex)) {
+			if (handle) {
+				err = ext3_journal_stop(handle);
+				handle = NULL;
+			}
+			mutex_lock_nested(&inode->i_mutex, I_MUTEX_PARENT);
+			if (err) {
+				mutex_unlock(&inode->i_mutex);
+				return err;
+			}
+		}
+		if (!handle) {
+			handle = ext3_journal_start_sb(sb,
+					YUIHA_PRUNE_TRANS_BLOCKS);
+			if (IS_ERR(handle)) {
+				mutex_unlock(&inode->i_mutex);
+				return PTR_ERR(handle);
+			}
+		}
+		drop_nlink(inode);
+		inode->i_ctime = CURRENT_TIME_SEC;
+		ext3_orphan_add(handle, inode);
+		EXT3_I(inode)->i_flags |= YUIHA_PHANTOM_VERSION_FL;
+		err = ext3_mark_inode_dirty(handle, inode);
+		mutex_unlock(&inode->i_mutex);
+		(*marked)++;
+
+		if (i % YUIHA_PRUNE_BATCH == YUIHA_PRUNE_BATCH - 1) {
+			err2 = ext3_journal_stop(handle);
+			handle = NULL;
+			if (!err)
+				err = err2;
+		}
+	}
+	if (handle) {
+		err2 = ext3_journal_stop(handle);
+		if (!err)
+			err = err2;
+	}
+	return err;
+}
+
+int yuiha_squash(struct file *filp, struct yuiha_squash __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, **chain = NULL;
+	struct super_block *sb = inode->i_sb;
+	struct yuiha_prune_entry *entries = NULL;
+	struct yuiha_squash arg;
+	handle_t *handle;
+	int count, marked = 0, i, err;
+
+	if (!is_owner_or_cap(inode))
+		return -EACCES;
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags)
+		return -EINVAL;
+	if (EXT3_I(inode)->i_flags & (YUIHA_PHANTOM_VERSION_FL |
+				YUIHA_PHANTOM_ROOT_VERSION_FL))
+		return -EINVAL;
+
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		return err;
+	// no version can come in between the file and the chain
+	mutex_lock(&inode->i_mutex);
+	count = yuiha_squash_chain(inode, &arg, &entries);
+	err = count;
+	if (count <= 0)
+		goto out;
+	// the chain leaves the tree in a single transaction
+	err = -E2BIG;
+	if (count + YUIHA_SQUASH_LINK_BLOCKS >
+			EXT3_SB(sb)->s_journal->j_max_transaction_buffers)
+		goto out;
+	err = -ENOMEM;
+	chain = kcalloc(count, sizeof(*chain), GFP_KERNEL);
+	if (!chain)
+		goto out;
+
+	err = yuiha_squash_grab(sb, entries, count, chain);
+	if (!err)
+		err = yuiha_squash_mark(sb, chain, count, &marked);
+
+	// nearest first, so nothing left in the chain maps a freed block
+	for (i = 0; i < count && !err; i++) {
+		mutex_lock_nested(&chain[i]->i_mutex, I_MUTEX_PARENT);
+		err = yuiha_truncate_into(chain[i], inode);
+		mutex_unlock(&chain[i]->i_mutex);
+	}
+
+	if (!err) {
+		// a reader of the file may have picked the chain up again
+		yuiha_detatch_parent(chain[0]);
+		handle = ext3_journal_start_sb(sb,
+				count + YUIHA_SQUASH_LINK_BLOCKS);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+		} else {
+			err = yuiha_squash_link(handle, inode, chain, count);
+			i = ext3_journal_stop(handle);
+			if (!err)
+				err = i;
+		}
+	}
+
+	// versions deleted but not cut out go the usual way
+	if (err)
+		for (i = 0; i < marked; i++)
+			yuiha_reclaim_queue(chain[i]);
+out:
+	mutex_unlock(&inode->i_mutex);
+	mnt_drop_write(filp->f_path.mnt);
+	// the emptied versions are freed by their last iput()
+	if (chain) {
+		for (i = 0; i < count; i++)
+			if (chain[i])
+				iput(chain[i]);
+		kfree(chain);
+	}
+	kfree(entries);
+	if (err < 0)
+		return err;
+
+	arg.squashed = count;
+	if (put_user(arg.squashed, &uarg->squashed))
+		return -EFAULT;
+	return 0;
+}
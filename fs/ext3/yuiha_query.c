@@ -0,0 +1,394 @@
+/*
+ *  linux/fs/ext3/yuiha_query.c
+ *
+ *  Tree-wide queries on versions.
+ *
+ *  yuiha_readversion() hands out one version's parent and children per
+ *  readdir and leaves the rest to a stat of every version.
+ *  YUIHA_IOC_GET_VTREE reports the whole tree instead, top first and every
+ *  version ahead of its children, in fixed-size records a page per call.
+ *  The cookie names the next version to report, so a call walks on from
+ *  there and costs its page and the depth of the tree, not the versions
+ *  before it.  A tree that changes between two calls may have versions
+ *  skipped or reported twice, and a call fails with -ESTALE once the
+ *  version the cookie names has left the tree.  Everything but the block
+ *  counts comes from the topology cache.
+ *
+ *  YUIHA_IOC_DIFF reports the logical blocks two versions map differently.
+ *  Versions of a tree share whole subtrees of their block maps, so the two
+ *  maps are walked side by side and a pointer both have, the producer bit
+ *  aside, is skipped with everything below it.  The cost follows the
+ *  amount of change, not the file size.  A pointer only one side has is
+ *  followed down that side alone, so holes do not show up as changes.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/ext3_jbd.h>
+#include <asm/uaccess.h>
+#include "yuiha.h"
+
+static int yuiha_query_vnode(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn)
+{
+	int err = yuiha_vtree_lookup(sb, ino, vn);
+
+	// deleted versions stay in the tree until reclaimed
+	if (err == -ESTALE)
+		err = yuiha_read_vnode(sb, ino, vn, 1);
+	return err;
+}
+
+/*
+ * Fill in the blocks @rec owns and the ones it maps from other versions.
+ */
+static int yuiha_query_blocks(struct super_block *sb,
+		struct yuiha_vtree_rec *rec, struct yuiha_vnode *vn)
+{
+	struct inode *inode;
+	u64 mapped = vn->blocks >> (sb->s_blocksize_bits - 9);
+	int err;
+
+	inode = yuiha_ilookup(sb, rec->ino);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode) == -ESTALE ? 0 : PTR_ERR(inode);
+	err = yuiha_owned_blocks(inode, &rec->exclusive);
+	iput(inode);
+	if (err)
+		return err;
+	rec->shared = mapped > rec->exclusive ? mapped - rec->exclusive : 0;
+	return 0;
+}
+
+/*
+ * Step from @vn to the version after it in preorder below @top.  @depth
+ * follows, @next and its @parent are set, @next is 0 past the end.
+ */
+static int yuiha_vtree_next(struct super_block *sb, unsigned long top,
+		struct yuiha_vnode *vn, u32 *depth, unsigned long *next,
+		unsigned long *parent)
+{
+	struct yuiha_vnode cur = *vn, up;
+	int err;
+
+	if (cur.child) {
+		*next = cur.child;
+		*parent = cur.ino;
+		(*depth)++;
+		return 0;
+	}
+	// the next sibling of the version or of the closest ancestor
+	for (; cur.ino != top; cur = up, (*depth)--) {
+		if (!*depth)
+			return -EIO;
+		err = yuiha_query_vnode(sb, cur.parent, &up);
+		if (err)
+			return err;
+		if (cur.sibling_next && cur.sibling_next != up.child) {
+			*next = cur.sibling_next;
+			*parent = up.ino;
+			return 0;
+		}
+	}
+	*next = 0;
+	return 0;
+}
+
+/*
+ * How many levels @vn lies below @top.  -ESTALE if it is not below it
+ * any more.
+ */
+static int yuiha_vtree_depth(struct super_block *sb, unsigned long top,
+		struct yuiha_vnode *vn, u32 *depth)
+{
+	unsigned long limit = le32_to_cpu(EXT3_SB(sb)->s_es->s_inodes_count);
+	struct yuiha_vnode up = *vn;
+	int err;
+
+	for (*depth = 0; up.ino != top; (*depth)++) {
+		if (!up.parent)
+			return -ESTALE;
+		if (*depth >= limit)
+			return -EIO;
+		err = yuiha_query_vnode(sb, up.parent, &up);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int yuiha_get_vtree(struct file *filp, struct yuiha_get_vtree __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *root;
+	struct super_block *sb = inode->i_sb;
+	struct yuiha_get_vtree arg;
+	struct yuiha_vtree_rec *recs, *rec;
+	struct yuiha_vnode vn;
+	unsigned long top, ino, parent = 0;
+	u32 depth = 0;
+	int err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~YUIHA_VTREE_FLAGS || arg.reserved || !arg.count)
+		return -EINVAL;
+	arg.count = min_t(u32, arg.count, YUIHA_VTREE_MAX);
+
+	// a file that was never versioned is its own top
+	root = yuiha_trace_root(inode);
+	if (!root)
+		root = igrab(inode);
+	if (!root)
+		return -ENOENT;
+	top = root->i_ino;
+	iput(root);
+
+	recs = kcalloc(arg.count, sizeof(*recs), GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+
+	// the cookie names the next version to report
+	ino = arg.cookie ? (u32)arg.cookie : top;
+	err = yuiha_query_vnode(sb, ino, &vn);
+	if (!err && arg.cookie && vn.generation != arg.cookie >> 32)
+		err = -ESTALE;
+	if (!err)
+		err = yuiha_vtree_depth(sb, top, &vn, &depth);
+	if (err)
+		goto out;
+
+	arg.filled = 0;
+	for (;;) {
+		rec = &recs[arg.filled++];
+		rec->ino = vn.ino;
+		rec->generation = vn.generation;
+		rec->parent = depth ? vn.parent : 0;
+		rec->depth = depth;
+		rec->flags = vn.flags;
+		rec->mtime = vn.mtime;
+		rec->size = vn.size;
+		if (arg.flags & YUIHA_VTREE_BLOCKS) {
+			err = yuiha_query_blocks(sb, rec, &vn);
+			if (err)
+				goto out;
+		}
+		cond_resched();
+
+		err = yuiha_vtree_next(sb, top, &vn, &depth, &ino, &parent);
+		if (!err && ino)
+			err = yuiha_query_vnode(sb, ino, &vn);
+		// every version has to point back at the one it was reached from
+		if (!err && ino && vn.parent != parent)
+			err = -EIO;
+		if (err == -EIO)
+			ext3_error(sb, "yuiha_get_vtree",
+					"damaged version tree below inode %lu",
+					top);
+		if (err)
+			goto out;
+		if (!ino || arg.filled == arg.count)
+			break;
+	}
+
+	err = -EFAULT;
+	if (copy_to_user((void __user *)(unsigned long)arg.recs, recs,
+				arg.filled * sizeof(*recs)))
+		goto out;
+	arg.cookie = ino ? (u64)vn.generation << 32 | ino : 0;
+	err = 0;
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		err = -EFAULT;
+out:
+	kfree(recs);
+	return err;
+}
+
+struct yuiha_diff_walk {
+	struct super_block	*sb;
+	struct yuiha_diff_range	*r;
+	u32			count;
+	u32			filled;
+	u64			from;	// reported by the calls before
+	u64			next;	// where the next call goes on
+};
+
+/*
+ * Report logical block @blk.  Returns 1 once there is no room left.
+ */
+static int yuiha_diff_add(struct yuiha_diff_walk *w, u64 blk)
+{
+	struct yuiha_diff_range *last = w->filled ? &w->r[w->filled - 1] : NULL;
+
+	if (last && last->start + last->len == blk) {
+		last->len++;
+		return 0;
+	}
+	if (w->filled == w->count) {
+		w->next = blk;
+		return 1;
+	}
+	w->r[w->filled].start = blk;
+	w->r[w->filled].len = 1;
+	w->filled++;
+	return 0;
+}
+
+static struct buffer_head *yuiha_diff_read(struct super_block *sb,
+		ext3_fsblk_t nr)
+{
+	struct buffer_head *bh;
+
+	if (nr >= le32_to_cpu(EXT3_SB(sb)->s_es->s_blocks_count)) {
+		ext3_error(sb, __func__, "bad block pointer " E3FSBLK, nr);
+		return ERR_PTR(-EIO);
+	}
+	bh = sb_bread(sb, nr);
+	return bh ? bh : ERR_PTR(-EIO);
+}
+
+/*
+ * Compare the subtrees @a and @b point at, @depth levels of indirect
+ * blocks above the data, which map the file from logical block @start.
+ */
+static int yuiha_diff_branch(struct yuiha_diff_walk *w, __le32 a, __le32 b,
+		int depth, u64 start)
+{
+	struct super_block *sb = w->sb;
+	ext3_fsblk_t na = yuiha_block_nr(sb, a), nb = yuiha_block_nr(sb, b);
+	int bits = EXT3_ADDR_PER_BLOCK_BITS(sb);
+	struct buffer_head *bha = NULL, *bhb = NULL;
+	__le32 ca, cb;
+	unsigned int i;
+	int ret = 0;
+
+	if (na == nb || start + (1ULL << (depth * bits)) <= w->from)
+		return 0;
+	if (!depth)
+		return start < w->from ? 0 : yuiha_diff_add(w, start);
+
+	if (na) {
+		bha = yuiha_diff_read(sb, na);
+		if (IS_ERR(bha))
+			return PTR_ERR(bha);
+	}
+	if (nb) {
+		bhb = yuiha_diff_read(sb, nb);
+		if (IS_ERR(bhb)) {
+			brelse(bha);
+			return PTR_ERR(bhb);
+		}
+	}
+	for (i = 0; i < EXT3_ADDR_PER_BLOCK(sb) && !ret; i++) {
+		ca = bha ? ((__le32 *)bha->b_data)[i] : 0;
+		cb = bhb ? ((__le32 *)bhb->b_data)[i] : 0;
+		ret = yuiha_diff_branch(w, ca, cb, depth - 1,
+				start + ((u64)i << ((depth - 1) * bits)));
+	}
+	brelse(bha);
+	brelse(bhb);
+	cond_resched();
+	return ret;
+}
+
+static int yuiha_diff_maps(struct yuiha_diff_walk *w, __le32 *a, __le32 *b)
+{
+	int bits = EXT3_ADDR_PER_BLOCK_BITS(w->sb);
+	int i, depth, ret = 0;
+	u64 start = 0;
+
+	for (i = 0; i < EXT3_N_BLOCKS && !ret; i++) {
+		depth = i < EXT3_NDIR_BLOCKS ? 0 : i - EXT3_NDIR_BLOCKS + 1;
+		ret = yuiha_diff_branch(w, a[i], b[i], depth, start);
+		start += 1ULL << (depth * bits);
+	}
+	return ret;
+}
+
+/*
+ * Fill @r with up to @count ranges, from logical block @from on, where
+ * @inode maps differently from @other, or from a file without blocks if
+ * @other is NULL.  Returns the number of ranges and sets @next to where
+ * the next call goes on, 0 when there is nothing more.
+ */
+int yuiha_diff_ranges(struct inode *inode, struct inode *other, u64 from,
+		struct yuiha_diff_range *r, u32 count, u64 *next)
+{
+	static __le32 no_blocks[EXT3_N_BLOCKS];
+	struct yuiha_diff_walk w = {
+		.sb = inode->i_sb, .r = r, .count = count, .from = from,
+	};
+	struct inode *first, *second;
+	int err;
+
+	// no truncate frees a branch under the walk, in inode number order
+	// as YUIHA_IOC_SNAPSHOT_SET takes them
+	first = !other || inode->i_ino < other->i_ino ? inode : other;
+	second = first == inode ? other : inode;
+	mutex_lock(&first->i_mutex);
+	if (second && second != first)
+		mutex_lock(&second->i_mutex);
+	err = yuiha_diff_maps(&w, EXT3_I(inode)->i_data,
+			other ? EXT3_I(other)->i_data : no_blocks);
+	if (second && second != first)
+		mutex_unlock(&second->i_mutex);
+	mutex_unlock(&first->i_mutex);
+	if (err < 0)
+		return err;
+
+	*next = err ? w.next : 0;
+	return w.filled;
+}
+
+int yuiha_diff(struct file *filp, struct yuiha_diff __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *other;
+	struct yuiha_diff_range *r = NULL;
+	struct yuiha_diff arg;
+	u32 count;
+	int err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.reserved || !arg.count)
+		return -EINVAL;
+
+	other = yuiha_ilookup(inode->i_sb, arg.ino);
+	if (IS_ERR(other))
+		return PTR_ERR(other) == -ESTALE ? -ENOENT : PTR_ERR(other);
+	err = -ENOENT;
+	if (!yuiha_file(other) || !other->i_nlink ||
+			other->i_generation != arg.generation ||
+			EXT3_I(other)->i_flags & (YUIHA_PHANTOM_VERSION_FL |
+				YUIHA_PHANTOM_ROOT_VERSION_FL) ||
+			!yuiha_same_tree(inode, other))
+		goto out;
+	err = inode_permission(other, MAY_READ);
+	if (err)
+		goto out;
+
+	count = min_t(u32, arg.count, YUIHA_DIFF_MAX);
+	r = kcalloc(count, sizeof(*r), GFP_KERNEL);
+	err = -ENOMEM;
+	if (!r)
+		goto out;
+	err = yuiha_diff_ranges(inode, other, arg.cookie, r, count,
+			&arg.cookie);
+	if (err < 0)
+		goto out;
+
+	arg.filled = err;
+	arg.blocksize = inode->i_sb->s_blocksize;
+	err = -EFAULT;
+	if (arg.filled && copy_to_user((void __user *)(unsigned long)arg.ranges,
+				r, arg.filled * sizeof(*r)))
+		goto out;
+	err = 0;
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		err = -EFAULT;
+out:
+	kfree(r);
+	iput(other);
+	return err;
+}
@@ -0,0 +1,298 @@
+/*
+ *  linux/fs/ext3/yuiha_reclaim.c
+ *
+ *  Background reclaim of deleted versions.
+ *
+ *  Deleting a version only unlinks it, its blocks go with the last iput().
+ *  That truncate walks every pointer of the version, and without the block
+ *  reference map the same slot of every child too, so whoever happened to
+ *  close the version last used to stall for seconds.  A deleted version is
+ *  handed to a per-superblock thread instead.  Once nobody else holds the
+ *  inode the thread cuts it down from the end, YUIHA_RECLAIM_BATCH blocks
+ *  at a time, and leaves the rest and the inode itself to its final
+ *  iput().  Every step is an ordinary truncate in restartable transactions
+ *  of its own, and the version stays on the orphan list throughout, so a
+ *  crash leaves the remainder to the orphan cleanup.  The steps are paced
+ *  to the reclaim_rate mount option.
+ *
+ *  The top of a tree whose last name is gone is queued the same way and
+ *  tears the whole tree down once none of its versions is in use.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/ext3_jbd.h>
+#include "yuiha.h"
+
+// file blocks cut off per step
+#define YUIHA_RECLAIM_BATCH	2048
+
+struct yuiha_reclaim_entry {
+	struct list_head	e_list;
+	struct inode		*e_inode;
+	unsigned long		e_busy;		// jiffies a tree was found in use
+};
+
+struct yuiha_reclaim {
+	struct super_block	*r_sb;
+	struct task_struct	*r_task;
+	wait_queue_head_t	r_wait;
+	// Everything below is protected by r_lock.
+	spinlock_t		r_lock;
+	struct list_head	r_queue;
+	int			r_new;		// queued since the last look
+	unsigned int		r_pending;
+	u64			r_versions;
+	u64			r_blocks;
+};
+
+/*
+ * Hand @inode, a version that has just lost its last name, to the reclaim
+ * thread.  Without the thread it is left to the last iput() as before.
+ */
+void yuiha_reclaim_queue(struct inode *inode)
+{
+	struct yuiha_reclaim *r = EXT3_SB(inode->i_sb)->s_reclaim;
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct yuiha_reclaim_entry *e;
+
+	if (!r || inode->i_nlink)
+		return;
+
+	e = kmalloc(sizeof(*e), GFP_NOFS);
+	if (!e)
+		return;
+	e->e_inode = igrab(inode);
+	e->e_busy = 0;
+	if (!e->e_inode) {
+		kfree(e);
+		return;
+	}
+
+	spin_lock(&r->r_lock);
+	if (ei->i_state & EXT3_STATE_YUIHA_RECLAIM) {
+		spin_unlock(&r->r_lock);
+		iput(inode);
+		kfree(e);
+		return;
+	}
+	ei->i_state |= EXT3_STATE_YUIHA_RECLAIM;
+	list_add_tail(&e->e_list, &r->r_queue);
+	r->r_pending++;
+	r->r_new = 1;
+	spin_unlock(&r->r_lock);
+	wake_up(&r->r_wait);
+}
+
+static inline int yuiha_reclaim_is_tree(struct inode *inode)
+{
+	return !!(EXT3_I(inode)->i_flags & YUIHA_TEARDOWN_FL);
+}
+
+/*
+ * The first queued version nobody else holds any more.  A tree found in
+ * use is left alone for a second.
+ */
+static struct yuiha_reclaim_entry *yuiha_reclaim_take(struct yuiha_reclaim *r)
+{
+	struct yuiha_reclaim_entry *e;
+
+	if (r->r_sb->s_flags & MS_RDONLY)
+		return NULL;
+
+	spin_lock(&r->r_lock);
+	r->r_new = 0;
+	list_for_each_entry(e, &r->r_queue, e_list) {
+		if (e->e_busy && time_before(jiffies, e->e_busy + HZ))
+			continue;
+		if (atomic_read(&e->e_inode->i_count) == 1) {
+			list_del(&e->e_list);
+			spin_unlock(&r->r_lock);
+			return e;
+		}
+	}
+	spin_unlock(&r->r_lock);
+	return NULL;
+}
+
+/*
+ * Cut @inode down a batch at a time while nobody else picks it up, then
+ * drop the thread's reference.  The last iput() truncates the rest, takes
+ * the version out of its tree and frees the inode.
+ */
+static void yuiha_reclaim_version(struct yuiha_reclaim *r,
+		struct inode *inode)
+{
+	struct super_block *sb = r->r_sb;
+	loff_t batch = (loff_t)YUIHA_RECLAIM_BATCH << sb->s_blocksize_bits;
+	unsigned long blocks, rate;
+	loff_t size;
+
+	while (!kthread_should_stop() && !(sb->s_flags & MS_RDONLY)) {
+		mutex_lock(&inode->i_mutex);
+		size = i_size_read(inode);
+		if (size <= batch || atomic_read(&inode->i_count) > 1) {
+			mutex_unlock(&inode->i_mutex);
+			break;
+		}
+		size -= batch;
+		blocks = inode->i_blocks;
+		i_size_write(inode, size);
+		truncate_inode_pages(inode->i_mapping, size);
+		ext3_truncate(inode);
+		blocks = (blocks - inode->i_blocks) >> (sb->s_blocksize_bits - 9);
+		mutex_unlock(&inode->i_mutex);
+
+		spin_lock(&r->r_lock);
+		r->r_blocks += blocks;
+		spin_unlock(&r->r_lock);
+
+		rate = EXT3_SB(sb)->s_reclaim_rate;
+		if (rate && blocks)
+			schedule_timeout_interruptible(
+					max(blocks * HZ / rate, 1UL));
+		cond_resched();
+	}
+
+	// what the final iput() frees when it is ours
+	blocks = 0;
+	if (atomic_read(&inode->i_count) == 1)
+		blocks = inode->i_blocks >> (sb->s_blocksize_bits - 9);
+	iput(inode);
+
+	spin_lock(&r->r_lock);
+	r->r_pending--;
+	r->r_versions++;
+	r->r_blocks += blocks;
+	spin_unlock(&r->r_lock);
+}
+
+/*
+ * Tear down the tree below @e's inode and drop the thread's reference,
+ * which frees the top as well.  A tree with a version still in use goes
+ * back to the queue.
+ */
+static void yuiha_reclaim_tree(struct yuiha_reclaim *r,
+		struct yuiha_reclaim_entry *e)
+{
+	struct inode *root = e->e_inode;
+	int nr;
+
+	nr = yuiha_teardown_tree(root);
+	if (nr == -EBUSY) {
+		e->e_busy = jiffies;
+		spin_lock(&r->r_lock);
+		list_add_tail(&e->e_list, &r->r_queue);
+		spin_unlock(&r->r_lock);
+		return;
+	}
+	iput(root);
+	kfree(e);
+
+	spin_lock(&r->r_lock);
+	r->r_pending--;
+	r->r_versions += max(nr, 0) + 1;
+	spin_unlock(&r->r_lock);
+}
+
+static int yuiha_reclaim_thread(void *data)
+{
+	struct yuiha_reclaim *r = data;
+	struct yuiha_reclaim_entry *e;
+	long timeout;
+
+	while (!kthread_should_stop()) {
+		e = yuiha_reclaim_take(r);
+		if (e && yuiha_reclaim_is_tree(e->e_inode)) {
+			yuiha_reclaim_tree(r, e);
+			continue;
+		}
+		if (e) {
+			yuiha_reclaim_version(r, e->e_inode);
+			kfree(e);
+			continue;
+		}
+
+		// versions still open elsewhere are looked at once a second
+		spin_lock(&r->r_lock);
+		timeout = list_empty(&r->r_queue) ? MAX_SCHEDULE_TIMEOUT : HZ;
+		spin_unlock(&r->r_lock);
+		wait_event_interruptible_timeout(r->r_wait,
+				kthread_should_stop() || r->r_new, timeout);
+	}
+	return 0;
+}
+
+void yuiha_reclaim_stats(struct super_block *sb,
+		struct yuiha_reclaim_stats *stats)
+{
+	struct yuiha_reclaim *r = EXT3_SB(sb)->s_reclaim;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->rate = EXT3_SB(sb)->s_reclaim_rate;
+	if (!r)
+		return;
+	spin_lock(&r->r_lock);
+	stats->pending = r->r_pending;
+	stats->versions = r->r_versions;
+	stats->blocks = r->r_blocks;
+	spin_unlock(&r->r_lock);
+}
+
+/*
+ * Called at the end of the mount.
+ */
+int yuiha_reclaim_start(struct super_block *sb)
+{
+	struct yuiha_reclaim *r;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	r->r_sb = sb;
+	init_waitqueue_head(&r->r_wait);
+	spin_lock_init(&r->r_lock);
+	INIT_LIST_HEAD(&r->r_queue);
+
+	r->r_task = kthread_run(yuiha_reclaim_thread, r, "yuiha_reclaim/%s",
+			sb->s_id);
+	if (IS_ERR(r->r_task)) {
+		int err = PTR_ERR(r->r_task);
+
+		kfree(r);
+		return err;
+	}
+	EXT3_SB(sb)->s_reclaim = r;
+	return 0;
+}
+
+/*
+ * Called at unmount before the inodes are evicted.  What is still queued
+ * is left to the last iput(), which is ours now.  Trees go last, so the
+ * versions queued on their own no longer keep them busy.
+ */
+void yuiha_reclaim_stop(struct super_block *sb)
+{
+	struct yuiha_reclaim *r = EXT3_SB(sb)->s_reclaim;
+	struct yuiha_reclaim_entry *e, *next;
+	int trees;
+
+	if (!r)
+		return;
+	kthread_stop(r->r_task);
+	EXT3_SB(sb)->s_reclaim = NULL;
+
+	for (trees = 0; trees < 2; trees++) {
+		list_for_each_entry_safe(e, next, &r->r_queue, e_list) {
+			if (yuiha_reclaim_is_tree(e->e_inode) != trees)
+				continue;
+			list_del(&e->e_list);
+			iput(e->e_inode);
+			kfree(e);
+		}
+	}
+	kfree(r);
+}
@@ -0,0 +1,485 @@
+/*
+ *  linux/fs/ext3/yuiha_refcount.c
+ *
+ *  Persistent reference counts of the blocks versions share.
+ *
+ *  Without them a block counts as ours when its pointer carries the
+ *  producer bit, and truncating a version has to compare the same pointer
+ *  slot in every child to learn whether a block is still mapped elsewhere.
+ *  With them every block has one __le32 in the map: the number of
+ *  references it has beyond the first.  Zero, also for a hole in the map,
+ *  means that whoever reaches the block is its only user.
+ *
+ *  References are counted per tree level, like the sharing itself: a
+ *  snapshot takes a reference on every block the inode points at
+ *  directly, copying an indirect block takes one on every block the copy
+ *  points at, and dropping a pointer releases one.  A block is freed with
+ *  the last reference, and an indirect block releases its children then.
+ *
+ *  The map is a sparse file, its block N covers the fs blocks from N times
+ *  the entries per block on.  Map blocks are allocated on first use,
+ *  journalled as metadata and cached in the buffer cache like the bitmaps.
+ *  It can only be enabled before the first version is created: the
+ *  counts of blocks shared by then are not known.
+ *
+ *  Like the journal the map lives in a reserved inode that no directory
+ *  leads to, EXT3_YUIHA_REFCOUNT_INO, named by s_yuiha_refcount_inum.
+ *  Filesystems that got their map before it was reserved keep it in the
+ *  ordinary inode the superblock names.  A fsck has to know
+ *  RO_COMPAT_YUIHA_REFCOUNT and check that inode as it checks the
+ *  journal's: a regular file of one link, its blocks in use.
+ *
+ *  The map also frees bit 31 of the block pointers.  In the fulladdr
+ *  format they hold full 32-bit block numbers and a block is owned when
+ *  its count is zero, which lifts the 2^31 block limit the producer bit
+ *  sets.  A filesystem with the map is converted at mount time.
+ *
+ *  s_refcount_mutex serialises every read-modify-write of the map.  It
+ *  nests inside the truncate_mutex of the inodes being changed and outside
+ *  the one of the map inode.
+ */
+
+#include <linux/fs.h>
+#include <linux/ext3_jbd.h>
+#include "yuiha.h"
+
+static inline int yuiha_refcount_index(struct super_block *sb,
+		ext3_fsblk_t blk)
+{
+	return blk >> EXT3_ADDR_PER_BLOCK_BITS(sb);
+}
+
+/*
+ * Read the map block covering @blk.  NULL with *@err 0 is a hole.
+ */
+static struct buffer_head *yuiha_refcount_bread(handle_t *handle,
+		struct super_block *sb, ext3_fsblk_t blk, int create, int *err)
+{
+	struct inode *map = EXT3_SB(sb)->s_refcount_inode;
+	int index = yuiha_refcount_index(sb, blk);
+	struct buffer_head *bh;
+	loff_t size;
+
+	*err = 0;
+	bh = ext3_bread(handle, map, index, create, err);
+	if (!bh || !create)
+		return bh;
+
+	// keep the map's size covering its blocks
+	size = (loff_t)(index + 1) << sb->s_blocksize_bits;
+	if (size > EXT3_I(map)->i_disksize) {
+		i_size_write(map, size);
+		EXT3_I(map)->i_disksize = size;
+		ext3_mark_inode_dirty(handle, map);
+	}
+	return bh;
+}
+
+static inline __le32 *yuiha_refcount_slot(struct super_block *sb,
+		struct buffer_head *bh, ext3_fsblk_t blk)
+{
+	return (__le32 *)bh->b_data +
+		(blk & (EXT3_ADDR_PER_BLOCK(sb) - 1));
+}
+
+void yuiha_refcount_lock(struct super_block *sb)
+{
+	mutex_lock(&EXT3_SB(sb)->s_refcount_mutex);
+}
+
+void yuiha_refcount_unlock(struct super_block *sb)
+{
+	mutex_unlock(&EXT3_SB(sb)->s_refcount_mutex);
+}
+
+/*
+ * Fill @extra with the references block @blk has beyond the first.  The
+ * answer only holds while the caller has the map locked, or when it is 0
+ * and the caller is the one user of the block.
+ */
+int yuiha_refcount_get(struct super_block *sb, ext3_fsblk_t blk, u32 *extra)
+{
+	struct buffer_head *bh;
+	int err;
+
+	*extra = 0;
+	bh = yuiha_refcount_bread(NULL, sb, blk, 0, &err);
+	if (!bh)
+		return err;
+	*extra = le32_to_cpu(*yuiha_refcount_slot(sb, bh, blk));
+	brelse(bh);
+	return 0;
+}
+
+static int __yuiha_refcount_add(handle_t *handle, struct super_block *sb,
+		ext3_fsblk_t blk, int delta)
+{
+	struct buffer_head *bh;
+	__le32 *slot;
+	int err;
+
+	bh = yuiha_refcount_bread(handle, sb, blk, delta > 0, &err);
+	if (!bh) {
+		if (!err) {
+			ext3_error(sb, "yuiha_refcount_add",
+					"releasing unshared block "E3FSBLK, blk);
+			err = -EIO;
+		}
+		return err;
+	}
+
+	BUFFER_TRACE(bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err)
+		goto out;
+	slot = yuiha_refcount_slot(sb, bh, blk);
+	if (delta < 0 && !*slot) {
+		ext3_error(sb, "yuiha_refcount_add",
+				"releasing unshared block "E3FSBLK, blk);
+		err = -EIO;
+	} else {
+		le32_add_cpu(slot, delta);
+	}
+	BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
+	ext3_journal_dirty_metadata(handle, bh);
+out:
+	brelse(bh);
+	return err;
+}
+
+/*
+ * Add @delta to the count of every block in the pointer array @p[0 ..
+ * @nr-1].  Holes are skipped, producer bits ignored.  The caller holds
+ * the map lock.
+ */
+int yuiha_refcount_add(handle_t *handle, struct super_block *sb,
+		__le32 *p, int nr, int delta)
+{
+	ext3_fsblk_t blk;
+	int i, err;
+
+	for (i = 0; i < nr; i++) {
+		blk = yuiha_block_nr(sb, p[i]);
+		if (!blk)
+			continue;
+		err = __yuiha_refcount_add(handle, sb, blk, delta);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Drop one reference to @blk.  Returns 1 when other references remain,
+ * 0 when it was the last one and the caller has to free the block, or a
+ * negative errno.  On an error the block must be left alone.
+ */
+int yuiha_refcount_release(handle_t *handle, struct super_block *sb,
+		ext3_fsblk_t blk)
+{
+	u32 extra;
+	int err;
+
+	yuiha_refcount_lock(sb);
+	err = yuiha_refcount_get(sb, blk, &extra);
+	if (!err && extra) {
+		err = __yuiha_refcount_add(handle, sb, blk, -1);
+		if (!err)
+			err = 1;
+	}
+	yuiha_refcount_unlock(sb);
+	return err;
+}
+
+/*
+ * Journal credits for changing the counts of the blocks in @p[0 ..
+ * @nr-1]: one per map block, and an allocation for a map block that is
+ * not there yet.  Consecutive pointers mostly share a map block.
+ */
+int yuiha_refcount_credits(struct super_block *sb, __le32 *p, int nr)
+{
+	struct buffer_head *bh;
+	int i, index, last = -1, credits = 0, err;
+	ext3_fsblk_t blk;
+
+	for (i = 0; i < nr; i++) {
+		blk = yuiha_block_nr(sb, p[i]);
+		if (!blk)
+			continue;
+		index = yuiha_refcount_index(sb, blk);
+		if (index == last)
+			continue;
+		last = index;
+
+		bh = yuiha_refcount_bread(NULL, sb, blk, 0, &err);
+		if (bh) {
+			credits++;
+			brelse(bh);
+		} else {
+			credits += EXT3_SINGLEDATA_TRANS_BLOCKS;
+		}
+	}
+	return credits;
+}
+
+/*
+ * Add @delta to the count of every block @inode points at directly: +1
+ * when a snapshot shares them with the new version, -1 to take that back.
+ */
+int yuiha_refcount_share(handle_t *handle, struct inode *inode, int delta)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	int err;
+
+	mutex_lock(&ei->truncate_mutex);
+	err = ext3_journal_extend(handle, yuiha_refcount_credits(sb,
+				ei->i_data, EXT3_N_BLOCKS));
+	if (err > 0)
+		err = -ENOSPC;
+	if (!err) {
+		yuiha_refcount_lock(sb);
+		err = yuiha_refcount_add(handle, sb, ei->i_data,
+				EXT3_N_BLOCKS, delta);
+		yuiha_refcount_unlock(sb);
+	}
+	mutex_unlock(&ei->truncate_mutex);
+	return err;
+}
+
+/*
+ * Record that the filesystem has versions.  From then on the map can no
+ * longer be enabled.
+ */
+int yuiha_mark_versioned(handle_t *handle, struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	int err;
+
+	if (EXT3_HAS_COMPAT_FEATURE(sb, EXT3_FEATURE_COMPAT_YUIHA_VERSIONS))
+		return 0;
+
+	err = ext3_journal_get_write_access(handle, sbi->s_sbh);
+	if (err)
+		return err;
+	EXT3_SET_COMPAT_FEATURE(sb, EXT3_FEATURE_COMPAT_YUIHA_VERSIONS);
+	return ext3_journal_dirty_metadata(handle, sbi->s_sbh);
+}
+
+/*
+ * Turn the reserved map inode into an empty regular file, the way mke2fs
+ * sets up the journal inode.  mke2fs leaves the reserved inodes zeroed and
+ * marked in use, so no bitmap changes.
+ */
+static int yuiha_refcount_init_inode(handle_t *handle, struct super_block *sb)
+{
+	unsigned long ino = EXT3_YUIHA_REFCOUNT_INO;
+	unsigned long group = (ino - 1) / EXT3_INODES_PER_GROUP(sb);
+	unsigned long offset = ((ino - 1) % EXT3_INODES_PER_GROUP(sb)) *
+		EXT3_INODE_SIZE(sb);
+	struct ext3_group_desc *gdp;
+	struct ext3_inode *raw_inode;
+	struct buffer_head *bh;
+	int err;
+
+	gdp = ext3_get_group_desc(sb, group, NULL);
+	if (!gdp)
+		return -EIO;
+	bh = sb_bread(sb, le32_to_cpu(gdp->bg_inode_table) +
+			(offset >> EXT3_BLOCK_SIZE_BITS(sb)));
+	if (!bh)
+		return -EIO;
+	raw_inode = (struct ext3_inode *)(bh->b_data +
+			(offset & (sb->s_blocksize - 1)));
+
+	err = -EBUSY;
+	if (raw_inode->i_mode || raw_inode->i_links_count ||
+			raw_inode->i_blocks) {
+		printk(KERN_ERR "EXT3-fs: %s: reserved inode %lu is in use, "
+		       "no block reference map\n", sb->s_id, ino);
+		goto out;
+	}
+	BUFFER_TRACE(bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err)
+		goto out;
+	memset(raw_inode, 0, EXT3_INODE_SIZE(sb));
+	raw_inode->i_mode = cpu_to_le16(S_IFREG | 0600);
+	raw_inode->i_links_count = cpu_to_le16(1);
+	raw_inode->i_atime = raw_inode->i_ctime = raw_inode->i_mtime =
+		cpu_to_le32(get_seconds());
+	if (EXT3_INODE_SIZE(sb) > EXT3_GOOD_OLD_INODE_SIZE)
+		raw_inode->i_extra_isize = cpu_to_le16(YUIHA_INODE_EXTRA_ISIZE);
+	err = ext3_journal_dirty_metadata(handle, bh);
+out:
+	brelse(bh);
+	return err;
+}
+
+static int yuiha_refcount_create(struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct inode *map;
+	handle_t *handle;
+	int err;
+
+	if (EXT3_HAS_COMPAT_FEATURE(sb, EXT3_FEATURE_COMPAT_YUIHA_VERSIONS)) {
+		printk(KERN_ERR "EXT3-fs: %s: block reference map can only "
+		       "be enabled before the first version\n", sb->s_id);
+		return -EINVAL;
+	}
+
+	// the inode table block and the superblock
+	handle = ext3_journal_start_sb(sb, 2);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = yuiha_refcount_init_inode(handle, sb);
+	if (err)
+		goto out_stop;
+	err = ext3_journal_get_write_access(handle, sbi->s_sbh);
+	if (err)
+		goto out_stop;
+	sbi->s_es->s_yuiha_refcount_inum = cpu_to_le32(EXT3_YUIHA_REFCOUNT_INO);
+	EXT3_SET_RO_COMPAT_FEATURE(sb, EXT3_FEATURE_RO_COMPAT_YUIHA_REFCOUNT);
+	err = ext3_journal_dirty_metadata(handle, sbi->s_sbh);
+	if (err)
+		goto out_stop;
+
+	// with the number in place it gets the plain ext3 operations
+	map = ext3_iget(sb, EXT3_YUIHA_REFCOUNT_INO);
+	if (IS_ERR(map)) {
+		err = PTR_ERR(map);
+		goto out_stop;
+	}
+	sbi->s_refcount_inode = map;
+	return ext3_journal_stop(handle);
+
+out_stop:
+	ext3_journal_stop(handle);
+	return err;
+}
+
+/*
+ * Called at mount time, after the root and before the orphans are
+ * cleaned up: their truncates already need the map.
+ */
+int yuiha_refcount_setup(struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct inode *map;
+
+	mutex_init(&sbi->s_refcount_mutex);
+	sbi->s_refcount_inode = NULL;
+
+	if (!EXT3_HAS_RO_COMPAT_FEATURE(sb,
+				EXT3_FEATURE_RO_COMPAT_YUIHA_REFCOUNT)) {
+		if (!test_opt(sb, YUIHA_REFCOUNT) || (sb->s_flags & MS_RDONLY))
+			return 0;
+		return yuiha_refcount_create(sb);
+	}
+
+	map = ext3_iget(sb, le32_to_cpu(sbi->s_es->s_yuiha_refcount_inum));
+	if (IS_ERR(map)) {
+		printk(KERN_ERR "EXT3-fs: %s: cannot read the block "
+		       "reference map\n", sb->s_id);
+		return PTR_ERR(map);
+	}
+	sbi->s_refcount_inode = map;
+	return 0;
+}
+
+/*
+ * Strip the producer bits of every yuiha file, then record the fulladdr
+ * format.  Until the feature is set the bits are still honoured, and a
+ * file stripped already just claims its blocks again on write.
+ */
+static int yuiha_fulladdr_convert(struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct buffer_head *bitmap_bh;
+	struct inode *inode;
+	unsigned long group, ino;
+	handle_t *handle;
+	int i, err = 0;
+
+	for (group = 0; !err && group < sbi->s_groups_count; group++) {
+		bitmap_bh = ext3_read_inode_bitmap(sb, group);
+		if (!bitmap_bh)
+			return -EIO;
+		for (i = 0; !err && i < EXT3_INODES_PER_GROUP(sb); i++) {
+			if (!ext3_test_bit(i, bitmap_bh->b_data))
+				continue;
+			ino = group * EXT3_INODES_PER_GROUP(sb) + i + 1;
+			if (ino < EXT3_FIRST_INO(sb))
+				continue;
+			// deleted meanwhile, the orphans are gone by now
+			inode = ext3_iget(sb, ino);
+			if (IS_ERR(inode))
+				continue;
+			if (yuiha_file(inode))
+				err = yuiha_strip_blocks(inode);
+			iput(inode);
+		}
+		brelse(bitmap_bh);
+	}
+	if (err)
+		return err;
+
+	handle = ext3_journal_start_sb(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = ext3_journal_get_write_access(handle, sbi->s_sbh);
+	if (!err) {
+		EXT3_SET_INCOMPAT_FEATURE(sb,
+				EXT3_FEATURE_INCOMPAT_YUIHA_FULLADDR);
+		err = ext3_journal_dirty_metadata(handle, sbi->s_sbh);
+	}
+	if (!err)
+		sbi->s_producer_le = 0;
+	ext3_journal_stop(handle);
+	return err;
+}
+
+/*
+ * Called at the end of the mount, once the orphans are gone.  A failed
+ * conversion leaves the producer bits in charge, it is tried again on
+ * the next mount with the option.  A filesystem too large for them stays
+ * read-only meanwhile.
+ */
+void yuiha_fulladdr_setup(struct super_block *sb)
+{
+	int err;
+
+	if (!yuiha_producer_le(sb) || !test_opt(sb, YUIHA_FULLADDR) ||
+	    (sb->s_flags & MS_RDONLY))
+		return;
+	if (!yuiha_refcount_enabled(sb)) {
+		printk(KERN_ERR "EXT3-fs: %s: full block numbers need the "
+		       "block reference map\n", sb->s_id);
+		return;
+	}
+
+	err = yuiha_fulladdr_convert(sb);
+	if (!err) {
+		printk(KERN_INFO "EXT3-fs: %s: converted to full block "
+		       "numbers\n", sb->s_id);
+		return;
+	}
+	printk(KERN_ERR "EXT3-fs: %s: conversion to full block numbers "
+	       "failed: %d\n", sb->s_id, err);
+	// the blocks past the producer bit must not be handed out
+	if (yuiha_producer_limit(sb,
+			le32_to_cpu(EXT3_SB(sb)->s_es->s_blocks_count))) {
+		printk(KERN_ERR "EXT3-fs: %s: mounted read-only\n", sb->s_id);
+		sb->s_flags |= MS_RDONLY;
+	}
+}
+
+void yuiha_refcount_put_super(struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+
+	iput(sbi->s_refcount_inode);
+	sbi->s_refcount_inode = NULL;
+}
@@ -0,0 +1,901 @@
+/*
+ *  linux/fs/ext3/yuiha_send.c
+ *
+ *  Replication streams between yuiha filesystems.
+ *
+ *  YUIHA_IOC_SEND writes a version to a file or pipe as a header with the
+ *  version's metadata and the blocks it maps differently from a base
+ *  version of the same tree, found the way YUIHA_IOC_DIFF finds them.
+ *  Without a base every block the version maps is sent.
+ *
+ *  YUIHA_IOC_RECEIVE applies such a stream to the replica of the base on
+ *  the other side.  It snapshots the replica first, so the base stays as
+ *  a version of its own, and writes the blocks in the stream through the
+ *  ordinary write path.  That allocates and splices the new blocks the
+ *  way every write does and leaves every other block shared with the
+ *  base.  Last the size, mode, times and flags of the version are set.
+ *  The owner stays that of the replica.  A stream that fails halfway
+ *  leaves the replica half written, the snapshot keeps the base.
+ *
+ *  The stream names the version by its index sequence number and
+ *  creation time, and the base by the same.  A replica records the
+ *  version it last received in its origin fields, which its snapshots
+ *  copy, and only takes a stream against that version.  A base has to
+ *  be a version a snapshot created, a head has no such name.
+ *
+ *  Blocks are sent whole and both sides need the same block size.  A
+ *  block the base maps and the version does not is sent as a hole, and
+ *  the receive unlinks it from the replica, see yuiha_punch_blocks().
+ *  Only whole pages are punched, the blocks of a partial one are written
+ *  as zeroes.
+ *
+ *  YUIHA_IOC_DUMP writes the whole tree the same way: every live version,
+ *  parents before children, as its parent's position in the dump and a
+ *  stream relative to that parent, the top as a full stream.  A version
+ *  shares everything but what it wrote with its parent, so every block
+ *  goes into the dump once, with the version that owns it.  Deleted
+ *  versions are left out and their children sent against the nearest
+ *  live ancestor.  YUIHA_IOC_RESTORE rebuilds the tree in an empty file
+ *  by receiving each stream into the inode that holds the parent at the
+ *  time: the snapshot the receive takes keeps the parent, the inode goes
+ *  on as the child.  The file the dump was taken through comes first
+ *  among its siblings, so the restored file ends up as that version.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/mount.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/ext3_jbd.h>
+#include <linux/cred.h>
+#include <asm/uaccess.h>
+#include "namei.h"
+#include "yuiha.h"
+
+#define YUIHA_STREAM_MAGIC	0x444e5359	// "YSND"
+#define YUIHA_STREAM_VERSION	2
+// the stream is a full copy, not relative to a base
+#define YUIHA_STREAM_FULL	0x0001
+
+// ranges asked for per walk of the block maps
+#define YUIHA_SEND_RANGES	256
+
+struct yuiha_stream_header {
+	__le32	sh_magic;
+	__le16	sh_version;
+	__le16	sh_flags;
+	__le32	sh_blocksize;
+	__le32	sh_mode;
+	__le32	sh_uid;
+	__le32	sh_gid;
+	__le32	sh_atime;
+	__le32	sh_mtime;
+	__le32	sh_ctime;
+	__le32	sh_iflags;		// user-visible ext3 i_flags
+	__le64	sh_size;
+	__le64	sh_base_size;
+	__le64	sh_seq;
+	__le32	sh_crtime;
+	__le32	sh_base_crtime;
+	__le64	sh_base_seq;
+};
+
+enum {
+	YUIHA_STREAM_DATA = 1,	// sr_count blocks follow
+	YUIHA_STREAM_END,
+	YUIHA_STREAM_HOLE,	// sr_count blocks become holes, nothing follows
+};
+
+struct yuiha_stream_record {
+	__le64	sr_start;
+	__le32	sr_count;
+	__le32	sr_type;
+};
+
+#define YUIHA_DUMP_MAGIC	0x504d4459	// "YDMP"
+#define YUIHA_DUMP_VERSION	1
+#define YUIHA_DUMP_NO_PARENT	0xffffffff
+
+struct yuiha_dump_header {
+	__le32	dh_magic;
+	__le32	dh_version;
+	__le32	dh_count;		// versions in the dump
+	__le32	dh_reserved;
+};
+
+// in front of the stream of every version
+struct yuiha_dump_entry {
+	__le32	de_parent;		// position in the dump
+	__le32	de_reserved;
+};
+
+static int yuiha_stream_write(struct file *f, const void *buf, size_t len,
+		u64 *bytes)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret = 0;
+
+	set_fs(KERNEL_DS);
+	while (len) {
+		ret = vfs_write(f, (const char __user *)buf, len, &f->f_pos);
+		if (ret <= 0)
+			break;
+		buf += ret;
+		len -= ret;
+		*bytes += ret;
+	}
+	set_fs(old_fs);
+	if (ret < 0)
+		return ret;
+	return len ? -EIO : 0;
+}
+
+static int yuiha_stream_read(struct file *f, void *buf, size_t len,
+		u64 *bytes)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret = 0;
+
+	set_fs(KERNEL_DS);
+	while (len) {
+		ret = vfs_read(f, (char __user *)buf, len, &f->f_pos);
+		if (ret <= 0)
+			break;
+		buf += ret;
+		len -= ret;
+		*bytes += ret;
+	}
+	set_fs(old_fs);
+	if (ret < 0)
+		return ret;
+	// the stream ended early
+	return len ? -EIO : 0;
+}
+
+/*
+ * Send logical block @blk of @inode, as the page cache has it.
+ */
+static int yuiha_send_block(struct file *out, struct inode *inode, u64 blk,
+		u64 *bytes)
+{
+	unsigned int bits = inode->i_blkbits;
+	struct page *page;
+	void *kaddr;
+	int err;
+
+	page = read_mapping_page(inode->i_mapping,
+			blk >> (PAGE_CACHE_SHIFT - bits), NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	kaddr = kmap(page);
+	err = yuiha_stream_write(out, kaddr +
+			((blk << bits) & ~PAGE_CACHE_MASK), 1 << bits, bytes);
+	kunmap(page);
+	page_cache_release(page);
+	return err;
+}
+
+static int yuiha_send_range(struct file *out, struct inode *inode,
+		struct yuiha_diff_range *r, u64 *bytes)
+{
+	u64 end = DIV_ROUND_UP(i_size_read(inode), inode->i_sb->s_blocksize);
+	struct yuiha_stream_record rec;
+	u64 blk, len, n;
+	int err, hole;
+
+	// blocks past the end go with the size
+	if (r->start >= end)
+		return 0;
+	len = min(r->len, end - r->start);
+
+	while (len) {
+		// a run of blocks the version maps, or of holes
+		hole = !bmap(inode, r->start);
+		for (n = 1; n < len && n < ~0U; n++)
+			if (!bmap(inode, r->start + n) == !hole)
+				break;
+		rec.sr_start = cpu_to_le64(r->start);
+		rec.sr_count = cpu_to_le32(n);
+		rec.sr_type = cpu_to_le32(hole ? YUIHA_STREAM_HOLE :
+				YUIHA_STREAM_DATA);
+		err = yuiha_stream_write(out, &rec, sizeof(rec), bytes);
+		if (err)
+			return err;
+		for (blk = r->start; !hole && blk < r->start + n; blk++) {
+			err = yuiha_send_block(out, inode, blk, bytes);
+			if (err)
+				return err;
+			if (fatal_signal_pending(current))
+				return -EINTR;
+			cond_resched();
+		}
+		r->start += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void yuiha_send_header(struct yuiha_stream_header *sh,
+		struct inode *inode, struct inode *base)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->sh_magic = cpu_to_le32(YUIHA_STREAM_MAGIC);
+	sh->sh_version = cpu_to_le16(YUIHA_STREAM_VERSION);
+	sh->sh_flags = cpu_to_le16(base ? 0 : YUIHA_STREAM_FULL);
+	sh->sh_blocksize = cpu_to_le32(inode->i_sb->s_blocksize);
+	sh->sh_mode = cpu_to_le32(inode->i_mode);
+	sh->sh_uid = cpu_to_le32(inode->i_uid);
+	sh->sh_gid = cpu_to_le32(inode->i_gid);
+	sh->sh_atime = cpu_to_le32(inode->i_atime.tv_sec);
+	sh->sh_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	sh->sh_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
+	sh->sh_iflags = cpu_to_le32(EXT3_I(inode)->i_flags &
+			EXT3_FL_USER_VISIBLE);
+	sh->sh_size = cpu_to_le64(i_size_read(inode));
+	sh->sh_base_size = cpu_to_le64(base ? i_size_read(base) : 0);
+	sh->sh_seq = cpu_to_le64(YUIHA_I(inode)->i_seq);
+	sh->sh_crtime = cpu_to_le32(YUIHA_I(inode)->i_crtime);
+	if (base) {
+		sh->sh_base_seq = cpu_to_le64(YUIHA_I(base)->i_seq);
+		sh->sh_base_crtime = cpu_to_le32(YUIHA_I(base)->i_crtime);
+	}
+}
+
+/*
+ * Write the stream of @inode relative to @base, or a full one if @base is
+ * NULL.  @r is room for YUIHA_SEND_RANGES ranges.
+ */
+static int yuiha_send_stream(struct file *out, struct inode *inode,
+		struct inode *base, struct yuiha_diff_range *r, u64 *bytes)
+{
+	struct yuiha_stream_header sh;
+	struct yuiha_stream_record rec;
+	u64 from = 0;
+	int nr, i, err;
+
+	yuiha_send_header(&sh, inode, base);
+	err = yuiha_stream_write(out, &sh, sizeof(sh), bytes);
+	do {
+		if (err)
+			return err;
+		nr = yuiha_diff_ranges(inode, base, from, r,
+				YUIHA_SEND_RANGES, &from);
+		if (nr < 0)
+			return nr;
+		for (i = 0; i < nr && !err; i++)
+			err = yuiha_send_range(out, inode, &r[i], bytes);
+	} while (from);
+	if (err)
+		return err;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.sr_type = cpu_to_le32(YUIHA_STREAM_END);
+	return yuiha_stream_write(out, &rec, sizeof(rec), bytes);
+}
+
+// a live version of @inode's tree with a name, as a base to send against
+static int yuiha_send_base_ok(struct inode *inode, struct inode *base)
+{
+	return yuiha_file(base) && base->i_nlink && YUIHA_I(base)->i_seq &&
+		!(EXT3_I(base)->i_flags & (YUIHA_PHANTOM_VERSION_FL |
+					YUIHA_PHANTOM_ROOT_VERSION_FL)) &&
+		yuiha_same_tree(inode, base);
+}
+
+int yuiha_send(struct file *filp, struct yuiha_send __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *base = NULL;
+	struct yuiha_diff_range *r;
+	struct yuiha_send arg;
+	struct file *out;
+	int err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags)
+		return -EINVAL;
+	err = inode_permission(inode, MAY_READ);
+	if (err)
+		return err;
+
+	if (arg.base_ino) {
+		base = yuiha_ilookup(inode->i_sb, arg.base_ino);
+		if (IS_ERR(base))
+			return PTR_ERR(base) == -ESTALE ? -ENOENT :
+				PTR_ERR(base);
+		err = -ENOENT;
+		if (base->i_generation != arg.base_generation ||
+				!yuiha_send_base_ok(inode, base))
+			goto out_base;
+	}
+
+	err = -EBADF;
+	out = fget(arg.fd);
+	if (!out)
+		goto out_base;
+	if (!(out->f_mode & FMODE_WRITE))
+		goto out_put;
+	err = -ENOMEM;
+	r = kcalloc(YUIHA_SEND_RANGES, sizeof(*r), GFP_KERNEL);
+	if (!r)
+		goto out_put;
+
+	arg.bytes = 0;
+	err = yuiha_send_stream(out, inode, base, r, &arg.bytes);
+	kfree(r);
+	if (!err && put_user(arg.bytes, &uarg->bytes))
+		err = -EFAULT;
+out_put:
+	fput(out);
+out_base:
+	if (base)
+		iput(base);
+	return err;
+}
+
+/*
+ * Check @sh against @inode, the replica of the base it was sent from.
+ */
+static int yuiha_receive_check(struct inode *inode,
+		struct yuiha_stream_header *sh)
+{
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+
+	if (le32_to_cpu(sh->sh_magic) != YUIHA_STREAM_MAGIC ||
+			le16_to_cpu(sh->sh_version) != YUIHA_STREAM_VERSION ||
+			le16_to_cpu(sh->sh_flags) & ~YUIHA_STREAM_FULL)
+		return -EINVAL;
+	if (le32_to_cpu(sh->sh_blocksize) != inode->i_sb->s_blocksize)
+		return -EINVAL;
+	if (le16_to_cpu(sh->sh_flags) & YUIHA_STREAM_FULL)
+		return 0;
+	// a replica that is not the base the stream was made against
+	if (!yi->i_origin_seq ||
+			yi->i_origin_seq != le64_to_cpu(sh->sh_base_seq) ||
+			yi->i_origin_crtime != le32_to_cpu(sh->sh_base_crtime) ||
+			i_size_read(inode) != le64_to_cpu(sh->sh_base_size))
+		return -ESTALE;
+	return 0;
+}
+
+/*
+ * Give @inode the flags of the version in @sh and record the version as
+ * its origin.  Called with i_mutex held.
+ */
+static int yuiha_receive_ident(struct inode *inode,
+		struct yuiha_stream_header *sh)
+{
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	unsigned int flags = le32_to_cpu(sh->sh_iflags) &
+		EXT3_FL_USER_MODIFIABLE;
+	handle_t *handle;
+	int err;
+
+	// the same as EXT3_IOC_SETFLAGS asks for
+	if ((flags ^ ei->i_flags) & (EXT3_APPEND_FL | EXT3_IMMUTABLE_FL) &&
+			!capable(CAP_LINUX_IMMUTABLE))
+		return -EPERM;
+
+	handle = ext3_journal_start(inode, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	ei->i_flags = (ei->i_flags & ~EXT3_FL_USER_MODIFIABLE) | flags;
+	ext3_set_inode_flags(inode);
+	YUIHA_I(inode)->i_origin_seq = le64_to_cpu(sh->sh_seq);
+	YUIHA_I(inode)->i_origin_crtime = le32_to_cpu(sh->sh_crtime);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	err = ext3_mark_inode_dirty(handle, inode);
+	ext3_journal_stop(handle);
+	return err;
+}
+
+static int yuiha_receive_attr(struct file *filp,
+		struct yuiha_stream_header *sh)
+{
+	struct dentry *dentry = filp->f_dentry;
+	struct inode *inode = dentry->d_inode;
+	struct iattr attr;
+	int err;
+
+	attr.ia_valid = ATTR_SIZE | ATTR_MODE | ATTR_ATIME | ATTR_MTIME |
+		ATTR_CTIME | ATTR_ATIME_SET | ATTR_MTIME_SET;
+	attr.ia_size = le64_to_cpu(sh->sh_size);
+	attr.ia_mode = (inode->i_mode & ~S_IALLUGO) |
+		(le32_to_cpu(sh->sh_mode) & S_IALLUGO);
+	attr.ia_atime.tv_sec = le32_to_cpu(sh->sh_atime);
+	attr.ia_atime.tv_nsec = 0;
+	attr.ia_mtime.tv_sec = le32_to_cpu(sh->sh_mtime);
+	attr.ia_mtime.tv_nsec = 0;
+	attr.ia_ctime = CURRENT_TIME_SEC;
+
+	mutex_lock(&inode->i_mutex);
+	err = notify_change(dentry, &attr);
+	if (!err)
+		err = yuiha_receive_ident(inode, sh);
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+/*
+ * Make the @count blocks from @start of @filp holes.  The blocks of a
+ * page the range covers only in part are written as zeroes, @buf is a
+ * block of them.
+ */
+static int yuiha_receive_hole(struct file *filp, u64 start, u32 count,
+		void *buf)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	unsigned int bs = inode->i_sb->s_blocksize;
+	u64 per_page = PAGE_CACHE_SIZE / bs, end = start + count, first, last;
+	mm_segment_t old_fs;
+	loff_t pos;
+	ssize_t ret;
+	int err = 0;
+
+	first = (start + per_page - 1) & ~(per_page - 1);
+	last = end & ~(per_page - 1);
+	if (first >= last)
+		first = last = end;
+
+	memset(buf, 0, bs);
+	for (pos = start * bs; pos < end * bs; ) {
+		if (pos == first * bs && first < last) {
+			mutex_lock(&inode->i_mutex);
+			err = yuiha_punch_blocks(inode, first, last - first);
+			mutex_unlock(&inode->i_mutex);
+			if (err)
+				return err;
+			pos = last * bs;
+			continue;
+		}
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = vfs_write(filp, (const char __user *)buf, bs, &pos);
+		set_fs(old_fs);
+		if (ret < 0)
+			return ret;
+		if (ret != bs)
+			return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Apply the stream read from @in to @filp.  @full is whether it has to
+ * be a full stream, -1 for either.  @buf has room for a block.
+ */
+static int yuiha_receive_stream(struct file *filp, struct file *in, int full,
+		void *buf, u64 *bytes)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	unsigned int bs = inode->i_sb->s_blocksize;
+	struct yuiha_stream_header sh;
+	struct yuiha_stream_record rec;
+	struct dentry *version;
+	mm_segment_t old_fs;
+	loff_t pos;
+	ssize_t ret;
+	u64 end;
+	u32 n;
+	int err;
+
+	err = yuiha_stream_read(in, &sh, sizeof(sh), bytes);
+	if (!err)
+		err = yuiha_receive_check(inode, &sh);
+	if (err)
+		return err;
+	if (full >= 0 &&
+	    !!(le16_to_cpu(sh.sh_flags) & YUIHA_STREAM_FULL) != full)
+		return -EINVAL;
+
+	// the base stays as a version of its own
+	if (!(le16_to_cpu(sh.sh_flags) & YUIHA_STREAM_FULL)) {
+		version = yuiha_create_snapshot(filp->f_dentry->d_parent,
+				inode, filp->f_dentry);
+		if (IS_ERR(version))
+			return PTR_ERR(version);
+	}
+
+	for (;;) {
+		err = yuiha_stream_read(in, &rec, sizeof(rec), bytes);
+		if (err)
+			return err;
+		if (le32_to_cpu(rec.sr_type) == YUIHA_STREAM_END)
+			break;
+		if (le32_to_cpu(rec.sr_type) == YUIHA_STREAM_HOLE) {
+			// the sender sends no holes past the end
+			end = DIV_ROUND_UP(le64_to_cpu(sh.sh_size), bs);
+			if (le64_to_cpu(rec.sr_start) > end ||
+			    le32_to_cpu(rec.sr_count) > end - le64_to_cpu(rec.sr_start))
+				return -EINVAL;
+			err = yuiha_receive_hole(filp, le64_to_cpu(rec.sr_start),
+					le32_to_cpu(rec.sr_count), buf);
+			if (err)
+				return err;
+			continue;
+		}
+		if (le32_to_cpu(rec.sr_type) != YUIHA_STREAM_DATA)
+			return -EINVAL;
+
+		pos = le64_to_cpu(rec.sr_start) * bs;
+		for (n = 0; n < le32_to_cpu(rec.sr_count); n++) {
+			err = yuiha_stream_read(in, buf, bs, bytes);
+			if (err)
+				return err;
+			old_fs = get_fs();
+			set_fs(KERNEL_DS);
+			ret = vfs_write(filp, (const char __user *)buf, bs, &pos);
+			set_fs(old_fs);
+			if (ret < 0)
+				return ret;
+			if (ret != bs)
+				return -EIO;
+			if (fatal_signal_pending(current))
+				return -EINTR;
+			cond_resched();
+		}
+	}
+	return yuiha_receive_attr(filp, &sh);
+}
+
+int yuiha_receive(struct file *filp, struct yuiha_receive __user *uarg)
+{
+	struct yuiha_receive arg;
+	struct file *in;
+	void *buf;
+	int err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags)
+		return -EINVAL;
+	if (!(filp->f_mode & FMODE_WRITE) || filp->f_flags & O_APPEND)
+		return -EBADF;
+
+	in = fget(arg.fd);
+	if (!in)
+		return -EBADF;
+	err = -EBADF;
+	if (!(in->f_mode & FMODE_READ))
+		goto out_put;
+	err = -ENOMEM;
+	buf = kmalloc(filp->f_dentry->d_inode->i_sb->s_blocksize, GFP_KERNEL);
+	if (!buf)
+		goto out_put;
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		goto out_free;
+
+	arg.bytes = 0;
+	err = yuiha_receive_stream(filp, in, -1, buf, &arg.bytes);
+	if (!err && put_user(arg.bytes, &uarg->bytes))
+		err = -EFAULT;
+	mnt_drop_write(filp->f_path.mnt);
+out_free:
+	kfree(buf);
+out_put:
+	fput(in);
+	return err;
+}
+
+struct yuiha_dump_node {
+	unsigned long	ino;
+	u32		parent;		// position in the dump
+};
+
+static int yuiha_dump_vnode(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn)
+{
+	int err = yuiha_vtree_lookup(sb, ino, vn);
+
+	// deleted versions stay in the tree until reclaimed
+	if (err == -ESTALE)
+		err = yuiha_read_vnode(sb, ino, vn, 1);
+	return err;
+}
+
+/*
+ * Put the live versions of the tree below @top into @nodes, parents first
+ * and the branch towards @self before its siblings.  @path holds @self
+ * and its ancestors, @stack has room for @max entries as @nodes has.
+ * Returns how many versions went in.
+ */
+static int yuiha_dump_order(struct super_block *sb, unsigned long top,
+		unsigned long *path, int depth, struct yuiha_dump_node *nodes,
+		struct yuiha_dump_node *stack, int max)
+{
+	struct yuiha_dump_node cur, tmp;
+	struct yuiha_vnode vn, cvn;
+	unsigned long ino;
+	int nr = 0, sp = 0, mine, i, err;
+	u32 idx;
+
+	stack[sp].ino = top;
+	stack[sp++].parent = YUIHA_DUMP_NO_PARENT;
+	while (sp) {
+		cur = stack[--sp];
+		err = yuiha_dump_vnode(sb, cur.ino, &vn);
+		if (err)
+			return err;
+
+		idx = cur.parent;
+		if (vn.nlink && !(vn.flags & (YUIHA_PHANTOM_VERSION_FL |
+					YUIHA_PHANTOM_ROOT_VERSION_FL |
+					YUIHA_TEARDOWN_FL))) {
+			// the tree grew since it was counted
+			if (nr == max)
+				return -EAGAIN;
+			// a second top, below a deleted one, goes below the
+			// first: a stream is right against any base
+			if (nr && cur.parent == YUIHA_DUMP_NO_PARENT)
+				cur.parent = 0;
+			nodes[nr] = cur;
+			idx = nr++;
+		}
+
+		mine = -1;
+		for (ino = vn.child; ino; ino = cvn.sibling_next) {
+			if (sp == max)
+				return -EAGAIN;
+			for (i = 0; i < depth && mine < 0; i++)
+				if (path[i] == ino)
+					mine = sp;
+			stack[sp].ino = ino;
+			stack[sp++].parent = idx;
+			err = yuiha_dump_vnode(sb, ino, &cvn);
+			if (err)
+				return err;
+			if (cvn.sibling_next == vn.child)
+				break;
+		}
+		// the branch towards @self is taken first
+		if (mine >= 0) {
+			tmp = stack[mine];
+			stack[mine] = stack[sp - 1];
+			stack[sp - 1] = tmp;
+		}
+	}
+	return nr;
+}
+
+/*
+ * Write the versions in @nodes to @out, each against its parent.
+ */
+static int yuiha_dump_write(struct file *out, struct super_block *sb,
+		struct yuiha_dump_node *nodes, int nr, u64 *bytes)
+{
+	struct yuiha_dump_header dh;
+	struct yuiha_dump_entry de;
+	struct yuiha_diff_range *r;
+	struct inode *inode, *base;
+	int i, err;
+
+	r = kcalloc(YUIHA_SEND_RANGES, sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	memset(&dh, 0, sizeof(dh));
+	dh.dh_magic = cpu_to_le32(YUIHA_DUMP_MAGIC);
+	dh.dh_version = cpu_to_le32(YUIHA_DUMP_VERSION);
+	dh.dh_count = cpu_to_le32(nr);
+	err = yuiha_stream_write(out, &dh, sizeof(dh), bytes);
+
+	for (i = 0; i < nr && !err; i++) {
+		de.de_parent = cpu_to_le32(nodes[i].parent);
+		de.de_reserved = 0;
+		err = yuiha_stream_write(out, &de, sizeof(de), bytes);
+		if (err)
+			break;
+
+		inode = yuiha_ilookup(sb, nodes[i].ino);
+		if (IS_ERR(inode)) {
+			err = PTR_ERR(inode);
+			break;
+		}
+		base = NULL;
+		if (nodes[i].parent != YUIHA_DUMP_NO_PARENT) {
+			base = yuiha_ilookup(sb, nodes[nodes[i].parent].ino);
+			if (IS_ERR(base)) {
+				iput(inode);
+				err = PTR_ERR(base);
+				break;
+			}
+		}
+		err = inode_permission(inode, MAY_READ);
+		if (!err)
+			err = yuiha_send_stream(out, inode, base, r, bytes);
+		if (base)
+			iput(base);
+		iput(inode);
+	}
+	kfree(r);
+	// a version deleted during the dump
+	return err == -ESTALE ? -EAGAIN : err;
+}
+
+int yuiha_dump(struct file *filp, struct yuiha_dump __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *root;
+	struct super_block *sb = inode->i_sb;
+	struct yuiha_dump_node *nodes = NULL, *stack = NULL;
+	unsigned long *path = NULL, *inos, top, ino;
+	struct yuiha_vnode vn;
+	struct yuiha_dump arg;
+	struct file *out;
+	int max, depth = 0, nr, err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+
+	// a file that was never versioned is its own top
+	root = yuiha_trace_root(inode);
+	if (!root)
+		root = igrab(inode);
+	if (!root)
+		return -ENOENT;
+	max = yuiha_collect_tree(root, &inos);
+	top = root->i_ino;
+	iput(root);
+	if (max < 0)
+		return max;
+	kfree(inos);
+	max++;
+
+	err = -ENOMEM;
+	nodes = kcalloc(max, sizeof(*nodes), GFP_KERNEL);
+	stack = kcalloc(max, sizeof(*stack), GFP_KERNEL);
+	path = kcalloc(max, sizeof(*path), GFP_KERNEL);
+	if (!nodes || !stack || !path)
+		goto out;
+
+	for (ino = inode->i_ino; ino && depth < max; ino = vn.parent) {
+		path[depth++] = ino;
+		err = yuiha_dump_vnode(sb, ino, &vn);
+		if (err)
+			goto out;
+	}
+	nr = yuiha_dump_order(sb, top, path, depth, nodes, stack, max);
+	err = nr;
+	if (nr < 0)
+		goto out;
+
+	err = -EBADF;
+	out = fget(arg.fd);
+	if (!out)
+		goto out;
+	if (out->f_mode & FMODE_WRITE) {
+		arg.bytes = 0;
+		err = yuiha_dump_write(out, sb, nodes, nr, &arg.bytes);
+	}
+	fput(out);
+
+	arg.versions = nr;
+	if (!err && copy_to_user(uarg, &arg, sizeof(arg)))
+		err = -EFAULT;
+out:
+	kfree(path);
+	kfree(stack);
+	kfree(nodes);
+	return err;
+}
+
+/*
+ * Receive the version at @pos of the dump into the inode @holder holds
+ * for its parent.  @holder is updated for both.
+ */
+static int yuiha_restore_version(struct file *filp, struct file *in,
+		unsigned long *holder, u32 pos, u32 parent, void *buf,
+		u64 *bytes)
+{
+	struct inode *inode;
+	struct dentry *dentry;
+	struct file *f;
+	int err;
+
+	inode = yuiha_ilookup(filp->f_dentry->d_inode->i_sb, holder[parent]);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	dentry = yuiha_version_dentry(filp->f_dentry, inode);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	f = dentry_open(dentry, mntget(filp->f_path.mnt),
+			O_WRONLY | O_LARGEFILE, current_cred());
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
+	// the snapshot the receive takes goes on as the parent
+	err = yuiha_receive_stream(f, in, 0, buf, bytes);
+	if (!err) {
+		holder[parent] = YUIHA_I(inode)->i_parent_ino;
+		holder[pos] = inode->i_ino;
+	}
+	fput(f);
+	return err;
+}
+
+int yuiha_restore(struct file *filp, struct yuiha_dump __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	struct yuiha_dump_header dh;
+	struct yuiha_dump_entry de;
+	struct yuiha_dump arg;
+	unsigned long *holder = NULL;
+	struct file *in;
+	void *buf = NULL;
+	u32 count, i, parent;
+	int err;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	if (!(filp->f_mode & FMODE_WRITE) || filp->f_flags & O_APPEND)
+		return -EBADF;
+	// the tree is rebuilt from nothing
+	if (yi->i_parent_ino || yi->i_child_ino || yi->i_phantom_root_ino)
+		return -EINVAL;
+
+	in = fget(arg.fd);
+	if (!in)
+		return -EBADF;
+	err = -EBADF;
+	if (!(in->f_mode & FMODE_READ))
+		goto out_put;
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		goto out_put;
+
+	arg.bytes = 0;
+	err = yuiha_stream_read(in, &dh, sizeof(dh), &arg.bytes);
+	if (err)
+		goto out_drop;
+	count = le32_to_cpu(dh.dh_count);
+	err = -EINVAL;
+	if (le32_to_cpu(dh.dh_magic) != YUIHA_DUMP_MAGIC ||
+			le32_to_cpu(dh.dh_version) != YUIHA_DUMP_VERSION ||
+			!count || count >
+			le32_to_cpu(EXT3_SB(sb)->s_es->s_inodes_count))
+		goto out_drop;
+	err = -ENOMEM;
+	holder = kcalloc(count, sizeof(*holder), GFP_KERNEL);
+	buf = kmalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!holder || !buf)
+		goto out_drop;
+
+	for (i = 0, err = 0; i < count && !err; i++) {
+		err = yuiha_stream_read(in, &de, sizeof(de), &arg.bytes);
+		if (err)
+			break;
+		parent = le32_to_cpu(de.de_parent);
+		err = -EINVAL;
+		if (!i != (parent == YUIHA_DUMP_NO_PARENT) ||
+				(i && parent >= i))
+			break;
+
+		if (i) {
+			err = yuiha_restore_version(filp, in, holder, i,
+					parent, buf, &arg.bytes);
+		} else {
+			err = yuiha_receive_stream(filp, in, 1, buf,
+					&arg.bytes);
+			holder[0] = inode->i_ino;
+		}
+	}
+	arg.versions = i;
+	if (!err && copy_to_user(uarg, &arg, sizeof(arg)))
+		err = -EFAULT;
+out_drop:
+	mnt_drop_write(filp->f_path.mnt);
+	kfree(buf);
+	kfree(holder);
+out_put:
+	fput(in);
+	return err;
+}
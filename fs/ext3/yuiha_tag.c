@@ -0,0 +1,208 @@
+/*
+ *  linux/fs/ext3/yuiha_tag.c
+ *
+ *  Named tags on versions.
+ *
+ *  A tag names one version of a tree.  The tags of a tree are trusted
+ *  xattrs of its phantom root, "yuiha.tag.<name>" holding the inode and
+ *  generation of the version, so a tag is found with one xattr lookup and
+ *  goes with the tree.  Every version counts the tags naming it in
+ *  i_tags, and YUIHA_IOC_PRUNE counts a tagged version as pinned.  A
+ *  version that is deleted anyway leaves its tags stale: they are not
+ *  found and may be set on another version.
+ *
+ *  The tag changes of a tree are serialised by the phantom root's i_mutex.
+ */
+
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/string.h>
+#include <linux/ext3_jbd.h>
+#include <asm/uaccess.h>
+#include "xattr.h"
+#include "yuiha.h"
+
+#define YUIHA_TAG_PREFIX	"yuiha.tag."
+// the xattr, and the versions that gain and lose the tag
+#define YUIHA_TAG_TRANS_BLOCKS(sb)	(EXT3_DATA_TRANS_BLOCKS(sb) + 2)
+
+struct yuiha_tag_value {
+	__le32	tv_ino;
+	__le32	tv_generation;
+};
+
+static int yuiha_tag_name(struct yuiha_tag *tag, char *name)
+{
+	size_t len = strnlen(tag->name, YUIHA_TAG_LEN);
+
+	if (!len || len == YUIHA_TAG_LEN)
+		return -EINVAL;
+	sprintf(name, YUIHA_TAG_PREFIX "%s", tag->name);
+	return 0;
+}
+
+// the phantom root of @inode's tree
+static struct inode *yuiha_tag_root(struct inode *inode)
+{
+	unsigned long ino = YUIHA_I(inode)->i_phantom_root_ino;
+
+	if (EXT3_I(inode)->i_flags & YUIHA_PHANTOM_ROOT_VERSION_FL)
+		return igrab(inode) ?: ERR_PTR(-ENOENT);
+	// a file that was never versioned has nothing to tag
+	if (!ino)
+		return ERR_PTR(-ENOENT);
+	return yuiha_ilookup(inode->i_sb, ino);
+}
+
+/*
+ * The version tag @name of @root names, with a reference.  NULL if the tag
+ * is stale, -ENODATA if there is no such tag.
+ */
+static struct inode *yuiha_tag_get(struct inode *root, const char *name)
+{
+	struct yuiha_tag_value tv;
+	struct inode *inode;
+	int err;
+
+	err = ext3_xattr_get(root, EXT3_XATTR_INDEX_TRUSTED, name,
+			&tv, sizeof(tv));
+	if (err < 0)
+		return ERR_PTR(err);
+	if (err != sizeof(tv))
+		return ERR_PTR(-EIO);
+
+	inode = yuiha_ilookup(root->i_sb, le32_to_cpu(tv.tv_ino));
+	if (IS_ERR(inode))
+		return PTR_ERR(inode) == -ESTALE ? NULL : inode;
+	if (!yuiha_file(inode) || !inode->i_nlink ||
+			inode->i_generation != le32_to_cpu(tv.tv_generation) ||
+			YUIHA_I(inode)->i_phantom_root_ino != root->i_ino ||
+			EXT3_I(inode)->i_flags & YUIHA_PHANTOM_VERSION_FL) {
+		iput(inode);
+		return NULL;
+	}
+	return inode;
+}
+
+/*
+ * Set, move or remove the tag on @root's tree.  @inode is the version to
+ * tag, @old the one the tag names now.
+ */
+static int yuiha_tag_update(struct inode *root, struct inode *inode,
+		struct inode *old, const char *name, int remove)
+{
+	struct yuiha_tag_value tv;
+	handle_t *handle;
+	int err, err2;
+
+	if (!remove && YUIHA_I(inode)->i_tags == (__u16)~0)
+		return -ENOSPC;
+	tv.tv_ino = cpu_to_le32(inode->i_ino);
+	tv.tv_generation = cpu_to_le32(inode->i_generation);
+
+	handle = ext3_journal_start(root, YUIHA_TAG_TRANS_BLOCKS(root->i_sb));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = ext3_xattr_set_handle(handle, root, EXT3_XATTR_INDEX_TRUSTED,
+			name, remove ? NULL : &tv, remove ? 0 : sizeof(tv), 0);
+	if (!err && old && YUIHA_I(old)->i_tags) {
+		YUIHA_I(old)->i_tags--;
+		err = ext3_mark_inode_dirty(handle, old);
+	}
+	if (!err && !remove) {
+		YUIHA_I(inode)->i_tags++;
+		err = ext3_mark_inode_dirty(handle, inode);
+	}
+	err2 = ext3_journal_stop(handle);
+	return err ? err : err2;
+}
+
+int yuiha_tag(struct file *filp, struct yuiha_tag __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *root, *old;
+	char name[sizeof(YUIHA_TAG_PREFIX) + YUIHA_TAG_LEN];
+	struct yuiha_tag tag;
+	int remove, err;
+
+	if (!is_owner_or_cap(inode))
+		return -EACCES;
+	if (copy_from_user(&tag, uarg, sizeof(tag)))
+		return -EFAULT;
+	if (tag.flags & ~YUIHA_TAG_FLAGS || tag.reserved ||
+			(tag.flags & YUIHA_TAG_MOVE &&
+			 tag.flags & YUIHA_TAG_REMOVE))
+		return -EINVAL;
+	err = yuiha_tag_name(&tag, name);
+	if (err)
+		return err;
+	remove = tag.flags & YUIHA_TAG_REMOVE;
+	if (!remove && EXT3_I(inode)->i_flags &
+			(YUIHA_PHANTOM_ROOT_VERSION_FL | YUIHA_PHANTOM_VERSION_FL))
+		return -EINVAL;
+
+	root = yuiha_tag_root(inode);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		goto out;
+
+	mutex_lock(&root->i_mutex);
+	old = yuiha_tag_get(root, name);
+	if (IS_ERR(old)) {
+		err = PTR_ERR(old);
+		old = NULL;
+		// nothing to remove, anything to set
+		if (err == -ENODATA)
+			err = remove ? -ENOENT : 0;
+		if (err || remove)
+			goto out_unlock;
+	}
+	if (!remove && old == inode)
+		goto out_unlock;
+	if (!remove && old && !(tag.flags & YUIHA_TAG_MOVE)) {
+		err = -EEXIST;
+		goto out_unlock;
+	}
+	err = yuiha_tag_update(root, inode, old, name, remove);
+out_unlock:
+	mutex_unlock(&root->i_mutex);
+	iput(old);
+	mnt_drop_write(filp->f_path.mnt);
+out:
+	iput(root);
+	return err;
+}
+
+int yuiha_lookup_tag(struct file *filp, struct yuiha_tag __user *uarg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *root, *version;
+	char name[sizeof(YUIHA_TAG_PREFIX) + YUIHA_TAG_LEN];
+	struct yuiha_tag tag;
+	int err;
+
+	if (copy_from_user(&tag, uarg, sizeof(tag)))
+		return -EFAULT;
+	if (tag.flags || tag.reserved)
+		return -EINVAL;
+	err = yuiha_tag_name(&tag, name);
+	if (err)
+		return err;
+
+	root = yuiha_tag_root(inode);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	version = yuiha_tag_get(root, name);
+	iput(root);
+	if (!version || PTR_ERR(version) == -ENODATA)
+		return -ENOENT;
+	if (IS_ERR(version))
+		return PTR_ERR(version);
+
+	tag.ino = version->i_ino;
+	tag.generation = version->i_generation;
+	iput(version);
+	if (copy_to_user(uarg, &tag, sizeof(tag)))
+		return -EFAULT;
+	return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ *  linux/fs/ext3/yuiha_vtree.c
+ *
+ *  In-memory cache of the version-tree topology.
+ *
+ *  Walking a version tree one hop at a time through ext3_iget() reads the
+ *  inode table once per version and fills the inode cache with versions
+ *  nobody opened.  The links of every version (parent, first child,
+ *  sibling ring, flags) and what tree-wide queries look at besides (link
+ *  count, size, blocks, mtime) are small, so they are kept here instead.
+ *  Nodes are read straight from the inode table on first access and
+ *  grouped by the tree they belong to, keyed by its top: the phantom root,
+ *  or the version itself while the file has none.  Whole trees are the
+ *  unit of reclaim.
+ *
+ *  Every filesystem has a cache of its own, hung off ext3_sb_info, so
+ *  mounts do not contend for one lock.  Only the shrinker looks at all of
+ *  them.
+ *
+ *  The cache never holds the only copy of anything.  Every change of the
+ *  links goes through ext3_do_update_inode(), which refreshes a cached
+ *  node in place, and freeing an inode forgets it.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/ext3_jbd.h>
+#include "yuiha.h"
+
+#define YUIHA_VTREE_HASH_BITS	10
+#define YUIHA_VTREE_HASH_SIZE	(1 << YUIHA_VTREE_HASH_BITS)
+
+struct yuiha_vtree {
+	struct hlist_node	t_hash;
+	struct list_head	t_lru;
+	struct list_head	t_nodes;
+	unsigned long		t_root;
+	int			t_count;
+};
+
+struct yuiha_vtree_node {
+	struct hlist_node	n_hash;
+	struct list_head	n_list;
+	struct yuiha_vtree	*n_tree;
+	struct yuiha_vnode	n_vnode;
+};
+
+struct yuiha_vtree_cache {
+	struct list_head	c_list;		// on yuiha_vtree_caches
+	// Everything below is protected by c_lock.
+	spinlock_t		c_lock;
+	struct hlist_head	c_vnode_hash[YUIHA_VTREE_HASH_SIZE];
+	struct hlist_head	c_vtree_hash[YUIHA_VTREE_HASH_SIZE];
+	struct list_head	c_lru;
+	int			c_nr_nodes;
+	// Bumped by every change, so a node read from disk meanwhile is dropped.
+	unsigned long		c_seq;
+};
+
+// The caches of all mounts, for the shrinker.
+static LIST_HEAD(yuiha_vtree_caches);
+static DEFINE_SPINLOCK(yuiha_vtree_caches_lock);
+
+static struct kmem_cache *yuiha_vnode_cachep;
+
+static inline struct hlist_head *
+yuiha_vtree_bucket(struct hlist_head *table, unsigned long ino)
+{
+	return table + hash_long(ino, YUIHA_VTREE_HASH_BITS);
+}
+
+static inline unsigned long yuiha_vtree_key(struct yuiha_vnode *vn)
+{
+	return vn->phantom_root ? vn->phantom_root : vn->ino;
+}
+
+static struct yuiha_vtree_node *
+yuiha_vtree_find_node(struct yuiha_vtree_cache *c, unsigned long ino)
+{
+	struct yuiha_vtree_node *node;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(node, pos,
+			yuiha_vtree_bucket(c->c_vnode_hash, ino), n_hash) {
+		if (node->n_vnode.ino == ino)
+			return node;
+	}
+	return NULL;
+}
+
+static struct yuiha_vtree *
+yuiha_vtree_find_tree(struct yuiha_vtree_cache *c, unsigned long root)
+{
+	struct yuiha_vtree *tree;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(tree, pos,
+			yuiha_vtree_bucket(c->c_vtree_hash, root), t_hash) {
+		if (tree->t_root == root)
+			return tree;
+	}
+	return NULL;
+}
+
+static void yuiha_vtree_drop_node(struct yuiha_vtree_cache *c,
+		struct yuiha_vtree_node *node)
+{
+	struct yuiha_vtree *tree = node->n_tree;
+
+	hlist_del(&node->n_hash);
+	list_del(&node->n_list);
+	kmem_cache_free(yuiha_vnode_cachep, node);
+	c->c_nr_nodes--;
+
+	if (!--tree->t_count) {
+		hlist_del(&tree->t_hash);
+		list_del(&tree->t_lru);
+		kfree(tree);
+	}
+}
+
+static void yuiha_vtree_drop_tree(struct yuiha_vtree_cache *c,
+		struct yuiha_vtree *tree)
+{
+	struct yuiha_vtree_node *node, *next;
+
+	// the last node takes the tree with it
+	list_for_each_entry_safe(node, next, &tree->t_nodes, n_list)
+		yuiha_vtree_drop_node(c, node);
+}
+
+/*
+ * Fill @vn with the links of version @ino, reading them from the inode
+ * table when they are not cached yet.  The inode itself is neither looked
+ * up nor instantiated.
+ */
+int yuiha_vtree_lookup(struct super_block *sb, unsigned long ino,
+		struct yuiha_vnode *vn)
+{
+	struct yuiha_vtree_cache *c = EXT3_SB(sb)->s_vtree;
+	struct yuiha_vtree_node *node, *new_node;
+	struct yuiha_vtree *tree, *new_tree;
+	unsigned long seq;
+	int err;
+
+	// before the mount set the cache up
+	if (!c)
+		return yuiha_read_vnode(sb, ino, vn, 0);
+
+	spin_lock(&c->c_lock);
+	node = yuiha_vtree_find_node(c, ino);
+	if (node) {
+		*vn = node->n_vnode;
+		list_move(&node->n_tree->t_lru, &c->c_lru);
+		spin_unlock(&c->c_lock);
+		return 0;
+	}
+	seq = c->c_seq;
+	spin_unlock(&c->c_lock);
+
+	new_node = kmem_cache_alloc(yuiha_vnode_cachep, GFP_NOFS);
+	if (!new_node)
+		return -ENOMEM;
+	err = yuiha_read_vnode(sb, ino, &new_node->n_vnode, 0);
+	if (err) {
+		kmem_cache_free(yuiha_vnode_cachep, new_node);
+		return err;
+	}
+	*vn = new_node->n_vnode;
+
+	// Not being able to cache it is no reason to fail the lookup.
+	new_tree = kmalloc(sizeof(*new_tree), GFP_NOFS);
+	if (!new_tree)
+		goto out_free;
+
+	spin_lock(&c->c_lock);
+	if (seq != c->c_seq || yuiha_vtree_find_node(c, ino))
+		goto out_unlock;
+
+	tree = yuiha_vtree_find_tree(c, yuiha_vtree_key(vn));
+	if (!tree) {
+		tree = new_tree;
+		new_tree = NULL;
+		tree->t_root = yuiha_vtree_key(vn);
+		tree->t_count = 0;
+		INIT_LIST_HEAD(&tree->t_nodes);
+		INIT_LIST_HEAD(&tree->t_lru);
+		hlist_add_head(&tree->t_hash,
+				yuiha_vtree_bucket(c->c_vtree_hash, tree->t_root));
+	}
+
+	new_node->n_tree = tree;
+	hlist_add_head(&new_node->n_hash,
+			yuiha_vtree_bucket(c->c_vnode_hash, ino));
+	list_add(&new_node->n_list, &tree->t_nodes);
+	tree->t_count++;
+	c->c_nr_nodes++;
+	list_move(&tree->t_lru, &c->c_lru);
+	new_node = NULL;
+
+out_unlock:
+	spin_unlock(&c->c_lock);
+out_free:
+	kfree(new_tree);
+	if (new_node)
+		kmem_cache_free(yuiha_vnode_cachep, new_node);
+	return 0;
+}
+
+/*
+ * Called whenever @inode is written back to its on-disk inode.  A cached
+ * node takes over the new links; one that moved to another tree is
+ * dropped and read again on its next lookup.
+ */
+void yuiha_vtree_update(struct inode *inode)
+{
+	struct yuiha_vtree_cache *c = EXT3_SB(inode->i_sb)->s_vtree;
+	struct yuiha_inode_info *yi = YUIHA_I(inode);
+	struct yuiha_vtree_node *node;
+	struct yuiha_vnode *vn;
+
+	if (!c)
+		return;
+
+	spin_lock(&c->c_lock);
+	c->c_seq++;
+	node = yuiha_vtree_find_node(c, inode->i_ino);
+	if (!node)
+		goto out;
+
+	vn = &node->n_vnode;
+	vn->generation = inode->i_generation;
+	vn->parent = yi->i_parent_ino;
+	vn->child = yi->i_child_ino;
+	vn->sibling_next = yi->i_sibling_next_ino;
+	vn->sibling_prev = yi->i_sibling_prev_ino;
+	vn->phantom_root = yi->i_phantom_root_ino;
+	vn->flags = yi->i_ext3.i_flags;
+	vn->nlink = inode->i_nlink;
+	vn->size = yi->i_ext3.i_disksize;
+	vn->blocks = inode->i_blocks;
+	vn->mtime = inode->i_mtime.tv_sec;
+	vn->tags = yi->i_tags;
+	if (yuiha_vtree_key(vn) != node->n_tree->t_root)
+		yuiha_vtree_drop_node(c, node);
+out:
+	spin_unlock(&c->c_lock);
+}
+
+/*
+ * @ino is being freed.
+ */
+void yuiha_vtree_forget(struct super_block *sb, unsigned long ino)
+{
+	struct yuiha_vtree_cache *c = EXT3_SB(sb)->s_vtree;
+	struct yuiha_vtree_node *node;
+
+	if (!c)
+		return;
+
+	spin_lock(&c->c_lock);
+	c->c_seq++;
+	node = yuiha_vtree_find_node(c, ino);
+	if (node)
+		yuiha_vtree_drop_node(c, node);
+	spin_unlock(&c->c_lock);
+}
+
+/*
+ * Called at mount time, before the orphans are cleaned up.
+ */
+int yuiha_vtree_setup(struct super_block *sb)
+{
+	struct yuiha_vtree_cache *c;
+	int i;
+
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	spin_lock_init(&c->c_lock);
+	for (i = 0; i < YUIHA_VTREE_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&c->c_vnode_hash[i]);
+		INIT_HLIST_HEAD(&c->c_vtree_hash[i]);
+	}
+	INIT_LIST_HEAD(&c->c_lru);
+	c->c_nr_nodes = 0;
+	c->c_seq = 0;
+
+	spin_lock(&yuiha_vtree_caches_lock);
+	list_add(&c->c_list, &yuiha_vtree_caches);
+	spin_unlock(&yuiha_vtree_caches_lock);
+	EXT3_SB(sb)->s_vtree = c;
+	return 0;
+}
+
+void yuiha_vtree_put_super(struct super_block *sb)
+{
+	struct yuiha_vtree_cache *c = EXT3_SB(sb)->s_vtree;
+	struct yuiha_vtree *tree, *next;
+
+	if (!c)
+		return;
+
+	spin_lock(&yuiha_vtree_caches_lock);
+	list_del(&c->c_list);
+	spin_unlock(&yuiha_vtree_caches_lock);
+
+	EXT3_SB(sb)->s_vtree = NULL;
+	list_for_each_entry_safe(tree, next, &c->c_lru, t_lru)
+		yuiha_vtree_drop_tree(c, tree);
+	kfree(c);
+}
+
+static int yuiha_vtree_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct yuiha_vtree_cache *c;
+	struct yuiha_vtree *tree;
+	int nr_nodes = 0;
+
+	spin_lock(&yuiha_vtree_caches_lock);
+	list_for_each_entry(c, &yuiha_vtree_caches, c_list) {
+		spin_lock(&c->c_lock);
+		while (nr_to_scan > 0 && !list_empty(&c->c_lru)) {
+			tree = list_entry(c->c_lru.prev,
+					struct yuiha_vtree, t_lru);
+			nr_to_scan -= tree->t_count;
+			yuiha_vtree_drop_tree(c, tree);
+		}
+		nr_nodes += c->c_nr_nodes;
+		spin_unlock(&c->c_lock);
+	}
+	spin_unlock(&yuiha_vtree_caches_lock);
+	return (nr_nodes / 100) * sysctl_vfs_cache_pressure;
+}
+
+static struct shrinker yuiha_vtree_shrinker = {
+	.shrink = yuiha_vtree_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int __init init_yuiha_vtree(void)
+{
+	yuiha_vnode_cachep = kmem_cache_create("yuiha_vtree_node",
+					sizeof(struct yuiha_vtree_node),
+					0, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!yuiha_vnode_cachep)
+		return -ENOMEM;
+	register_shrinker(&yuiha_vtree_shrinker);
+	return 0;
+}
+
+void exit_yuiha_vtree(void)
+{
+	unregister_shrinker(&yuiha_vtree_shrinker);
+	kmem_cache_destroy(yuiha_vnode_cachep);
+}
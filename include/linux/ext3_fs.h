@@ -60,6 +60,7 @@
 #define EXT3_UNDEL_DIR_INO	 6	/* Undelete directory inode */
 #define EXT3_RESIZE_INO		 7	/* Reserved group descriptors inode */
 #define EXT3_JOURNAL_INO	 8	/* Journal inode */
+#define EXT3_YUIHA_REFCOUNT_INO	 9	/* Block reference map inode */
 
 /* First non-reserved inode for old ext3 filesystems */
 #define EXT3_GOOD_OLD_FIRST_INO	11
@@ -177,10 +178,13 @@ struct ext3_group_desc
 #define YUIHA_PHANTOM_VERSION_FL	0x00100000 /* Phantom version */
 #define YUIHA_ROOT_VERSION_FL		0x00200000 /* root version */
 #define YUIHA_PHANTOM_ROOT_VERSION_FL	0x00400000 /* phantom root version */
+#define YUIHA_PLAIN_FL			0x00800000 /* never versioned, no producer bits */
+#define YUIHA_TEARDOWN_FL		0x02000000 /* version tree being freed whole */
+#define YUIHA_PINNED_FL			0x04000000 /* version kept by pruning */
 #define EXT3_RESERVED_FL		0x80000000 /* reserved for ext3 lib */
 
-#define EXT3_FL_USER_VISIBLE		0x0003DFFF /* User visible flags */
-#define EXT3_FL_USER_MODIFIABLE		0x000380FF /* User modifiable flags */
+#define EXT3_FL_USER_VISIBLE		0x0403DFFF /* User visible flags */
+#define EXT3_FL_USER_MODIFIABLE		0x040380FF /* User modifiable flags */
 
 /* Flags that should be inherited by new inodes from their parent. */
 #define EXT3_FL_INHERITED (EXT3_SECRM_FL | EXT3_UNRM_FL | EXT3_COMPR_FL |\
@@ -213,6 +217,7 @@ static inline __u32 ext3_mask_flags(umode_t mode, __u32 flags)
 #define EXT3_STATE_NEW			0x00000002 /* inode is newly created */
 #define EXT3_STATE_XATTR		0x00000004 /* has in-inode xattrs */
 #define EXT3_STATE_FLUSH_ON_CLOSE	0x00000008
+#define EXT3_STATE_YUIHA_RECLAIM	0x00000010 /* queued for reclaim */
 
 /* Used to pass group descriptor data when online resize is done */
 struct ext3_new_group_input {
@@ -237,6 +242,173 @@ struct ext3_new_group_data {
 	__u32 free_blocks_count;
 };
 
+/* Used to version a set of files in one transaction */
+struct yuiha_snapshot_set {
+	__u32 count;		/* Number of entries in fds and inos */
+	__u32 reserved;
+	__u64 fds;		/* User pointer to __s32[count] */
+	__u64 inos;		/* User pointer to __u32[count], filled in */
+};
+
+/*
+ * Lockdep tells no more i_mutex of a kind apart.  A set larger than one
+ * journal transaction takes fails with E2BIG.
+ */
+#define YUIHA_SNAPSHOT_SET_MAX	8
+
+/* Progress of the background reclaim of deleted versions */
+struct yuiha_reclaim_stats {
+	__u32 pending;		/* Deleted versions not reclaimed yet */
+	__u32 rate;		/* reclaim_rate in blocks/s, 0 is unlimited */
+	__u64 versions;		/* Versions reclaimed since mount */
+	__u64 blocks;		/* Blocks freed by the reclaim since mount */
+};
+
+/* Retention policy applied by YUIHA_IOC_PRUNE */
+struct yuiha_prune {
+	__u32 keep_last;	/* Newest versions kept */
+	__u32 keep_hourly;	/* Newest version of each of the last N hours */
+	__u32 keep_daily;	/* Newest version of each of the last N days */
+	__u32 flags;		/* YUIHA_PRUNE_* */
+	__u64 max_bytes;	/* Space the versions may take, 0 is no cap */
+	__u32 pruned;		/* Versions deleted, filled in */
+	__u32 reserved;
+};
+
+#define YUIHA_PRUNE_KEEP_PINNED	0x0001	/* Never delete YUIHA_PINNED_FL */
+#define YUIHA_PRUNE_DRY_RUN	0x0002	/* Only count what would go */
+#define YUIHA_PRUNE_FLAGS	(YUIHA_PRUNE_KEEP_PINNED | YUIHA_PRUNE_DRY_RUN)
+
+/* Delete the versions between the file's version and an ancestor */
+struct yuiha_squash {
+	__u32 ino;		/* The ancestor, kept */
+	__u32 generation;
+	__u32 flags;		/* None yet */
+	__u32 squashed;		/* Versions deleted, filled in */
+};
+
+/* One version as reported by YUIHA_IOC_GET_VTREE */
+struct yuiha_vtree_rec {
+	__u32 ino;
+	__u32 generation;
+	__u32 parent;		/* 0 for the top of the tree */
+	__u32 depth;		/* Levels below the top */
+	__u32 flags;		/* ext3 i_flags */
+	__u32 mtime;
+	__u64 size;
+	__u64 exclusive;	/* Blocks the version owns */
+	__u64 shared;		/* Blocks it maps from other versions */
+};
+
+/* Fill recs with the whole tree, a page at a time */
+struct yuiha_get_vtree {
+	__u64 cookie;		/* 0 to start, filled in, 0 again at the end */
+	__u64 recs;		/* User pointer to struct yuiha_vtree_rec[count] */
+	__u32 count;		/* Room in recs */
+	__u32 filled;		/* Records filled in */
+	__u32 flags;		/* YUIHA_VTREE_* */
+	__u32 reserved;
+};
+
+#define YUIHA_VTREE_BLOCKS	0x0001	/* Count exclusive and shared blocks */
+#define YUIHA_VTREE_FLAGS	YUIHA_VTREE_BLOCKS
+#define YUIHA_VTREE_MAX		1024	/* Records per call */
+
+/* Logical blocks, in filesystem blocks, mapped differently */
+struct yuiha_diff_range {
+	__u64 start;
+	__u64 len;
+};
+
+/* Fill ranges with where another version of the tree differs */
+struct yuiha_diff {
+	__u64 cookie;		/* 0 to start, filled in, 0 again at the end */
+	__u64 ranges;		/* User pointer to struct yuiha_diff_range[count] */
+	__u32 ino;		/* The other version */
+	__u32 generation;
+	__u32 count;		/* Room in ranges */
+	__u32 filled;		/* Ranges filled in */
+	__u32 blocksize;	/* Filled in */
+	__u32 reserved;
+};
+
+#define YUIHA_DIFF_MAX		1024	/* Ranges per call */
+
+/* Write a replication stream of the version to fd */
+struct yuiha_send {
+	__s32 fd;		/* Open for writing */
+	__u32 flags;		/* None yet */
+	__u32 base_ino;		/* 0 for a full stream */
+	__u32 base_generation;
+	__u64 bytes;		/* Filled in */
+};
+
+/* Apply a replication stream read from fd to the file */
+struct yuiha_receive {
+	__s32 fd;		/* Open for reading */
+	__u32 flags;		/* None yet */
+	__u64 bytes;		/* Filled in */
+};
+
+/* Write the whole tree to fd, or rebuild it from there */
+struct yuiha_dump {
+	__s32 fd;
+	__u32 flags;		/* None yet */
+	__u32 versions;		/* Filled in */
+	__u32 reserved;
+	__u64 bytes;		/* Filled in */
+};
+
+/* Look a version of the tree up in its index */
+struct yuiha_find_version {
+	__u64 seq;		/* Sequence number, filled in */
+	__u32 time;		/* Or the newest created at or before, filled in */
+	__u32 flags;		/* YUIHA_FIND_* */
+	__u32 ino;		/* Filled in */
+	__u32 generation;	/* Filled in */
+};
+
+#define YUIHA_FIND_SEQ		0x0001	/* Find by seq */
+#define YUIHA_FIND_TIME		0x0002	/* Find by time */
+
+/* Tag a version of the tree, or look a tag up */
+#define YUIHA_TAG_LEN		64
+
+struct yuiha_tag {
+	char name[YUIHA_TAG_LEN];	/* NUL-terminated */
+	__u32 flags;		/* YUIHA_TAG_* */
+	__u32 ino;		/* Filled in by YUIHA_IOC_LOOKUP_TAG */
+	__u32 generation;	/* Filled in by YUIHA_IOC_LOOKUP_TAG */
+	__u32 reserved;
+};
+
+#define YUIHA_TAG_MOVE		0x0001	/* Move the tag from another version */
+#define YUIHA_TAG_REMOVE	0x0002	/* Remove the tag */
+#define YUIHA_TAG_FLAGS		(YUIHA_TAG_MOVE | YUIHA_TAG_REMOVE)
+
+/* Open another version of the tree, returns the new fd */
+struct yuiha_open_version {
+	__u32 how;		/* YUIHA_OPEN_* */
+	__u32 flags;		/* O_ACCMODE, O_APPEND, O_NONBLOCK, O_CLOEXEC */
+	__u32 ino;		/* YUIHA_OPEN_INO, filled in */
+	__u32 generation;	/* YUIHA_OPEN_INO, filled in */
+	__u32 nr;		/* Levels up, or which child */
+	__u32 reserved;
+};
+
+#define YUIHA_OPEN_INO		1	/* By ino and generation */
+#define YUIHA_OPEN_ANCESTOR	2	/* nr levels up */
+#define YUIHA_OPEN_CHILD	3	/* The nr-th child, 0 the first */
+
+/* Make a version the head of the name the file is open by */
+struct yuiha_promote {
+	__u32 ino;		/* The version */
+	__u32 generation;
+	__u32 head_ino;		/* Filled in */
+	__u32 head_generation;	/* Filled in */
+	__u32 flags;		/* None yet */
+	__u32 reserved;
+};
 
 /*
  * ioctl commands
@@ -257,6 +429,21 @@ struct ext3_new_group_data {
 #define YUIHA_IOC_DEL_VERSION		_IOWR('f', 9, unsigned long)
 #define YUIHA_IOC_LINK_VERSION	_IOW('f', 10, char __user *)
 #define YUIHA_IOC_GET_ROOT	_IOR('f', 11, unsigned int)
+#define YUIHA_IOC_SNAPSHOT_SET	_IOWR('f', 12, struct yuiha_snapshot_set)
+#define YUIHA_IOC_RECLAIM_STATS	_IOR('f', 13, struct yuiha_reclaim_stats)
+#define YUIHA_IOC_PRUNE		_IOWR('f', 14, struct yuiha_prune)
+#define YUIHA_IOC_GET_VTREE	_IOWR('f', 15, struct yuiha_get_vtree)
+#define YUIHA_IOC_FIND_VERSION	_IOWR('f', 16, struct yuiha_find_version)
+#define YUIHA_IOC_TAG		_IOW('f', 17, struct yuiha_tag)
+#define YUIHA_IOC_LOOKUP_TAG	_IOWR('f', 18, struct yuiha_tag)
+#define YUIHA_IOC_OPEN_VERSION	_IOWR('f', 19, struct yuiha_open_version)
+#define YUIHA_IOC_DIFF		_IOWR('f', 20, struct yuiha_diff)
+#define YUIHA_IOC_SEND		_IOWR('f', 21, struct yuiha_send)
+#define YUIHA_IOC_RECEIVE	_IOWR('f', 22, struct yuiha_receive)
+#define YUIHA_IOC_DUMP		_IOWR('f', 23, struct yuiha_dump)
+#define YUIHA_IOC_RESTORE	_IOWR('f', 24, struct yuiha_dump)
+#define YUIHA_IOC_PROMOTE	_IOWR('f', 25, struct yuiha_promote)
+#define YUIHA_IOC_SQUASH	_IOWR('f', 26, struct yuiha_squash)
 
 /*
  * ioctl commands in 32 bit emulation
@@ -283,6 +470,7 @@ struct ext3_mount_options {
 	uid_t s_resuid;
 	gid_t s_resgid;
 	unsigned long s_commit_interval;
+	unsigned long s_reclaim_rate;
 #ifdef CONFIG_QUOTA
 	int s_jquota_fmt;
 	char *s_qf_names[MAXQUOTAS];
@@ -368,8 +556,25 @@ struct yuiha_inode {
 	__le32 i_phantom_root_ino;
 	// This member only used at root version
 	__le16 i_vtree_nlink;
+	__le16 i_tags;		// tags naming this version
+
+	// Only versions created by a snapshot have them, see yuiha_index.c
+	__le32 i_crtime;
+	__le64 i_seq;
+
+	// The version a replica was received from, see yuiha_send.c
+	__le64 i_origin_seq;
+	__le32 i_origin_crtime;
+	__le32 i_origin_reserved;
 };
 
+// The in-inode xattrs of a yuiha filesystem start behind the version links
+#define YUIHA_INODE_EXTRA_ISIZE \
+	(sizeof(struct yuiha_inode) - EXT3_GOOD_OLD_INODE_SIZE)
+// Inodes from before the origin fields end here
+#define YUIHA_INODE_EXTRA_ISIZE_V1 \
+	(offsetof(struct yuiha_inode, i_origin_seq) - EXT3_GOOD_OLD_INODE_SIZE)
+
 #define i_size_high	i_dir_acl
 
 #if defined(__KERNEL__) || defined(__linux__)
@@ -443,6 +648,8 @@ struct yuiha_inode {
 #define EXT3_MOUNT_GRPQUOTA		0x200000 /* "old" group quota */
 #define EXT3_MOUNT_DATA_ERR_ABORT	0x400000 /* Abort on file data write
 						  * error in ordered mode */
+#define EXT3_MOUNT_YUIHA_REFCOUNT	0x800000 /* Keep a block reference map */
+#define EXT3_MOUNT_YUIHA_FULLADDR	0x1000000 /* Convert to full block numbers */
 
 /* Compatibility, for having both ext2_fs.h and ext3_fs.h included at once */
 #ifndef _LINUX_EXT2_FS_H
@@ -566,7 +773,8 @@ struct ext3_super_block {
 	__u8	s_log_groups_per_flex;  /* FLEX_BG group size */
 	__u8	s_reserved_char_pad2;
 	__le16  s_reserved_pad;
-	__u32   s_reserved[162];        /* Padding to the end of the block */
+	__le32	s_yuiha_refcount_inum;	/* inode of the block reference map */
+	__u32   s_reserved[161];        /* Padding to the end of the block */
 };
 
 #ifdef __KERNEL__
@@ -591,6 +799,7 @@ static inline int ext3_valid_inum(struct super_block *sb, unsigned long ino)
 	return ino == EXT3_ROOT_INO ||
 		ino == EXT3_JOURNAL_INO ||
 		ino == EXT3_RESIZE_INO ||
+		ino == EXT3_YUIHA_REFCOUNT_INO ||
 		(ino >= EXT3_FIRST_INO(sb) &&
 		 ino <= le32_to_cpu(EXT3_SB(sb)->s_es->s_inodes_count));
 }
@@ -652,16 +861,19 @@ static inline int ext3_valid_inum(struct super_block *sb, unsigned long ino)
 #define EXT3_FEATURE_COMPAT_EXT_ATTR		0x0008
 #define EXT3_FEATURE_COMPAT_RESIZE_INODE	0x0010
 #define EXT3_FEATURE_COMPAT_DIR_INDEX		0x0020
+#define EXT3_FEATURE_COMPAT_YUIHA_VERSIONS	0x00010000 /* A version was created */
 
 #define EXT3_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT3_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
 #define EXT3_FEATURE_RO_COMPAT_BTREE_DIR	0x0004
+#define EXT3_FEATURE_RO_COMPAT_YUIHA_REFCOUNT	0x00020000 /* Block reference map */
 
 #define EXT3_FEATURE_INCOMPAT_COMPRESSION	0x0001
 #define EXT3_FEATURE_INCOMPAT_FILETYPE		0x0002
 #define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004 /* Needs recovery */
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008 /* Journal device */
 #define EXT3_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT3_FEATURE_INCOMPAT_YUIHA_FULLADDR	0x00010000 /* No producer bits */
 
 #define EXT3_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT3_FEATURE_INCOMPAT_SUPP	(EXT3_FEATURE_INCOMPAT_FILETYPE| \
@@ -898,6 +1110,8 @@ extern struct inode * ext3_orphan_get (struct super_block *, unsigned long);
 extern unsigned long ext3_count_free_inodes (struct super_block *);
 extern unsigned long ext3_count_dirs (struct super_block *);
 extern void ext3_check_inodes_bitmap (struct super_block *);
+extern struct buffer_head *ext3_read_inode_bitmap(struct super_block *,
+						  unsigned long);
 extern unsigned long ext3_count_free (struct buffer_head *, unsigned);
 
 
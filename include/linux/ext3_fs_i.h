@@ -20,6 +20,7 @@
 #include <linux/rbtree.h>
 #include <linux/seqlock.h>
 #include <linux/mutex.h>
+#include <linux/radix-tree.h>
 
 /* data type for block offset of block group */
 typedef int ext3_grpblk_t;
@@ -166,7 +167,40 @@ struct yuiha_inode_info {
 	__u32 i_phantom_root_ino;
 	__u16 i_vtree_nlink;
 
+	// position in the tree's version index and creation time, 0 if none
+	__u64 i_seq;
+	__u32 i_crtime;
+	__u16 i_tags;
+
+	// i_seq and i_crtime of the version a replica was received from
+	__u64 i_origin_seq;
+	__u32 i_origin_crtime;
+
+	/*
+	 * parent_inode holds a reference to the parent version while this
+	 * one is open.  It is set and dropped under i_share_mutex, which
+	 * also covers handing pages of this version over to the parent.
+	 */
 	struct inode *parent_inode;
+	struct mutex i_share_mutex;
+
+	/*
+	 * Bumped every time a snapshot of this inode is taken.  Cached
+	 * pages are checked against it lazily on their next write instead
+	 * of being walked at snapshot time; i_page_gen remembers which
+	 * pages below i_snapshot_size have been checked already.
+	 */
+	unsigned long i_snapshot_gen;
+	loff_t i_snapshot_size;
+	spinlock_t i_page_gen_lock;
+	struct radix_tree_root i_page_gen;
+
+	/*
+	 * The direct write in flight, under i_mutex: its byte range and the
+	 * blocks of it that were copied-on-write without their old data.
+	 */
+	loff_t i_dio_start, i_dio_end;
+	sector_t i_dio_nocopy_start, i_dio_nocopy_end;
 };
 
 #endif	/* _LINUX_EXT3_FS_I */
@@ -21,6 +21,7 @@
 #include <linux/wait.h>
 #include <linux/blockgroup_lock.h>
 #include <linux/percpu_counter.h>
+#include <linux/mutex.h>
 #endif
 #include <linux/rbtree.h>
 
@@ -83,6 +84,19 @@ struct ext3_sb_info {
 	int s_jquota_fmt;			/* Format of quota to use */
 #endif
 	int s_is_yuiha;
+
+	/* yuiha block reference map, NULL unless enabled */
+	struct inode *s_refcount_inode;
+	struct mutex s_refcount_mutex;
+	/* producer bit of stored block pointers, 0 in the fulladdr format */
+	__le32 s_producer_le;
+	/* background reclaim of deleted versions */
+	struct yuiha_reclaim *s_reclaim;
+	unsigned long s_reclaim_rate;	/* blocks per second, 0 unlimited */
+	/* serialises the version indexes of all trees */
+	struct mutex s_index_mutex;
+	/* version tree topology cache, see yuiha_vtree.c */
+	struct yuiha_vtree_cache *s_vtree;
 };
 
 static inline spinlock_t *
@@ -0,0 +1,91 @@
+#!/bin/bash
+
+#####################################################
+# Error Handling
+#####################################################
+
+# Cause an error
+# $1: Error message string
+function raise() {
+	echo $1 1>&2
+	return 1
+}
+
+err_buf=""
+function err() {
+  # Usage: trap 'err ${LINENO[0]} ${FUNCNAME[1]}' ERR
+  status=$?
+  lineno=$1
+  func_name=${2:-main}
+  err_str="ERROR: [`date +'%Y-%m-%d %H:%M:%S'`] ${SCRIPT}:${func_name}() \
+	  returned non-zero exit status ${status} at line ${lineno}"
+  echo ${err_str}
+  err_buf+=${err_str}
+}
+
+#####################################################
+# Initialization process
+#####################################################
+
+set -e -o pipefail
+trap 'err ${LINENO[0]} ${FUNCNAME[1]}' ERR
+
+readonly MOUNT_POINT=$1
+readonly YUIHA_UTIL_PATH=$2
+readonly TEST_TARGET_FILE="promote_test"
+readonly rw_block_size="4096"
+readonly rw_block_count="16"
+
+# _IOWR('f', 19, struct yuiha_open_version)
+readonly YUIHA_IOC_OPEN_VERSION=$((0xC0186613))
+readonly YUIHA_OPEN_ANCESTOR=2
+# _IOWR('f', 25, struct yuiha_promote)
+readonly YUIHA_IOC_PROMOTE=$((0xC0186619))
+
+if [ ! -d "${MOUNT_POINT}" ]; then
+	raise "${MOUNT_POINT} not found"
+fi
+
+if [ ! -x "${YUIHA_UTIL_PATH}" ]; then
+	raise "${YUIHA_UTIL_PATH} not found"
+fi
+
+# Promote the snapshot of the file and print the new head's ino
+# $1: File whose snapshot is promoted
+function promote_parent() {
+	python3 - "$1" ${YUIHA_IOC_OPEN_VERSION} ${YUIHA_OPEN_ANCESTOR} \
+		${YUIHA_IOC_PROMOTE} <<-'EOF'
+		import fcntl, os, struct, sys
+		path, open_ioc, ancestor, promote_ioc = sys.argv[1], \
+			*map(int, sys.argv[2:])
+		with open(path, "r+b") as f:
+		    # how, flags, ino, generation, nr, reserved
+		    arg = bytearray(struct.pack("<6I", ancestor, os.O_RDONLY,
+				0, 0, 1, 0))
+		    os.close(fcntl.ioctl(f, open_ioc, arg))
+		    ino, gen = struct.unpack("<6I", arg)[2:4]
+		    # ino, generation, head_ino, head_generation, flags, reserved
+		    arg = bytearray(struct.pack("<6I", ino, gen, 0, 0, 0, 0))
+		    fcntl.ioctl(f, promote_ioc, arg)
+		print(struct.unpack("<6I", arg)[2])
+	EOF
+}
+
+readonly target="${MOUNT_POINT}/${TEST_TARGET_FILE}"
+rm -f "${target}" "${target}.old"
+dd if=/dev/urandom of="${target}" bs=${rw_block_size} count=${rw_block_count}
+cp "${target}" "${target}.old"
+${YUIHA_UTIL_PATH} --snapshot="${target}"
+dd if=/dev/urandom of="${target}" \
+	bs=${rw_block_size} count=${rw_block_count} conv=notrunc
+
+# Opening the name again right after promoting has to get the new head
+echo "Promoting the snapshot of ${TEST_TARGET_FILE}"
+head_ino=$(promote_parent "${target}")
+if [ "$(stat -c %i "${target}")" -ne "${head_ino}" ]; then
+	raise "the name still resolves to the old head"
+fi
+if ! cmp -s "${target}" "${target}.old"; then
+	raise "reopening the name reads the old head's data"
+fi
+rm -f "${target}.old"
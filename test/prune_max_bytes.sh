@@ -0,0 +1,98 @@
+#!/bin/bash
+
+#####################################################
+# Error Handling
+#####################################################
+
+# Cause an error
+# $1: Error message string
+function raise() {
+	echo $1 1>&2
+	return 1
+}
+
+err_buf=""
+function err() {
+  # Usage: trap 'err ${LINENO[0]} ${FUNCNAME[1]}' ERR
+  status=$?
+  lineno=$1
+  func_name=${2:-main}
+  err_str="ERROR: [`date +'%Y-%m-%d %H:%M:%S'`] ${SCRIPT}:${func_name}() \
+	  returned non-zero exit status ${status} at line ${lineno}"
+  echo ${err_str}
+  err_buf+=${err_str}
+}
+
+#####################################################
+# Initialization process
+#####################################################
+
+set -e -o pipefail
+trap 'err ${LINENO[0]} ${FUNCNAME[1]}' ERR
+
+readonly MOUNT_POINT=$1
+readonly YUIHA_UTIL_PATH=$2
+readonly TEST_TARGET_FILE="prune_test"
+readonly rw_block_size="4096"
+readonly rw_block_count="64"
+readonly snapshot_count="4"
+# max_bytes lets the tree keep twice the file
+readonly max_bytes=$((2*rw_block_size*rw_block_count))
+
+# _IOWR('f', 14, struct yuiha_prune)
+readonly YUIHA_IOC_PRUNE=$((0xC020660E))
+readonly YUIHA_PRUNE_DRY_RUN=2
+
+if [ ! -d "${MOUNT_POINT}" ]; then
+	raise "${MOUNT_POINT} not found"
+fi
+
+if [ ! -x "${YUIHA_UTIL_PATH}" ]; then
+	raise "${YUIHA_UTIL_PATH} not found"
+fi
+
+# Print how many versions a dry run of the max_bytes cap would delete
+# $1: File whose tree is weighed
+function prune_dry_run() {
+	python3 - "$1" ${YUIHA_IOC_PRUNE} ${YUIHA_PRUNE_DRY_RUN} ${max_bytes} <<-'EOF'
+		import fcntl, struct, sys
+		path, ioc, flags, max_bytes = sys.argv[1], *map(int, sys.argv[2:])
+		# keep_last, keep_hourly, keep_daily, flags, max_bytes, pruned
+		arg = bytearray(struct.pack("<IIIIQII", 0, 0, 0, flags,
+				max_bytes, 0, 0))
+		with open(path, "rb") as f:
+		    fcntl.ioctl(f, ioc, arg)
+		print(struct.unpack("<IIIIQII", arg)[5])
+	EOF
+}
+
+# $1: File name
+# $2: Rewrite the file before every snapshot
+function make_versions() {
+	rm -f "${MOUNT_POINT}/$1"
+	dd if=/dev/urandom of="${MOUNT_POINT}/$1" \
+		bs=${rw_block_size} count=${rw_block_count}
+	for i in $(seq ${snapshot_count}); do
+		${YUIHA_UTIL_PATH} --snapshot="${MOUNT_POINT}/$1"
+		if [ "$2" = "rewrite" ]; then
+			dd if=/dev/urandom of="${MOUNT_POINT}/$1" \
+				bs=${rw_block_size} count=${rw_block_count} conv=notrunc
+		fi
+	done
+}
+
+# Versions that share every block take the space of one file
+echo "Weighing ${TEST_TARGET_FILE}_shared"
+make_versions "${TEST_TARGET_FILE}_shared"
+pruned=$(prune_dry_run "${MOUNT_POINT}/${TEST_TARGET_FILE}_shared")
+if [ "${pruned}" -ne 0 ]; then
+	raise "shared blocks counted per version: ${pruned} versions pruned"
+fi
+
+# Versions that own a copy each do not fit
+echo "Weighing ${TEST_TARGET_FILE}_owned"
+make_versions "${TEST_TARGET_FILE}_owned" rewrite
+pruned=$(prune_dry_run "${MOUNT_POINT}/${TEST_TARGET_FILE}_owned")
+if [ "${pruned}" -eq 0 ]; then
+	raise "versions over max_bytes kept"
+fi